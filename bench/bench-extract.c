@@ -0,0 +1,242 @@
+/* This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   in Version 2 as published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+  Speed of tar_extract() on a tar archive with N files of 16 KiB
+  (default 10000). The archive contains a directory relocated like
+  /etc of an image, a hard link and a symlink, which are checked
+  after the extraction. An archive with an entry leaving the
+  destination with ".." has to be rejected.
+
+  bench-extract [files]
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "tiu-internal.h"
+#include "tiu-tar.h"
+
+#define FILE_SIZE (16*1024)
+
+static gboolean
+add_entry (struct archive *out, const gchar *path, unsigned int type,
+	   const gchar *link, gsize size, const guint8 *data, GError **error)
+{
+  struct archive_entry *entry = archive_entry_new();
+  gboolean res = TRUE;
+
+  archive_entry_set_pathname(entry, path);
+  archive_entry_set_filetype(entry, type);
+  archive_entry_set_perm(entry, type == AE_IFDIR ? 0755 : 0644);
+  archive_entry_set_mtime(entry, 1700000000, 0);
+  if (type == AE_IFLNK)
+    archive_entry_set_symlink(entry, link);
+  else if (link)
+    archive_entry_set_hardlink(entry, link);
+  else
+    archive_entry_set_size(entry, size);
+
+  if (archive_write_header(out, entry) != ARCHIVE_OK ||
+      (size > 0 && link == NULL &&
+       archive_write_data(out, data, size) != (la_ssize_t)size))
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to add '%s': %s", path, archive_error_string(out));
+      res = FALSE;
+    }
+  archive_entry_free(entry);
+
+  return res;
+}
+
+static gboolean
+write_archive (const gchar *path, guint files, gboolean escape,
+	       GError **error)
+{
+  g_autofree guint8 *data = g_malloc(FILE_SIZE);
+  struct archive *out = archive_write_new();
+  gboolean res;
+
+  for (gsize i = 0; i < FILE_SIZE; i++)
+    data[i] = i * 7 + (i >> 12);
+
+  archive_write_set_format_pax_restricted(out);
+  if (archive_write_open_filename(out, path) != ARCHIVE_OK)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to create '%s': %s", path, archive_error_string(out));
+      archive_write_free(out);
+      return FALSE;
+    }
+
+  res = add_entry(out, "./", AE_IFDIR, NULL, 0, NULL, error) &&
+    add_entry(out, "./etc/", AE_IFDIR, NULL, 0, NULL, error) &&
+    add_entry(out, "./etc/os-release", AE_IFREG, NULL, 9,
+	      (const guint8 *)"ID=bench\n", error) &&
+    add_entry(out, "./usr/", AE_IFDIR, NULL, 0, NULL, error) &&
+    add_entry(out, "./usr/lib/", AE_IFDIR, NULL, 0, NULL, error) &&
+    add_entry(out, "./usr/lib64", AE_IFLNK, "lib", 0, NULL, error);
+
+  for (guint i = 0; res && i < files; i++)
+    {
+      g_autofree gchar *name = g_strdup_printf("./usr/lib/f%u", i);
+
+      res = add_entry(out, name, AE_IFREG, NULL, FILE_SIZE, data, error);
+    }
+
+  if (res)
+    res = add_entry(out, "./usr/lib/hardlink", AE_IFREG, "./usr/lib/f0",
+		    0, NULL, error);
+  if (res && escape)
+    res = add_entry(out, "./usr/../../escape", AE_IFREG, NULL, 9,
+		    (const guint8 *)"escaped\n", error);
+
+  if (archive_write_close(out) != ARCHIVE_OK && res)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to write '%s': %s", path, archive_error_string(out));
+      res = FALSE;
+    }
+  archive_write_free(out);
+
+  return res;
+}
+
+static gboolean
+check (gboolean ok, const gchar *what, GError **error)
+{
+  if (!ok)
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		"Extracted tree is wrong: %s", what);
+  return ok;
+}
+
+static gboolean
+check_tree (const gchar *dest, guint files, GError **error)
+{
+  g_autofree gchar *etc = g_build_filename(dest, "etc", NULL);
+  g_autofree gchar *os_release = g_build_filename(dest, "usr", "share",
+						  "factory", "etc",
+						  "os-release", NULL);
+  g_autofree gchar *first = g_build_filename(dest, "usr", "lib", "f0", NULL);
+  g_autofree gchar *last = g_strdup_printf("%s/usr/lib/f%u", dest, files - 1);
+  g_autofree gchar *hardlink = g_build_filename(dest, "usr", "lib",
+						"hardlink", NULL);
+  g_autofree gchar *symlink = g_build_filename(dest, "usr", "lib64", NULL);
+  g_autofree gchar *target = g_file_read_link(symlink, NULL);
+  struct stat st1, st2;
+
+  return check(!g_file_test(etc, G_FILE_TEST_EXISTS),
+	       "etc was not relocated", error) &&
+    check(g_file_test(os_release, G_FILE_TEST_IS_REGULAR),
+	  "usr/share/factory/etc/os-release is missing", error) &&
+    check(g_stat(last, &st1) == 0 && st1.st_size == FILE_SIZE,
+	  "file is missing or has the wrong size", error) &&
+    check(g_stat(first, &st1) == 0 && g_stat(hardlink, &st2) == 0 &&
+	  st1.st_ino == st2.st_ino, "hard link is broken", error) &&
+    check(target && strcmp(target, "lib") == 0, "symlink is broken", error);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autofree gchar *tmp = NULL;
+  g_autofree gchar *archive = NULL;
+  g_autofree gchar *bad = NULL;
+  g_autofree gchar *dest = NULL;
+  g_autofree gchar *escape = NULL;
+  GError *error = NULL;
+  guint64 files = 10000;
+  gint64 start;
+  gdouble secs;
+  int rc = 1;
+
+  if (argc > 1)
+    files = g_ascii_strtoull(argv[1], NULL, 10);
+  if (files == 0 || files > G_MAXUINT)
+    {
+      g_fprintf(stderr, "Usage: %s [files]\n", argv[0]);
+      return 1;
+    }
+
+  tmp = g_dir_make_tmp("tiu-bench-extract-XXXXXX", &error);
+  if (tmp == NULL)
+    goto out;
+  archive = g_build_filename(tmp, "image.tar", NULL);
+  bad = g_build_filename(tmp, "bad.tar", NULL);
+  dest = g_build_filename(tmp, "root", NULL);
+  escape = g_build_filename(tmp, "escape", NULL);
+
+  if (!write_archive(archive, files, FALSE, &error) ||
+      !write_archive(bad, 1, TRUE, &error))
+    goto out;
+  if (g_mkdir(dest, 0755) < 0)
+    {
+      int err = errno;
+      g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", dest, g_strerror(err));
+      goto out;
+    }
+
+  start = g_get_monotonic_time();
+  if (!tar_extract(archive, dest, "etc", "usr/share/factory/etc", &error))
+    goto out;
+  secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+  if (!check_tree(dest, files, &error))
+    goto out;
+
+  /* the content of the tar archive must not leave dest */
+  if (tar_extract(bad, dest, NULL, NULL, &error) ||
+      g_file_test(escape, G_FILE_TEST_EXISTS))
+    {
+      g_clear_error(&error);
+      g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Entry with \"..\" was extracted");
+      goto out;
+    }
+  g_clear_error(&error);
+
+  g_printf("%-10s %10s %12s %12s\n", "files", "seconds", "files/s", "MiB/s");
+  g_printf("%-10" G_GUINT64_FORMAT " %10.3f %12.0f %12.1f\n", files, secs,
+	   secs > 0 ? files / secs : 0.0,
+	   secs > 0 ? files * FILE_SIZE / secs / (1024*1024) : 0.0);
+  rc = 0;
+
+ out:
+  if (error)
+    {
+      g_fprintf(stderr, "ERROR: %s\n", error->message);
+      g_clear_error(&error);
+    }
+  if (tmp)
+    {
+      g_autoptr(GFile) dir = g_file_new_for_path(tmp);
+
+      if (!rm_rf(dir, NULL, &error))
+	{
+	  g_fprintf(stderr, "ERROR: %s\n", error->message);
+	  g_clear_error(&error);
+	}
+    }
+
+  return rc;
+}
@@ -0,0 +1,287 @@
+/* This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   in Version 2 as published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+  Throughput of swupdate_deploy() for different feed_chunk_size
+  values. A fake swupdate listens on the IPC socket in a temporary
+  $TMPDIR: it acknowledges the install request, reads the archive to
+  the end and reports success on the next status request. The
+  archive (default 256 MiB) stays in the page cache, so the numbers
+  are the cost of the read-ahead thread, the ring buffer and the IPC
+  round trips per chunk.
+
+  bench-feeder [size in MiB]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+
+#include <network_ipc.h>
+
+#include "tiu-internal.h"
+#include "tiu-swupdate.h"
+
+/* Name of the control socket of swupdate below $TMPDIR */
+#define SWUPDATE_SOCKET "sockinstctrl"
+
+#define BUF_SIZE (1024*1024)
+
+static const gsize chunk_sizes[] = {
+  4*1024, 16*1024, 64*1024, 256*1024, 1024*1024, 4*1024*1024,
+  16*1024*1024,
+};
+
+typedef struct {
+  int listen_fd;
+  guint64 received;  /* archive size of the last install request */
+} FakeSwupdate;
+
+static gboolean
+read_all (int fd, void *data, gsize len)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = read(fd, (guint8 *)data + done, len - done);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return FALSE;
+      done += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_all (int fd, const void *data, gsize len)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = write(fd, (const guint8 *)data + done, len - done);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return FALSE;
+      done += n;
+    }
+
+  return TRUE;
+}
+
+/* One connection per request, like swupdate: an install request is
+   followed by the archive, the client closes the socket at its end. */
+static gpointer
+server_thread (gpointer data)
+{
+  FakeSwupdate *fs = data;
+  g_autofree guint8 *buf = g_malloc(BUF_SIZE);
+
+  for (;;)
+    {
+      ipc_message msg;
+      int fd = accept4(fs->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+      if (fd < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  /* listen socket was shut down */
+	  break;
+	}
+
+      if (!read_all(fd, &msg, sizeof(msg)))
+	{
+	  close(fd);
+	  continue;
+	}
+
+      if (msg.type == GET_STATUS)
+	{
+	  memset(&msg.data, 0, sizeof(msg.data));
+	  msg.data.status.current = IDLE;
+	  msg.data.status.last_result = SUCCESS;
+	  write_all(fd, &msg, sizeof(msg));
+	}
+      else
+	{
+	  guint64 received = 0;
+	  ssize_t n;
+
+	  memset(&msg.data, 0, sizeof(msg.data));
+	  msg.type = ACK;
+	  if (write_all(fd, &msg, sizeof(msg)))
+	    while ((n = read(fd, buf, BUF_SIZE)) != 0)
+	      {
+		if (n < 0 && errno == EINTR)
+		  continue;
+		if (n < 0)
+		  break;
+		received += n;
+	      }
+	  /* set before the status request of the client is answered */
+	  fs->received = received;
+	}
+      close(fd);
+    }
+
+  return NULL;
+}
+
+static gboolean
+fake_swupdate_start (FakeSwupdate *fs, const gchar *dir, GError **error)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  g_snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/" SWUPDATE_SOCKET, dir);
+
+  fs->listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fs->listen_fd < 0 ||
+      bind(fs->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fs->listen_fd, 4) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to listen on '%s': %s", addr.sun_path,
+		  g_strerror(err));
+      if (fs->listen_fd >= 0)
+	close(fs->listen_fd);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_archive (const gchar *path, guint64 size, GError **error)
+{
+  g_autofree guint8 *buf = g_malloc(BUF_SIZE);
+  guint64 done = 0;
+  gboolean res;
+  int fd;
+
+  for (gsize i = 0; i < BUF_SIZE; i++)
+    buf[i] = i * 7 + (i >> 12);
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  res = (fd >= 0);
+  while (res && done < size)
+    {
+      gsize len = MIN(BUF_SIZE, size - done);
+
+      res = write_all(fd, buf, len);
+      done += len;
+    }
+  if (!res)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to write '%s': %s", path, g_strerror(err));
+    }
+  if (fd >= 0)
+    close(fd);
+
+  return res;
+}
+
+int
+main (int argc, char **argv)
+{
+  FakeSwupdate fs = {0};
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *archive = NULL;
+  g_autofree gchar *socket_path = NULL;
+  GThread *server;
+  GError *error = NULL;
+  guint64 size = 256;
+  int rc = 0;
+
+  if (argc > 1)
+    size = g_ascii_strtoull(argv[1], NULL, 10);
+  if (size == 0)
+    {
+      g_fprintf(stderr, "Usage: %s [size in MiB]\n", argv[0]);
+      return 1;
+    }
+  size *= 1024*1024;
+
+  /* libswupdate looks for the socket of swupdate in $TMPDIR */
+  dir = g_dir_make_tmp("tiu-bench-feeder-XXXXXX", &error);
+  if (dir == NULL)
+    goto fail;
+  g_setenv("TMPDIR", dir, TRUE);
+  g_setenv("RUNTIME_DIRECTORY", dir, TRUE);
+  socket_path = g_build_filename(dir, SWUPDATE_SOCKET, NULL);
+  archive = g_build_filename(dir, "archive.swu", NULL);
+
+  if (!write_archive(archive, size, &error) ||
+      !fake_swupdate_start(&fs, dir, &error))
+    goto fail;
+  server = g_thread_new("fake-swupdate", server_thread, &fs);
+
+  g_printf("%-12s %12s\n", "chunk(KiB)", "feed(MiB/s)");
+  for (guint i = 0; i < G_N_ELEMENTS(chunk_sizes); i++)
+    {
+      gint64 start;
+      gdouble secs;
+
+      feed_chunk_size = chunk_sizes[i];
+      fs.received = 0;
+      start = g_get_monotonic_time();
+      if (!swupdate_deploy(archive, NULL, NULL, &error))
+	break;
+      secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      if (fs.received != size)
+	{
+	  g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Fake swupdate received %" G_GUINT64_FORMAT
+		      " of %" G_GUINT64_FORMAT " bytes",
+		      fs.received, size);
+	  break;
+	}
+      g_printf("%-12" G_GSIZE_FORMAT " %12.1f\n", chunk_sizes[i] / 1024,
+	       secs > 0 ? size / secs / (1024*1024) : 0.0);
+    }
+
+  shutdown(fs.listen_fd, SHUT_RDWR);
+  g_thread_join(server);
+  close(fs.listen_fd);
+
+ fail:
+  if (error)
+    {
+      g_fprintf(stderr, "ERROR: %s\n", error->message);
+      g_clear_error(&error);
+      rc = 1;
+    }
+  if (archive)
+    g_remove(archive);
+  if (socket_path)
+    g_remove(socket_path);
+  if (dir)
+    g_rmdir(dir);
+
+  return rc;
+}
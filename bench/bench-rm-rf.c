@@ -0,0 +1,202 @@
+/* This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   in Version 2 as published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+  Speed of rm_rf() on a tree with N files in M directories (default
+  100000 files in 1000 directories, 100 directories per parent). The
+  tree contains symlinks to a directory and a file outside of it,
+  which have to survive the removal.
+
+  bench-rm-rf [files] [directories]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+
+#include "tiu-internal.h"
+
+/* Number of directories per parent directory */
+#define DIRS_PER_PARENT 100
+
+static gboolean
+set_errno_error (GError **error, const gchar *what, const gchar *path)
+{
+  int err = errno;
+
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+	      "Failed to %s '%s': %s", what, path, g_strerror(err));
+  return FALSE;
+}
+
+static gboolean
+create_file (const gchar *path, GError **error)
+{
+  int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+
+  if (fd < 0)
+    return set_errno_error(error, "create", path);
+  close(fd);
+
+  return TRUE;
+}
+
+static gchar *
+dir_path (const gchar *top, guint i)
+{
+  return g_strdup_printf("%s/g%u/d%u", top, i / DIRS_PER_PARENT, i);
+}
+
+/* Directory i is top/g<i/100>/d<i>, the files are distributed round
+   robin. Returns the number of created entries in @entries. */
+static gboolean
+create_tree (const gchar *top, const gchar *outside, guint64 files,
+	     guint dirs, guint64 *entries, GError **error)
+{
+  g_autofree gchar *link = NULL;
+
+  *entries = 0;
+  if (g_mkdir(top, 0755) < 0)
+    return set_errno_error(error, "create", top);
+
+  for (guint i = 0; i < dirs; i++)
+    {
+      g_autofree gchar *path = dir_path(top, i);
+
+      if (i % DIRS_PER_PARENT == 0)
+	{
+	  g_autofree gchar *parent = g_path_get_dirname(path);
+
+	  if (g_mkdir(parent, 0755) < 0)
+	    return set_errno_error(error, "create", parent);
+	  (*entries)++;
+	}
+      if (g_mkdir(path, 0755) < 0)
+	return set_errno_error(error, "create", path);
+      (*entries)++;
+    }
+
+  for (guint64 i = 0; i < files; i++)
+    {
+      g_autofree gchar *dir = dir_path(top, i % dirs);
+      g_autofree gchar *path = g_strdup_printf("%s/f%" G_GUINT64_FORMAT,
+					       dir, i);
+
+      if (!create_file(path, error))
+	return FALSE;
+      (*entries)++;
+    }
+
+  /* rm_rf() must remove the links, not what they point to */
+  link = g_build_filename(top, "g0", "outside", NULL);
+  if (symlink(outside, link) < 0)
+    return set_errno_error(error, "create", link);
+  g_free(link);
+  link = g_build_filename(top, "g0", "d0", "keep", NULL);
+  if (symlink("../../../outside/keep", link) < 0)
+    return set_errno_error(error, "create", link);
+  *entries += 2;
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autofree gchar *tmp = NULL;
+  g_autofree gchar *top = NULL;
+  g_autofree gchar *outside = NULL;
+  g_autofree gchar *keep = NULL;
+  g_autoptr(GFile) file = NULL;
+  GError *error = NULL;
+  guint64 files = 100000;
+  guint64 dirs = 1000;
+  guint64 entries;
+  gint64 start;
+  gdouble secs;
+  int rc = 1;
+
+  if (argc > 1)
+    files = g_ascii_strtoull(argv[1], NULL, 10);
+  if (argc > 2)
+    dirs = g_ascii_strtoull(argv[2], NULL, 10);
+  if (dirs == 0 || dirs > G_MAXUINT)
+    {
+      g_fprintf(stderr, "Usage: %s [files] [directories]\n", argv[0]);
+      return 1;
+    }
+
+  tmp = g_dir_make_tmp("tiu-bench-rm-rf-XXXXXX", &error);
+  if (tmp == NULL)
+    goto out;
+  top = g_build_filename(tmp, "tree", NULL);
+  outside = g_build_filename(tmp, "outside", NULL);
+  keep = g_build_filename(outside, "keep", NULL);
+
+  if (g_mkdir(outside, 0755) < 0)
+    {
+      set_errno_error(&error, "create", outside);
+      goto out;
+    }
+  if (!create_file(keep, &error) ||
+      !create_tree(top, outside, files, dirs, &entries, &error))
+    goto out;
+  /* do not measure the writeback of the new tree */
+  sync();
+
+  file = g_file_new_for_path(top);
+  start = g_get_monotonic_time();
+  if (!rm_rf(file, NULL, &error))
+    goto out;
+  secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+  if (g_file_test(top, G_FILE_TEST_EXISTS))
+    {
+      g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "'%s' still exists", top);
+      goto out;
+    }
+  if (!g_file_test(keep, G_FILE_TEST_IS_REGULAR))
+    {
+      g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "rm_rf() followed a symlink, '%s' is gone", keep);
+      goto out;
+    }
+
+  g_printf("%-10s %10s %12s\n", "entries", "seconds", "entries/s");
+  g_printf("%-10" G_GUINT64_FORMAT " %10.3f %12.0f\n", entries, secs,
+	   secs > 0 ? entries / secs : 0.0);
+  rc = 0;
+
+ out:
+  if (error)
+    {
+      g_fprintf(stderr, "ERROR: %s\n", error->message);
+      g_clear_error(&error);
+    }
+  if (tmp)
+    {
+      /* the outside directory and leftovers of a failed run */
+      g_autoptr(GFile) dir = g_file_new_for_path(tmp);
+
+      if (!rm_rf(dir, NULL, &error))
+	{
+	  g_fprintf(stderr, "ERROR: %s\n", error->message);
+	  g_clear_error(&error);
+	}
+    }
+
+  return rc;
+}
@@ -0,0 +1,133 @@
+/* This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   in Version 2 as published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+  Throughput of the dm-verity hash tree generation on 1, 2, 4, ...
+  up to all cores. The image is a temporary file with random data
+  (default 512 MiB), it stays in the page cache, so the numbers are
+  the hashing speed and not the disk speed.
+
+  bench-verity [size in MiB]
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+
+#include "verity_hash.h"
+
+static gboolean
+write_image (int fd, guint64 size, GError **error)
+{
+  g_autofree guint32 *buf = g_malloc(VERITY_READ_SIZE);
+  GRand *rand = g_rand_new_with_seed(42);
+  guint64 done = 0;
+
+  while (done < size)
+    {
+      gsize len = MIN(VERITY_READ_SIZE, size - done);
+
+      for (gsize i = 0; i < len / sizeof(guint32); i++)
+	buf[i] = g_rand_int(rand);
+      if (write(fd, buf, len) != (ssize_t)len)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to write test image: %s", g_strerror(err));
+	  g_rand_free(rand);
+	  return FALSE;
+	}
+      done += len;
+    }
+
+  g_rand_free(rand);
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  guint8 salt[VERITY_SALT_SIZE] = {0};
+  guint8 hash[VERITY_DIGEST_SIZE];
+  guint8 first[VERITY_DIGEST_SIZE];
+  guint max = g_get_num_processors();
+  g_autofree gchar *image = NULL;
+  GError *error = NULL;
+  guint64 size = 512;
+  guint64 blocks;
+  int fd;
+
+  if (argc > 1)
+    size = g_ascii_strtoull(argv[1], NULL, 10);
+  if (size == 0)
+    {
+      g_fprintf(stderr, "Usage: %s [size in MiB]\n", argv[0]);
+      return 1;
+    }
+  size *= 1024*1024;
+  blocks = size / VERITY_BLOCK_SIZE;
+
+  fd = g_file_open_tmp("tiu-bench-verity-XXXXXX", &image, &error);
+  if (fd < 0 || !write_image(fd, size, &error))
+    {
+      g_fprintf(stderr, "ERROR: %s\n", error->message);
+      g_clear_error(&error);
+      if (fd >= 0)
+	{
+	  close(fd);
+	  g_remove(image);
+	}
+      return 1;
+    }
+
+  /* warm up the page cache */
+  if (!verity_hash_fd(fd, blocks, salt, max, first, NULL, NULL, &error))
+    goto fail;
+
+  g_printf("%-8s %12s\n", "cores", "verity(GiB/s)");
+  for (guint n = 1; ; n = MIN(n * 2, max))
+    {
+      gint64 start = g_get_monotonic_time();
+      gdouble secs;
+
+      if (!verity_hash_fd(fd, blocks, salt, n, hash, NULL, NULL, &error))
+	goto fail;
+      secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      if (memcmp(hash, first, sizeof(hash)) != 0)
+	{
+	  g_fprintf(stderr, "ERROR: root hash with %u cores differs\n", n);
+	  close(fd);
+	  g_remove(image);
+	  return 1;
+	}
+
+      g_printf("%-8u %12.2f\n", n,
+	       secs > 0 ? size / secs / (1024*1024*1024) : 0.0);
+      if (n == max)
+	break;
+    }
+
+  close(fd);
+  g_remove(image);
+  return 0;
+
+ fail:
+  g_fprintf(stderr, "ERROR: %s\n", error->message);
+  g_clear_error(&error);
+  close(fd);
+  g_remove(image);
+  return 1;
+}
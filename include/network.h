@@ -2,6 +2,8 @@
 
 #include <glib.h>
 
+#include "tiu-ringbuf.h"
+
 /**
  * Network initalization routine.
  *
@@ -14,7 +16,73 @@
 gboolean network_init(GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
-gboolean download_file(const gchar *target, const gchar *url, goffset limit, GError **error)
+/**
+ * Download @url into the file @target.
+ *
+ * If @sha256sum is set, the data gets hashed while it arrives and the
+ * download fails if the checksum does not match. @target is only
+ * created if the download was complete and correct.
+ *
+ * @param target file to create
+ * @param url location to download from
+ * @param sha256sum expected SHA256 checksum as hex string, or NULL
+ * @param limit maximum number of bytes to download, 0 for no limit
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if succeeded, FALSE if failed
+ */
+gboolean download_file(const gchar *target, const gchar *url, const gchar *sha256sum,
+		       goffset limit, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Download @url into a ring buffer instead of a file.
+ *
+ * Blocks until the transfer is finished. @ring is closed at the end,
+ * marked as failed if the transfer did not succeed. If @sha256sum is
+ * set, the end of the data is only written to @ring after the
+ * checksum of the whole stream matched.
+ *
+ * @param url location to download from
+ * @param sha256sum expected SHA256 checksum as hex string, or NULL
+ * @param limit maximum number of bytes to download, 0 for no limit
+ * @param ring ring buffer read by the consumer
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if succeeded, FALSE if failed
+ */
+gboolean download_stream(const gchar *url, const gchar *sha256sum, goffset limit,
+			 TIURingBuf *ring, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Download a list of small files over one connection.
+ *
+ * @param urls NULL terminated list of locations to download from
+ * @param targets files to create, one for every entry of @urls
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if all files were downloaded, FALSE if failed
+ */
+gboolean download_files(const gchar * const *urls, const gchar * const *targets,
+			GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Download @len bytes at @offset of @url into @buf.
+ *
+ * Fails if the server does not support byte ranges.
+ *
+ * @param url location to download from
+ * @param offset first byte to download
+ * @param buf buffer for the data
+ * @param len number of bytes to download
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if succeeded, FALSE if failed
+ */
+gboolean download_range(const gchar *url, guint64 offset, guint8 *buf, gsize len,
+			GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
 gboolean is_remote_scheme (const gchar *scheme) G_GNUC_WARN_UNUSED_RESULT;
@@ -0,0 +1,43 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <glib.h>
+
+#include "tiu-topology.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BOOT_DIR "/boot"
+#define ESP_DIR "/boot/efi"
+#define GRUB_DEFAULT_FILE "/etc/default/grub"
+#define KERNEL_CMDLINE_FILE "/etc/kernel/cmdline"
+/* Sources the fragments of all slots in menu entry order, included by
+   grub.d/09_partAB. Below BOOT_DIR, like the fragments. */
+#define GRUB_SLOTS_CFG "tiu-slots.cfg"
+#define GRUB_ENTRY_CFG "grub-entry.cfg"
+
+extern gboolean write_boot_entries (const gchar *root, TIUTopology *topo,
+				    const TIUSlot *slot, GError **error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,38 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Directory for downloaded archives */
+#define TIU_CACHE_DIR "/var/cache/tiu"
+
+/* Index of the checksums of the files in TIU_CACHE_DIR, together with
+   the metadata of the file at the time the checksum was computed. */
+#define TIU_CACHE_INDEX TIU_CACHE_DIR "/index"
+
+extern gboolean cache_check_sha256sum (const gchar *filename, const gchar *sha256sum);
+extern gboolean cache_add_sha256sum (const gchar *filename, const gchar *sha256sum,
+				     GError **error);
+
+#ifdef __cplusplus
+}
+#endif
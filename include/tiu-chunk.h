@@ -0,0 +1,79 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <glib.h>
+
+#include "tiu-cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sizes for content defined chunking of images */
+#define CHUNK_SIZE_MIN (16*1024)
+#define CHUNK_SIZE_AVG (64*1024)
+#define CHUNK_SIZE_MAX (256*1024)
+
+/* Local chunk store and the indexes of the images in the USR_X slots */
+#define TIU_CHUNK_STORE TIU_CACHE_DIR "/store"
+#define TIU_SLOT_INDEX_DIR TIU_CACHE_DIR "/slots"
+
+/*
+  A .tiuidx file describes an image as list of chunks. All numbers
+  are stored in big endian:
+
+    8 bytes   magic "TIUIDX01"
+    4 bytes   minimal, average and maximal chunk size (3x)
+    4 bytes   reserved
+    8 bytes   size of the image
+    8 bytes   number of chunks
+   32 bytes   SHA256 of the image
+  followed by one entry per chunk:
+   32 bytes   SHA256 of the chunk (the chunk ID)
+    4 bytes   size of the chunk
+
+  The chunks are stored zlib compressed as <store>/<id[0..3]>/<id>.chunk
+*/
+#define CHUNK_INDEX_MAGIC "TIUIDX01"
+
+typedef struct {
+  guint8 id[32];
+  guint64 offset;
+  guint32 size;
+} TIUChunk;
+
+typedef struct {
+  guint32 min_size;
+  guint32 avg_size;
+  guint32 max_size;
+  guint64 image_size;
+  guint8 image_sha256[32];
+  GArray *chunks;  /* TIUChunk, in image order */
+} TIUChunkIndex;
+
+extern TIUChunkIndex *chunk_index_load (const gchar *filename, GError **error);
+extern void chunk_index_free (TIUChunkIndex *idx);
+extern gboolean chunk_index_create (const gchar *image, const gchar *index,
+				    const gchar *store, GError **error);
+extern gboolean chunk_update (const gchar *index, const gchar *store_url,
+			      const gchar *seed, const gchar *seed_index,
+			      const gchar *target, GError **error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,54 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block size for finding data of the base image in the new image */
+#define DELTA_BLOCK_SIZE 4096
+
+/*
+  A .tiudelta file describes a new image as a list of operations on
+  the previous image (the base). All numbers are stored in big endian:
+
+    8 bytes   magic "TIUDLT01"
+    8 bytes   size of the base image
+   32 bytes   SHA256 of the base image
+    8 bytes   size of the new image
+   32 bytes   SHA256 of the new image
+    4 bytes   block size
+    4 bytes   reserved
+  followed by a zlib compressed list of operations:
+    'C' offset(8) length(8)   copy length bytes from the base at offset
+    'D' length(8) data        literal data
+    'E'                       end of the list
+*/
+#define DELTA_MAGIC "TIUDLT01"
+
+extern gboolean delta_create (const gchar *base, const gchar *image,
+			      const gchar *delta, GError **error);
+extern gboolean delta_apply (const gchar *delta, const gchar *base,
+			     const gchar *base_index, const gchar *target,
+			     GError **error);
+
+#ifdef __cplusplus
+}
+#endif
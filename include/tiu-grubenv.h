@@ -0,0 +1,50 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GRUBENV_FILE "/boot/grub2/grubenv"
+/* grub only accepts a block of exactly this size */
+#define GRUBENV_SIZE 1024
+#define GRUBENV_HEADER "# GRUB Environment Block\n"
+
+/* The variables of a grubenv file in the order of the file. Changes
+   are only done in memory until grubenv_write(), so several variables
+   are updated in one transaction. */
+typedef struct {
+  gchar *path;
+  GPtrArray *names;
+  GPtrArray *values;
+} TIUGrubenv;
+
+extern TIUGrubenv *grubenv_read (const gchar *path, GError **error);
+extern void grubenv_free (TIUGrubenv *env);
+extern const gchar *grubenv_get (TIUGrubenv *env, const gchar *name);
+extern void grubenv_set (TIUGrubenv *env, const gchar *name, const gchar *value);
+extern void grubenv_unset (TIUGrubenv *env, const gchar *name);
+extern gboolean grubenv_write (TIUGrubenv *env, GError **error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,11 +28,44 @@ extern "C" {
 /* Default maximum downloadable bundle size (800 MiB) */
 #define DEFAULT_MAX_DOWNLOAD_SIZE 800*1024*1024
 
+/* Number of download attempts and delay between them in seconds,
+   the delay gets doubled after every failed attempt */
+#define DOWNLOAD_RETRIES 8
+#define DOWNLOAD_RETRY_DELAY 1
+#define DOWNLOAD_MAX_RETRY_DELAY 60
+
+/* Parallel downloads: size of the byte ranges, and the default
+   for the maximum number of connections */
+#define DOWNLOAD_SEGMENT_SIZE (8*1024*1024)
+#define DEFAULT_DOWNLOAD_CONNECTIONS 4
+
+/* Read size for hashing data which was not seen while downloading */
+#define DOWNLOAD_HASH_BUFSIZE (1024*1024)
+
+/* End of a streamed archive with checksum which is held back until
+   the checksum is verified, more than the cpio trailer of a swu */
+#define DOWNLOAD_STREAM_HOLD (64*1024)
+
+/* Size of the chunks handed over to swupdate (default 1 MiB) */
+#define DEFAULT_FEED_CHUNK_SIZE 1024*1024
+#define MIN_FEED_CHUNK_SIZE 4*1024
+#define MAX_FEED_CHUNK_SIZE 64*1024*1024
+
+/* Number of 1 MiB buffers written in parallel to the slot device.
+   0 writes through the page cache. */
+#define DEFAULT_WRITE_QUEUE_DEPTH 8
+#define MAX_WRITE_QUEUE_DEPTH 64
+
 extern gboolean verbose_flag;
 extern gboolean debug_flag;
 extern gboolean quiet_flag;
+extern gsize feed_chunk_size;
+extern guint download_connections;
+extern gchar *chunk_store_url;
+extern gboolean skip_unchanged_blocks;
+extern guint write_queue_depth;
+extern gboolean dracut_fallback;
 
-extern gboolean workdir_setup (const gchar *contentpath, const gchar **workdir, GError **error);
 extern gboolean workdir_destroy (const gchar *workdir, GError **error);
 extern gboolean rm_rf (GFile *file, GCancellable *cancellable, GError **error);
 extern gboolean rmdir_rf (const gchar *dir, GCancellable *cancellable, GError **error);
@@ -0,0 +1,38 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* initrds built by dracut on the device, named by the hash of the
+   kernel, its modules and the dracut configuration */
+#define INITRD_CACHE_DIR "/var/cache/tiu/initrd"
+/* Number of cached initrds kept, the least recently used go first */
+#define INITRD_CACHE_MAX 4
+
+extern gboolean stage_kernels (const gchar *chroot, const gchar *slot_name,
+			       GError **error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,9 +25,8 @@ extern "C" {
 
 #define TIU_ROOT_DIR "/var/lib/tiu/root"
 
-extern gboolean bind_mount (const gchar *source, const gchar *target, const gchar *dir, GError **error);
-extern gboolean setup_chroot (const gchar *target, const gchar *root_dir, GError **error);
-extern gboolean umount_chroot (const gchar *target, gboolean force, GError **error);
+extern gboolean umount_recursive (const gchar *target, gboolean lazy, GError **error);
+extern GSubprocessLauncher *chroot_launcher_new (const gchar *target, const gchar *root_dir, GSubprocessFlags flags, GError **error);
 extern gboolean is_mounted (const gchar *target, GError **error);
 
 
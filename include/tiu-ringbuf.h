@@ -0,0 +1,41 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default size of the buffer between a download and swupdate (4 MiB) */
+#define DEFAULT_RINGBUF_SIZE 4*1024*1024
+
+/* Bounded single producer/single consumer byte buffer. The producer
+   blocks if the buffer is full, the consumer blocks if it is empty. */
+typedef struct _TIURingBuf TIURingBuf;
+
+extern TIURingBuf *ringbuf_new (gsize size);
+extern void ringbuf_free (TIURingBuf *rb);
+extern gboolean ringbuf_write (TIURingBuf *rb, const void *data, gsize len);
+extern gssize ringbuf_read (TIURingBuf *rb, void *data, gsize len);
+extern void ringbuf_close (TIURingBuf *rb, gboolean failed);
+extern void ringbuf_abort (TIURingBuf *rb);
+
+#ifdef __cplusplus
+}
+#endif
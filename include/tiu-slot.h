@@ -0,0 +1,61 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <glib.h>
+
+#include "verity_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the buffer collecting data for the slot device (1 MiB) */
+#define SLOT_WRITER_BUFSIZE (1024*1024)
+
+/* Alignment of buffers, offsets and sizes for O_DIRECT */
+#define SLOT_WRITER_ALIGN 4096
+
+/* Granularity of the comparison with the old content of the slot */
+#define SLOT_COMPARE_BLOCK_SIZE 4096
+
+/* Sequential writer for the image of an USR_X partition. The data
+   gets collected into large blocks before it is written out, the
+   device is synced when the writer is finished.
+   With skip_unchanged_blocks set, blocks already containing the
+   right data are not written, the result is verified at the end.
+   Otherwise up to write_queue_depth buffers are written in the
+   background with io_uring and O_DIRECT.
+   If the verity hash tree of the image is known, every block gets
+   checked before it is written and no verification at the end is
+   needed. */
+typedef struct _TIUSlotWriter TIUSlotWriter;
+
+extern TIUSlotWriter *slot_writer_new (const gchar *device, guint64 size,
+				       GError **error);
+extern gboolean slot_writer_set_verity (TIUSlotWriter *w,
+					const VerityInfo *info,
+					const guint8 *tree, GError **error);
+extern gboolean slot_writer_write (TIUSlotWriter *w, const void *data, gsize len,
+				   GError **error);
+extern gboolean slot_writer_finish (TIUSlotWriter *w, GError **error);
+extern guint64 slot_writer_get_offset (TIUSlotWriter *w);
+extern void slot_writer_free (TIUSlotWriter *w);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,7 +22,8 @@
 extern "C" {
 #endif
 
-extern gboolean swupdate_deploy (const gchar *archive, GError **error);
+extern gboolean swupdate_deploy (const gchar *archive, const gchar *sha256sum,
+				 const gchar *slot_device, GError **error);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,57 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block size for reading the (decompressed) tar archive (1 MiB) */
+#define TAR_READ_BLOCK_SIZE (1024*1024)
+
+/* Block size of a written tar stream (64 KiB) */
+#define TAR_WRITE_BLOCK_SIZE (64*1024)
+
+/* Extract @archive into the existing directory @dest. Entries below
+   @relocate_from (e.g. "etc") are extracted below @relocate_to (e.g.
+   "usr/share/factory/etc") instead, both relative to @dest. */
+extern gboolean tar_extract (const gchar *archive, const gchar *dest,
+			     const gchar *relocate_from,
+			     const gchar *relocate_to, GError **error);
+
+/* Changes applied by tar_rewrite() while the archive is copied */
+typedef struct {
+  const gchar *relocate_from;   /* like tar_extract() */
+  const gchar *relocate_to;
+  const gchar * const *exclude; /* directories whose content is dropped */
+  const gchar *capture;         /* file to keep in captured, or NULL */
+  GBytes *captured;
+  const gchar *append_root;     /* directory of the files to append */
+  const gchar * const *append;  /* added at the end, relative to append_root */
+  const gchar *subtree;         /* copied to subtree_fd as well, or NULL */
+  int subtree_fd;
+} TarRewrite;
+
+extern gboolean tar_rewrite (const gchar *archive, int out_fd, TarRewrite *rw,
+			     GError **error);
+
+#ifdef __cplusplus
+}
+#endif
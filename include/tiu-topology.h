@@ -0,0 +1,56 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <glib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Prefix of the partition labels of the /usr slots */
+#define SLOT_LABEL_PREFIX "USR_"
+
+/* A /usr slot, the partition with the label "USR_<name>" */
+typedef struct {
+  gchar *label;        /* USR_A, USR_B, ..., USR_AA */
+  gchar *name;         /* A, B, ..., AA */
+  gchar *device;       /* /dev/vda3 */
+  gchar *disk;         /* vda */
+  dev_t devno;
+  guint index;         /* position in the slot list, the boot menu entry */
+} TIUSlot;
+
+/* The slots on the disk of the running /usr, read once from
+   /proc/self/mountinfo and /sys/class/block. They are sorted by the
+   length of the name first, A ... Z come before AA. */
+typedef struct {
+  GPtrArray *slots;    /* TIUSlot */
+  TIUSlot *current;    /* slot mounted on /usr, or NULL */
+  gchar *usr_device;   /* device mounted on /usr, e.g. /dev/dm-0 */
+} TIUTopology;
+
+extern TIUTopology *topology_new (GError **error);
+extern void topology_free (TIUTopology *topo);
+extern TIUSlot *topology_find (TIUTopology *topo, const gchar *label);
+extern TIUSlot *topology_next (TIUTopology *topo, GError **error);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,46 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <glib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Minimal io_uring for writes, without liburing. uring_new() returns
+   NULL with G_IO_ERROR_NOT_SUPPORTED if the kernel has no io_uring
+   or it is disabled, the caller is expected to use pwrite then. */
+typedef struct _TIUUring TIUUring;
+
+extern TIUUring *uring_new (guint depth, GError **error);
+extern void uring_free (TIUUring *u);
+/* Queue a write of @len bytes at @offset. Fails if the queue is full,
+   uring_wait() has to be called first. */
+extern gboolean uring_write (TIUUring *u, int fd, void *buf, gsize len,
+			     off_t offset, guint64 user_data, GError **error);
+/* Wait for the next completion. @result is the number of bytes
+   written or a negative errno. */
+extern gboolean uring_wait (TIUUring *u, guint64 *user_data, gint *result,
+			    GError **error);
+extern guint uring_in_flight (TIUUring *u);
+
+#ifdef __cplusplus
+}
+#endif
@@ -23,12 +23,18 @@ extern "C" {
 #endif
 
 extern gboolean extract_image(const gchar *archive, const gchar *outputdir, GError **error);
-extern gboolean install_system (const gchar *archive, const gchar *device,
-		                const gchar *disk_layout, GError **error);
-extern gboolean update_system (const gchar *archive, GError **error);
+extern gboolean create_image (const gchar *input, const gchar *outputdir,
+			      const gchar *previous, const gchar *store,
+			      const gchar *profile, gboolean initrd,
+			      GError **error);
+extern gboolean install_system (const gchar *archive, const gchar *archive_sha256sum,
+				const gchar *device, const gchar *disk_layout,
+				GError **error);
+extern gboolean update_system (const gchar *archive, const gchar *archive_sha256sum,
+			       GError **error);
 extern gboolean update_system_pre (GError **error);
 extern gboolean update_system_post (GError **error);
-extern gboolean download_archive (const gchar *archive, const gchar *archive_md5sum,
+extern gboolean download_archive (const gchar *archive, const gchar *archive_sha256sum,
 				  gchar **location, GError **error);
 
 #ifdef __cplusplus
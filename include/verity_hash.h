@@ -0,0 +1,100 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* dm-verity format version 1 with sha256, 4 KiB data and hash blocks */
+#define VERITY_BLOCK_SIZE 4096
+#define VERITY_DIGEST_SIZE 32
+#define VERITY_SALT_SIZE 32
+
+/* Data read at once from the image while hashing it (16 MiB) */
+#define VERITY_READ_SIZE (16*1024*1024)
+
+/* Incremental builder for a dm-verity hash tree. Data blocks get
+   hashed on up to n_threads cores, the upper levels are built while
+   the data blocks arrive in order. Blocks can be added out of order
+   or again, the affected parts of the tree are rebuilt at the end.
+   The builder itself is not thread safe. */
+typedef struct _VerityHash VerityHash;
+
+extern VerityHash *verity_hash_new (const guint8 *salt, guint n_threads);
+extern void verity_hash_add (VerityHash *vh, guint64 block,
+			     const guint8 *data, guint64 n_blocks);
+extern gsize verity_hash_finish (VerityHash *vh, guint64 data_blocks,
+				 guint8 *root_hash, guint8 **tree);
+extern void verity_hash_free (VerityHash *vh);
+
+/* Hash the first @data_blocks blocks of @fd, returns the hash tree
+   as stored behind the data (top level first) in @tree. */
+extern gboolean verity_hash_fd (int fd, guint64 data_blocks,
+				const guint8 *salt, guint n_threads,
+				guint8 *root_hash, guint8 **tree,
+				gsize *tree_size, GError **error);
+
+/* Verity parameters of an image, from the manifest at its end */
+typedef struct {
+  guint8 root_hash[VERITY_DIGEST_SIZE];
+  guint8 salt[VERITY_SALT_SIZE];
+  guint64 image_size;  /* data, hash tree, manifest and manifest size */
+  guint64 data_size;   /* the squashfs, covered by the hash tree */
+  guint64 tree_size;
+} VerityInfo;
+
+/* The manifest and its size are searched for in this many bytes at
+   the end of an image (64 KiB) */
+#define VERITY_TRAILER_MAX (64*1024)
+
+/* Upper bound for the size of the hash tree of an image */
+#define VERITY_TREE_MAX(image_size) ((image_size)/64 + VERITY_BLOCK_SIZE)
+
+extern gboolean verity_parse_trailer (const guint8 *tail, gsize len,
+				      guint64 image_size, VerityInfo *info,
+				      GError **error);
+
+/* Check an image against its hash tree while it is written. Every
+   data block gets checked as soon as it is complete, the first bad
+   block stops the update before it reaches the disk. */
+typedef struct _VerityCheck VerityCheck;
+
+extern VerityCheck *verity_check_new (const VerityInfo *info,
+				      const guint8 *tree, GError **error);
+extern gboolean verity_check_update (VerityCheck *vc, const guint8 *data,
+				     gsize len, GError **error);
+extern gboolean verity_check_finish (VerityCheck *vc, GError **error);
+extern void verity_check_free (VerityCheck *vc);
+
+/* Append the hash tree to the data of @fd, or with @verify set check
+   the appended hash tree and @root_hash. @combined_size is the size
+   of data and hash tree in blocks. Returns 0 on success. */
+extern int verity_create_or_verify_hash (int verify, int fd,
+					 uint64_t data_blocks,
+					 off_t *combined_size,
+					 guint8 *root_hash,
+					 const guint8 *salt);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,428 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+
+#include "tiu-internal.h"
+#include "tiu-bootentry.h"
+
+#define MENU_TITLE "openSUSE MicroOS"
+
+/*
+  Value of the last assignment of @name in the shell fragment @file
+  (/etc/default/grub), with quotes and backslash escapes resolved like
+  sourcing it would do. Variables are not expanded.
+*/
+static gchar *
+read_shell_var (const gchar *file, const gchar *name)
+{
+  g_autofree gchar *content = NULL;
+  g_auto(GStrv) lines = NULL;
+  gsize len = strlen(name);
+  gchar *value = NULL;
+
+  if (!g_file_get_contents(file, &content, NULL, NULL))
+    return NULL;
+
+  lines = g_strsplit(content, "\n", -1);
+  for (guint i = 0; lines[i]; i++)
+    {
+      const gchar *p = lines[i];
+      gchar quote = 0;
+      GString *s;
+
+      while (g_ascii_isspace(*p))
+	p++;
+      if (g_str_has_prefix(p, "export "))
+	p += strlen("export ");
+      if (strncmp(p, name, len) != 0 || p[len] != '=')
+	continue;
+
+      s = g_string_new(NULL);
+      for (p += len + 1; *p; p++)
+	{
+	  if (quote == '\'')
+	    {
+	      if (*p == '\'')
+		quote = 0;
+	      else
+		g_string_append_c(s, *p);
+	    }
+	  else if (*p == '\\' && p[1])
+	    g_string_append_c(s, *++p);
+	  else if (*p == '"' && (quote == 0 || quote == '"'))
+	    quote = quote ? 0 : '"';
+	  else if (*p == '\'' && quote == 0)
+	    quote = '\'';
+	  else if (quote == 0 && g_ascii_isspace(*p))
+	    break;
+	  else
+	    g_string_append_c(s, *p);
+	}
+      g_free(value);
+      value = g_string_free(s, FALSE);
+    }
+
+  return value;
+}
+
+/* Newest "vmlinuz-<version>" in @dir */
+static gchar *
+find_kernel (const gchar *dir)
+{
+  g_autoptr(GDir) d = g_dir_open(dir, 0, NULL);
+  const gchar *name;
+  gchar *kver = NULL;
+
+  if (d == NULL)
+    return NULL;
+
+  while ((name = g_dir_read_name(d)) != NULL)
+    {
+      const gchar *v;
+
+      if (!g_str_has_prefix(name, "vmlinuz-"))
+	continue;
+      v = name + strlen("vmlinuz-");
+      if (kver == NULL || strverscmp(v, kver) > 0)
+	{
+	  g_free(kver);
+	  kver = g_strdup(v);
+	}
+    }
+
+  return kver;
+}
+
+static gboolean
+write_grub_fragment (const gchar *boot, const TIUSlot *slot,
+		     const gchar *kver, const gchar *default_grub,
+		     GError **error)
+{
+  g_autofree gchar *cmdline = read_shell_var(default_grub, "GRUB_CMDLINE_LINUX");
+  g_autofree gchar *cmdline_default = read_shell_var(default_grub, "GRUB_CMDLINE_LINUX_DEFAULT");
+  g_autofree gchar *path = g_strjoin("/", boot, slot->name, GRUB_ENTRY_CFG, NULL);
+  g_autofree gchar *initrd = g_strdup_printf("%s/%s/initrd-%s", boot, slot->name, kver);
+  g_autoptr(GString) cfg = g_string_new(NULL);
+
+  g_string_append_printf(cfg,
+			 "menuentry '" MENU_TITLE ", partition %s (Linux %s)' {\n"
+			 "        load_video\n"
+			 "        set gfxpayload=keep\n"
+			 "        insmod gzio\n"
+			 "        insmod part_gpt\n"
+			 "        insmod ext2\n"
+			 "        echo    'Loading Linux %s ...'\n"
+			 "        linux   /%s/vmlinuz-%s root=PARTLABEL=ROOT rootflags=rw %s mount.usr=PARTLABEL=%s mount.usrflags=ro %s\n",
+			 slot->name, kver, kver, slot->name, kver,
+			 cmdline ? cmdline : "", slot->label,
+			 cmdline_default ? cmdline_default : "");
+  if (g_file_test(initrd, G_FILE_TEST_EXISTS))
+    g_string_append_printf(cfg,
+			   "        echo    'Loading initial ramdisk ...'\n"
+			   "        initrd  /%s/initrd-%s\n",
+			   slot->name, kver);
+  g_string_append(cfg, "}\n");
+
+  return g_file_set_contents(path, cfg->str, cfg->len, error);
+}
+
+/* The list is static, changing the default entry or the kernel of a
+   slot never needs grub2-mkconfig. */
+static gboolean
+write_grub_slots (const gchar *boot, TIUTopology *topo, GError **error)
+{
+  g_autofree gchar *path = g_strjoin("/", boot, GRUB_SLOTS_CFG, NULL);
+  g_autoptr(GString) cfg = g_string_new(NULL);
+
+  for (guint i = 0; i < topo->slots->len; i++)
+    {
+      TIUSlot *slot = g_ptr_array_index(topo->slots, i);
+
+      g_string_append_printf(cfg,
+			     "if [ -f \"/%s/" GRUB_ENTRY_CFG "\" ]; then\n"
+			     "  source \"/%s/" GRUB_ENTRY_CFG "\"\n"
+			     "fi\n", slot->name, slot->name);
+    }
+
+  return g_file_set_contents(path, cfg->str, cfg->len, error);
+}
+
+/* /etc/kernel/cmdline of kernel-install, with mount.usr for @slot */
+static gchar *
+sdboot_options (const gchar *cmdline_file, const TIUSlot *slot)
+{
+  g_autofree gchar *content = NULL;
+  g_autofree gchar *usr = g_strconcat("mount.usr=PARTLABEL=", slot->label, NULL);
+  g_auto(GStrv) words = NULL;
+  g_autoptr(GString) options = g_string_new(NULL);
+  gboolean have_usr = FALSE;
+
+  if (!g_file_get_contents(cmdline_file, &content, NULL, NULL))
+    content = g_strdup("root=PARTLABEL=ROOT rootflags=rw mount.usrflags=ro");
+
+  words = g_strsplit_set(g_strstrip(content), " \t\n", -1);
+  for (guint i = 0; words[i]; i++)
+    {
+      const gchar *w = words[i];
+
+      if (*w == '\0')
+	continue;
+      if (g_str_has_prefix(w, "mount.usr="))
+	{
+	  w = usr;
+	  have_usr = TRUE;
+	}
+      if (options->len)
+	g_string_append_c(options, ' ');
+      g_string_append(options, w);
+    }
+  if (!have_usr)
+    g_string_append_printf(options, " %s", usr);
+
+  return g_string_free(g_steal_pointer(&options), FALSE);
+}
+
+static gboolean
+copy_to_esp (const gchar *src, const gchar *dst, GError **error)
+{
+  g_autoptr(GFile) in = g_file_new_for_path(src);
+  g_autoptr(GFile) out = g_file_new_for_path(dst);
+
+  return g_file_copy(in, out, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, error);
+}
+
+/* Entry token of @slot for kernel-install, "<os-release ID>-<label>",
+   which setup-bootloader-sd-boot writes to /etc/kernel/entry-token
+   during installation. */
+static gchar *
+sdboot_entry_token (const gchar *root, const TIUSlot *slot)
+{
+  g_autofree gchar *os_release = g_strconcat(root, "/usr/lib/os-release", NULL);
+  g_autofree gchar *id = read_shell_var(os_release, "ID");
+
+  return g_strdup_printf("%s-%s", id ? id : "linux", slot->label);
+}
+
+/* Remove the entries of @token and of older tiu versions for @slot,
+   together with their kernels */
+static gboolean
+remove_sdboot_entries (const gchar *esp, const gchar *token,
+		       const TIUSlot *slot, GError **error)
+{
+  g_autofree gchar *entries = g_strconcat(esp, "/loader/entries", NULL);
+  g_autofree gchar *prefix = g_strconcat(token, "-", NULL);
+  g_autofree gchar *old_entry = g_strdup_printf("tiu-%s.conf", slot->name);
+  g_autofree gchar *dir = g_strjoin("/", esp, token, NULL);
+  g_autofree gchar *old_dir = g_strdup_printf("%s/tiu/%s", esp, slot->name);
+  g_autoptr(GDir) d = g_dir_open(entries, 0, NULL);
+  const gchar *name;
+
+  while (d && (name = g_dir_read_name(d)) != NULL)
+    if ((g_str_has_prefix(name, prefix) && g_str_has_suffix(name, ".conf")) ||
+	strcmp(name, old_entry) == 0)
+      {
+	g_autofree gchar *path = g_strjoin("/", entries, name, NULL);
+
+	if (g_remove(path) != 0)
+	  {
+	    int err = errno;
+	    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			"Failed to remove '%s': %s", path, g_strerror(err));
+	    return FALSE;
+	  }
+      }
+
+  if (!rmdir_rf(dir, NULL, error) || !rmdir_rf(old_dir, NULL, error))
+    return FALSE;
+  /* rmdir_rf() keeps the directories themselves */
+  g_rmdir(dir);
+  g_rmdir(old_dir);
+
+  return TRUE;
+}
+
+/* Make @id the default entry in loader.conf. The LoaderEntryDefault
+   EFI variable, set with "bootctl set-default", still takes
+   precedence. */
+static gboolean
+set_sdboot_default (const gchar *esp, const gchar *id, GError **error)
+{
+  g_autofree gchar *path = g_strconcat(esp, "/loader/loader.conf", NULL);
+  g_autofree gchar *content = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GString) conf = g_string_new(NULL);
+  gboolean found = FALSE;
+
+  if (!g_file_get_contents(path, &content, NULL, NULL))
+    content = g_strdup("");
+
+  lines = g_strsplit(content, "\n", -1);
+  for (guint i = 0; lines[i]; i++)
+    {
+      const gchar *p = lines[i];
+
+      /* the last line has no newline */
+      if (lines[i + 1] == NULL && *p == '\0')
+	break;
+
+      while (g_ascii_isspace(*p))
+	p++;
+      if (g_str_has_prefix(p, "default") &&
+	  (p[7] == '\0' || g_ascii_isspace(p[7])))
+	{
+	  if (!found)
+	    g_string_append_printf(conf, "default %s\n", id);
+	  found = TRUE;
+	  continue;
+	}
+      g_string_append_printf(conf, "%s\n", lines[i]);
+    }
+  if (!found)
+    {
+      g_autofree gchar *line = g_strdup_printf("default %s\n", id);
+
+      g_string_prepend(conf, line);
+    }
+
+  return g_file_set_contents(path, conf->str, conf->len, error);
+}
+
+/*
+  sd-boot can only read the ESP, so kernel and initrd of the slot are
+  copied there next to a Boot Loader Specification entry. Names and
+  layout are the ones of kernel-install, which creates the entry of
+  the first slot during installation: <token>/<version>/linux and
+  loader/entries/<token>-<version>.conf. The entry replaces the
+  previous ones of the slot and becomes the default.
+*/
+static gboolean
+write_sdboot_entry (const gchar *root, const gchar *boot, const TIUSlot *slot,
+		    const gchar *kver, GError **error)
+{
+  g_autofree gchar *esp = g_strconcat(root, ESP_DIR, NULL);
+  g_autofree gchar *token = sdboot_entry_token(root, slot);
+  g_autofree gchar *dir = g_strdup_printf("%s/%s/%s", esp, token, kver);
+  g_autofree gchar *kernel = g_strdup_printf("%s/%s/vmlinuz-%s", boot, slot->name, kver);
+  g_autofree gchar *initrd = g_strdup_printf("%s/%s/initrd-%s", boot, slot->name, kver);
+  g_autofree gchar *id = g_strdup_printf("%s-%s.conf", token, kver);
+  g_autofree gchar *entry = g_strdup_printf("%s/loader/entries/%s", esp, id);
+  g_autofree gchar *cmdline_file = g_strconcat(root, KERNEL_CMDLINE_FILE, NULL);
+  g_autofree gchar *options = sdboot_options(cmdline_file, slot);
+  g_autofree gchar *dst = NULL;
+  g_autoptr(GString) conf = g_string_new(NULL);
+  gboolean have_initrd = g_file_test(initrd, G_FILE_TEST_EXISTS);
+
+  /* the ESP is small, drop the old kernel of the slot first */
+  if (!remove_sdboot_entries(esp, token, slot, error))
+    return FALSE;
+  if (g_mkdir_with_parents(dir, 0755) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", dir, g_strerror(err));
+      return FALSE;
+    }
+
+  dst = g_strconcat(dir, "/linux", NULL);
+  if (!copy_to_esp(kernel, dst, error))
+    return FALSE;
+  if (have_initrd)
+    {
+      g_free(dst);
+      dst = g_strconcat(dir, "/initrd", NULL);
+      if (!copy_to_esp(initrd, dst, error))
+	return FALSE;
+    }
+
+  g_string_append_printf(conf,
+			 "title      " MENU_TITLE ", partition %s\n"
+			 "version    %s\n"
+			 "sort-key   %s\n"
+			 "linux      /%s/%s/linux\n",
+			 slot->name, kver, token, token, kver);
+  if (have_initrd)
+    g_string_append_printf(conf, "initrd     /%s/%s/initrd\n", token, kver);
+  g_string_append_printf(conf, "options    %s\n", options);
+
+  if (!g_file_set_contents(entry, conf->str, conf->len, error))
+    return FALSE;
+
+  return set_sdboot_default(esp, id, error);
+}
+
+/*
+  Create the boot menu entries of @slot from its kernel in
+  /boot/<slot name>: the grub fragment, the static list of all slots
+  sourced by grub.d/09_partAB and, if sd-boot is installed on the ESP,
+  a loader entry. @root is the prefix of all paths, NULL for /.
+*/
+gboolean
+write_boot_entries (const gchar *root, TIUTopology *topo,
+		    const TIUSlot *slot, GError **error)
+{
+  GError *ierror = NULL;
+  g_autofree gchar *boot = NULL;
+  g_autofree gchar *slot_dir = NULL;
+  g_autofree gchar *default_grub = NULL;
+  g_autofree gchar *entries = NULL;
+  g_autofree gchar *kver = NULL;
+  gint64 start = g_get_monotonic_time();
+
+  if (root == NULL)
+    root = "";
+
+  boot = g_strconcat(root, BOOT_DIR, NULL);
+  slot_dir = g_strjoin("/", boot, slot->name, NULL);
+  if ((kver = find_kernel(slot_dir)) == NULL)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+		  "No kernel found in '%s'", slot_dir);
+      return FALSE;
+    }
+
+  if (debug_flag)
+    g_printf("Creating boot entries for %s (Linux %s)...\n", slot->label, kver);
+
+  default_grub = g_strconcat(root, GRUB_DEFAULT_FILE, NULL);
+  if (!write_grub_fragment(boot, slot, kver, default_grub, &ierror) ||
+      !write_grub_slots(boot, topo, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to write grub menu entries: ");
+      return FALSE;
+    }
+
+  entries = g_strconcat(root, ESP_DIR "/loader/entries", NULL);
+  if (g_file_test(entries, G_FILE_TEST_IS_DIR) &&
+      !write_sdboot_entry(root, boot, slot, kver, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to write sd-boot entry: ");
+      return FALSE;
+    }
+
+  if (debug_flag)
+    g_printf("Boot entries written in %.2f ms\n",
+	     (g_get_monotonic_time() - start) / 1000.0);
+
+  return TRUE;
+}
@@ -15,7 +15,15 @@
 */
 
 #include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 
 #include <glib.h>
 #include <gio/gio.h>
@@ -24,151 +32,290 @@
 #include "tiu-internal.h"
 #include "tiu-btrfs.h"
 
+static int
+open_dir (const gchar *path, GError **error)
+{
+  int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+  if (fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s': %s", path, g_strerror(err));
+    }
+
+  return fd;
+}
+
 gboolean
 btrfs_set_readonly (const gchar *path, gboolean ro, GError **error)
 {
-  g_autoptr (GSubprocess) sproc = NULL;
-  GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, g_free);
+  guint64 flags;
+  gboolean retval = FALSE;
+  int fd;
 
   if (debug_flag)
     g_printf("Setting subvolume '%s' to '%s'...\n",
              path, ro?"read-only":"read-write");
 
-  g_ptr_array_add(args, "btrfs");
-  g_ptr_array_add(args, "property");
-  g_ptr_array_add(args, "set");
-  g_ptr_array_add(args, g_strdup(path));
-  g_ptr_array_add(args, "ro");
-  g_ptr_array_add(args, ro?"true":"false");
-  g_ptr_array_add(args, NULL);
-
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
+  if ((fd = open_dir(path, error)) < 0)
+    return FALSE;
+
+  if (ioctl(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to get flags of subvolume '%s': %s", path,
+		  g_strerror(err));
+      goto cleanup;
+    }
+
+  if (ro)
+    flags |= BTRFS_SUBVOL_RDONLY;
+  else
+    flags &= ~(guint64)BTRFS_SUBVOL_RDONLY;
+
+  if (ioctl(fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to set subvolume '%s' %s: %s", path,
+		  ro?"read-only":"read-write", g_strerror(err));
+      goto cleanup;
+    }
+
+  retval = TRUE;
+
+ cleanup:
+  close(fd);
+  return retval;
+}
+
+/* btrfs indexes directory entries by crc32c(~1, name), without the
+   final inversion */
+static guint32
+name_hash (const gchar *name, gsize len)
+{
+  static guint32 table[256];
+  guint32 crc = ~(guint32)1;
+
+  if (table[1] == 0)
+    for (guint32 i = 0; i < 256; i++)
+      {
+	guint32 c = i;
+
+	for (int k = 0; k < 8; k++)
+	  c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+	table[i] = c;
+      }
+
+  for (gsize i = 0; i < len; i++)
+    crc = table[(crc ^ (guint8)name[i]) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+/*
+  Look up the entry @name of the directory @dir in the subvolume
+  @tree. One exact key search, independent of the number of entries
+  and subvolumes. Returns FALSE without error if there is no entry.
+*/
+static gboolean
+lookup_entry (int fd, guint64 tree, guint64 dir, const gchar *name,
+	      struct btrfs_disk_key *location, GError **error)
+{
+  struct btrfs_ioctl_search_args args;
+  struct btrfs_ioctl_search_key *sk = &args.key;
+  gsize name_len = strlen(name);
+  guint64 off = 0;
+
+  memset(&args, 0, sizeof(args));
+  sk->tree_id = tree;
+  sk->min_objectid = sk->max_objectid = dir;
+  sk->min_type = sk->max_type = BTRFS_DIR_ITEM_KEY;
+  sk->min_offset = sk->max_offset = name_hash(name, name_len);
+  sk->max_transid = (guint64)-1;
+  sk->nr_items = 1;
+
+  if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
     {
-      g_propagate_prefixed_error(error, ierror, "Failed to start btrfs set property: ");
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to search subvolume %" G_GUINT64_FORMAT ": %s",
+		  tree, g_strerror(err));
       return FALSE;
     }
 
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+  for (guint32 i = 0; i < sk->nr_items; i++)
     {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute btrfs set property: ");
+      struct btrfs_ioctl_search_header *sh =
+	(struct btrfs_ioctl_search_header *)(args.buf + off);
+      const gchar *item = args.buf + off + sizeof(*sh);
+      guint32 pos = 0;
+
+      /* names with the same hash share the item */
+      while (pos + sizeof(struct btrfs_dir_item) <= sh->len)
+	{
+	  struct btrfs_dir_item di;
+
+	  memcpy(&di, item + pos, sizeof(di));
+	  pos += sizeof(di);
+	  if (le16toh(di.name_len) == name_len &&
+	      pos + name_len <= sh->len &&
+	      memcmp(item + pos, name, name_len) == 0)
+	    {
+	      *location = di.location;
+	      return TRUE;
+	    }
+	  pos += le16toh(di.name_len) + le16toh(di.data_len);
+	}
+      off += sizeof(*sh) + sh->len;
+    }
+
+  return FALSE;
+}
+
+/*
+  Resolve @path, starting at directory @dir of subvolume @tree, to
+  the ID of the subvolume it names.
+*/
+static gboolean
+resolve_subvolume (int fd, guint64 tree, guint64 dir, const gchar *path,
+		   guint64 *id, GError **error)
+{
+  g_auto(GStrv) parts = g_strsplit(path, "/", -1);
+  gboolean is_subvol = (dir == BTRFS_FIRST_FREE_OBJECTID);
+
+  for (guint i = 0; parts[i]; i++)
+    {
+      struct btrfs_disk_key location;
+      GError *ierror = NULL;
+
+      if (parts[i][0] == '\0' || strcmp(parts[i], ".") == 0)
+	continue;
+
+      if (!lookup_entry(fd, tree, dir, parts[i], &location, &ierror))
+	{
+	  if (ierror)
+	    g_propagate_error(error, ierror);
+	  else
+	    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+			"No subvolume '%s' found", path);
+	  return FALSE;
+	}
+
+      if (location.type == BTRFS_ROOT_ITEM_KEY)
+	{
+	  tree = le64toh(location.objectid);
+	  dir = BTRFS_FIRST_FREE_OBJECTID;
+	  is_subvol = TRUE;
+	}
+      else
+	{
+	  dir = le64toh(location.objectid);
+	  is_subvol = FALSE;
+	}
+    }
+
+  if (!is_subvol)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "'%s' is not a subvolume", path);
       return FALSE;
     }
 
+  *id = tree;
   return TRUE;
 }
 
+/*
+  ID of the subvolume @snapshot_dir, a path relative to the top level
+  of the btrfs filesystem mounted at @mountpoint (as shown by "btrfs
+  subvolume list"). If there is no such path, it is looked up relative
+  to @mountpoint.
+*/
 gboolean
 btrfs_get_subvolume_id (const gchar *snapshot_dir, const gchar *mountpoint, gchar **output, GError **error)
 {
-  gboolean retval = TRUE;
-  g_autoptr (GSubprocess) sproc = NULL;
+  struct btrfs_ioctl_ino_lookup_args lookup;
   GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, NULL);
+  struct stat st;
+  guint64 id;
+  gboolean retval = FALSE;
+  int fd;
 
   if (debug_flag)
     g_printf("Get subvolume ID for '%s'...\n", snapshot_dir);
 
-  gchar *sharg = g_strjoin(NULL, "btrfs subvolume list -o ", mountpoint, " | grep ",
-                           snapshot_dir, " | awk '{print $2}'", NULL);
+  *output = NULL;
 
-  g_ptr_array_add(args, "/bin/sh");
-  g_ptr_array_add(args, "-c");
-  g_ptr_array_add(args, sharg);
-  g_ptr_array_add(args, NULL);
+  if ((fd = open_dir(mountpoint, error)) < 0)
+    return FALSE;
 
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
-    {
-      g_propagate_prefixed_error(error, ierror, "Failed to start getting subvolume ID: ");
-      retval = FALSE;
-      goto cleanup;
-    }
+  if (resolve_subvolume(fd, BTRFS_FS_TREE_OBJECTID, BTRFS_FIRST_FREE_OBJECTID,
+			snapshot_dir, &id, &ierror))
+    goto found;
 
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+  if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
     {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute getting subvolume ID: ");
-      retval = FALSE;
+      g_propagate_error(error, ierror);
       goto cleanup;
     }
+  g_clear_error(&ierror);
 
-  gchar *stdout;
-  gchar *stderr;
-  if (!g_subprocess_communicate_utf8 (sproc, NULL, NULL, &stdout, &stderr, &ierror))
+  /* the subvolume and directory of the mountpoint */
+  memset(&lookup, 0, sizeof(lookup));
+  lookup.objectid = BTRFS_FIRST_FREE_OBJECTID;
+  if (fstat(fd, &st) < 0 || ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0)
     {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to read stdout to get subvolume ID: ");
-      retval = FALSE;
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to find the subvolume of '%s': %s", mountpoint,
+		  g_strerror(err));
       goto cleanup;
-
     }
+  if (!resolve_subvolume(fd, lookup.treeid, st.st_ino, snapshot_dir, &id,
+			 error))
+    goto cleanup;
 
-  if (stdout)
-    {
-      /* Remove trailing "\n" from output */
-      int len = strlen(stdout);
-      if (stdout[len - 1] == '\n')
-        stdout[len - 1] = '\0';
-      *output = g_strdup(stdout);
-    }
-  else
-    {
-      *output = NULL;
-      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(EPIPE),
-                  "Failed to read stdout to get subvolume ID:");
-      retval = FALSE;
-      goto cleanup;
-    }
+ found:
+  *output = g_strdup_printf("%" G_GUINT64_FORMAT, id);
+  retval = TRUE;
 
  cleanup:
-  g_ptr_array_free (args, TRUE);
-  if (sharg)
-    free (sharg);
-
+  close(fd);
   return retval;
 }
 
 gboolean
 btrfs_set_default (const gchar *btrfs_id, const gchar *path, GError **error)
 {
-  g_autoptr (GSubprocess) sproc = NULL;
   GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, NULL);
+  guint64 id;
   gboolean retval = TRUE;
+  int fd;
 
   if (debug_flag)
     g_printf("Set btrfs subvolume %s as default...\n", btrfs_id);
 
-  g_ptr_array_add(args, "btrfs");
-  g_ptr_array_add(args, "subvolume");
-  g_ptr_array_add(args, "set-default");
-  g_ptr_array_add(args, g_strdup(btrfs_id));
-  g_ptr_array_add(args, g_strdup(path));
-  g_ptr_array_add(args, NULL);
-
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
+  if (!g_ascii_string_to_unsigned(btrfs_id, 10, 0, G_MAXUINT64, &id, &ierror))
     {
-      g_propagate_prefixed_error(error, ierror, "Failed to start setting default subvolume: ");
-      retval = FALSE;
-      goto cleanup;
+      g_propagate_prefixed_error(error, ierror, "Invalid subvolume ID: ");
+      return FALSE;
     }
 
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+  if ((fd = open_dir(path, error)) < 0)
+    return FALSE;
+
+  if (ioctl(fd, BTRFS_IOC_DEFAULT_SUBVOL, &id) < 0)
     {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute setting default subvolume: ");
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to set subvolume %s as default: %s", btrfs_id,
+		  g_strerror(err));
       retval = FALSE;
     }
 
- cleanup:
-  g_ptr_array_free (args, TRUE);
-
+  close(fd);
   return retval;
 }
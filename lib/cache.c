@@ -0,0 +1,205 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib/gprintf.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "tiu-cache.h"
+
+/*
+  The index is a keyfile with one group per cached file. Besides the
+  checksum it contains everything which changes if the content of the
+  file gets modified or the file gets replaced, so that the checksum
+  can be trusted without reading the file again.
+*/
+
+static void
+set_stat (GKeyFile *index, const gchar *group, const struct stat *st)
+{
+  g_key_file_set_uint64(index, group, "device", st->st_dev);
+  g_key_file_set_uint64(index, group, "inode", st->st_ino);
+  g_key_file_set_uint64(index, group, "size", st->st_size);
+  g_key_file_set_int64(index, group, "mtime", st->st_mtim.tv_sec);
+  g_key_file_set_int64(index, group, "mtime-nsec", st->st_mtim.tv_nsec);
+  g_key_file_set_int64(index, group, "ctime", st->st_ctim.tv_sec);
+  g_key_file_set_int64(index, group, "ctime-nsec", st->st_ctim.tv_nsec);
+}
+
+static gboolean
+stat_matches (GKeyFile *index, const gchar *group, const struct stat *st)
+{
+  if (!g_key_file_has_key(index, group, "ctime-nsec", NULL))
+    return FALSE;
+
+  return g_key_file_get_uint64(index, group, "device", NULL) == (guint64)st->st_dev &&
+    g_key_file_get_uint64(index, group, "inode", NULL) == (guint64)st->st_ino &&
+    g_key_file_get_uint64(index, group, "size", NULL) == (guint64)st->st_size &&
+    g_key_file_get_int64(index, group, "mtime", NULL) == st->st_mtim.tv_sec &&
+    g_key_file_get_int64(index, group, "mtime-nsec", NULL) == st->st_mtim.tv_nsec &&
+    g_key_file_get_int64(index, group, "ctime", NULL) == st->st_ctim.tv_sec &&
+    g_key_file_get_int64(index, group, "ctime-nsec", NULL) == st->st_ctim.tv_nsec;
+}
+
+static GKeyFile *
+load_index (void)
+{
+  GKeyFile *index = g_key_file_new();
+
+  /* a missing or broken index only means that nothing is cached */
+  g_key_file_load_from_file(index, TIU_CACHE_INDEX, G_KEY_FILE_NONE, NULL);
+
+  return index;
+}
+
+static gboolean
+store_entry (const gchar *filename, const struct stat *st,
+	     const gchar *sha256sum, GError **error)
+{
+  g_autoptr(GKeyFile) index = load_index();
+
+  g_key_file_set_string(index, filename, "sha256", sha256sum);
+  set_stat(index, filename, st);
+
+  /* g_key_file_save_to_file() replaces the index atomically */
+  return g_key_file_save_to_file(index, TIU_CACHE_INDEX, error);
+}
+
+/* Read the whole file, the slow path if the index cannot be used */
+static gchar *
+compute_sha256sum (int fd, GError **error)
+{
+  g_autofree guchar *buf = g_malloc(DOWNLOAD_HASH_BUFSIZE);
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_MD_CTX *mdctx;
+  gchar *sha256sum;
+  ssize_t n;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  mdctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+  while ((n = read(fd, buf, DOWNLOAD_HASH_BUFSIZE)) != 0)
+    {
+      if (n < 0)
+	{
+	  int err = errno;
+
+	  if (err == EINTR)
+	    continue;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read file: %s", g_strerror(err));
+	  EVP_MD_CTX_free(mdctx);
+	  return NULL;
+	}
+      EVP_DigestUpdate(mdctx, buf, n);
+    }
+  EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+  EVP_MD_CTX_free(mdctx);
+
+  sha256sum = g_malloc(md_len * 2 + 1);
+  for (unsigned int i = 0; i < md_len; i++)
+    g_snprintf(&sha256sum[i * 2], 3, "%02x", md_value[i]);
+
+  return sha256sum;
+}
+
+/*
+  Check if the cached @filename has the checksum @sha256sum. If the
+  file did not change since its checksum was recorded in the index,
+  no data needs to be read. Otherwise the file gets hashed once and
+  the result is recorded for the next call.
+*/
+gboolean
+cache_check_sha256sum (const gchar *filename, const gchar *sha256sum)
+{
+  g_autoptr(GKeyFile) index = NULL;
+  g_autofree gchar *known = NULL;
+  GError *ierror = NULL;
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      return FALSE;
+    }
+
+  index = load_index();
+  if (stat_matches(index, filename, &st))
+    known = g_key_file_get_string(index, filename, "sha256", NULL);
+
+  if (known == NULL)
+    {
+      gint64 start = g_get_monotonic_time();
+
+      known = compute_sha256sum(fd, &ierror);
+      if (known == NULL)
+	{
+	  if (debug_flag)
+	    g_printf("Cannot hash '%s': %s\n", filename, ierror->message);
+	  g_clear_error(&ierror);
+	  close(fd);
+	  return FALSE;
+	}
+      if (debug_flag)
+	g_printf("Hashed '%s' in %.1f seconds\n", filename,
+		 (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC);
+
+      /* the metadata from before reading, a change while we were
+	 reading makes sure that the entry does not match next time */
+      if (!store_entry(filename, &st, known, &ierror))
+	{
+	  if (debug_flag)
+	    g_printf("Cannot update cache index: %s\n", ierror->message);
+	  g_clear_error(&ierror);
+	}
+    }
+  else if (debug_flag)
+    g_printf("Using checksum of '%s' from the cache index\n", filename);
+
+  close(fd);
+
+  return g_ascii_strcasecmp(known, sha256sum) == 0;
+}
+
+/* Record the checksum of a file which was just verified */
+gboolean
+cache_add_sha256sum (const gchar *filename, const gchar *sha256sum,
+		     GError **error)
+{
+  struct stat st;
+
+  if (stat(filename, &st) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to stat '%s': %s", filename, g_strerror(err));
+      return FALSE;
+    }
+
+  return store_entry(filename, &st, sha256sum, error);
+}
@@ -0,0 +1,998 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "tiu-chunk.h"
+#include "tiu-slot.h"
+#include "network.h"
+
+/* Read size while chunking an image */
+#define CHUNK_READ_BUFSIZE (4*1024*1024)
+
+#define INDEX_HEADER_SIZE 72
+#define INDEX_ENTRY_SIZE 36
+
+/*
+  FastCDC: a cut point is found if the gear hash of the data since
+  the start of the chunk has the masked bits cleared. Before the
+  average size a stricter mask is used, after it a looser one, so
+  that the chunk sizes are close to the average.
+*/
+typedef struct {
+  gsize min_size;
+  gsize avg_size;
+  gsize max_size;
+  guint64 mask_s;
+  guint64 mask_l;
+} CDCParams;
+
+static guint64 gear[256];
+
+/* The table has to be the same everywhere, so it is derived from a
+   fixed seed with splitmix64 instead of using random data. */
+static void
+init_gear (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter(&initialized))
+    {
+      guint64 x = 0x5449554944583031ULL; /* "TIUIDX01" */
+
+      for (guint i = 0; i < G_N_ELEMENTS(gear); i++)
+	{
+	  guint64 z = (x += 0x9e3779b97f4a7c15ULL);
+	  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	  gear[i] = z ^ (z >> 31);
+	}
+      g_once_init_leave(&initialized, 1);
+    }
+}
+
+static void
+cdc_init (CDCParams *p, gsize min_size, gsize avg_size, gsize max_size)
+{
+  guint bits = g_bit_nth_msf(avg_size, -1);
+
+  init_gear();
+  p->min_size = min_size;
+  p->avg_size = avg_size;
+  p->max_size = max_size;
+  /* use the upper bits, they depend on more input bytes */
+  p->mask_s = ((G_GUINT64_CONSTANT(1) << (bits + 2)) - 1) << (64 - bits - 2);
+  p->mask_l = ((G_GUINT64_CONSTANT(1) << (bits - 2)) - 1) << (64 - bits + 2);
+}
+
+/* Returns the size of the next chunk at @data. If @len is smaller
+   than the maximal chunk size, @data has to be the end of the image. */
+static gsize
+cdc_cut (const CDCParams *p, const guint8 *data, gsize len)
+{
+  guint64 hash = 0;
+  gsize i, n, normal;
+
+  if (len <= p->min_size)
+    return len;
+
+  n = MIN(len, p->max_size);
+  normal = MIN(n, p->avg_size);
+
+  for (i = p->min_size; i < normal; i++)
+    {
+      hash = (hash << 1) + gear[data[i]];
+      if (!(hash & p->mask_s))
+	return i + 1;
+    }
+  for (; i < n; i++)
+    {
+      hash = (hash << 1) + gear[data[i]];
+      if (!(hash & p->mask_l))
+	return i + 1;
+    }
+
+  return n;
+}
+
+typedef gboolean (*ChunkFunc) (const guint8 *data, gsize len, guint64 offset,
+			       gpointer user_data, GError **error);
+
+/* Split the content of @fd into chunks and call @func for every one */
+static gboolean
+chunk_fd (int fd, const CDCParams *p, ChunkFunc func, gpointer user_data,
+	  GError **error)
+{
+  g_autofree guint8 *buf = g_malloc(CHUNK_READ_BUFSIZE);
+  gsize avail = 0;
+  guint64 offset = 0;
+  gboolean eof = FALSE;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (!eof || avail > 0)
+    {
+      gsize pos = 0;
+
+      while (!eof && avail < CHUNK_READ_BUFSIZE)
+	{
+	  ssize_t n = read(fd, buf + avail, CHUNK_READ_BUFSIZE - avail);
+
+	  if (n < 0)
+	    {
+	      int err = errno;
+
+	      if (err == EINTR)
+		continue;
+	      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			  "Failed to read image: %s", g_strerror(err));
+	      return FALSE;
+	    }
+	  if (n == 0)
+	    eof = TRUE;
+	  avail += n;
+	}
+
+      while (avail - pos >= p->max_size || (eof && avail > pos))
+	{
+	  gsize len = cdc_cut(p, buf + pos, avail - pos);
+
+	  if (!func(buf + pos, len, offset, user_data, error))
+	    return FALSE;
+	  pos += len;
+	  offset += len;
+	}
+
+      memmove(buf, buf + pos, avail - pos);
+      avail -= pos;
+    }
+
+  return TRUE;
+}
+
+static void
+id_to_hex (const guint8 *id, gchar *hex)
+{
+  for (guint i = 0; i < 32; i++)
+    g_snprintf(&hex[i * 2], 3, "%02x", id[i]);
+}
+
+static gboolean
+hex_to_id (const gchar *hex, guint8 *id)
+{
+  for (guint i = 0; i < 32; i++)
+    {
+      gint hi = g_ascii_xdigit_value(hex[i * 2]);
+      gint lo = hi < 0 ? -1 : g_ascii_xdigit_value(hex[i * 2 + 1]);
+
+      if (lo < 0)
+	return FALSE;
+      id[i] = (hi << 4) | lo;
+    }
+
+  return TRUE;
+}
+
+static gchar *
+chunk_path (const gchar *store, const guint8 *id)
+{
+  gchar hex[65];
+
+  id_to_hex(id, hex);
+  return g_strdup_printf("%s/%.4s/%s.chunk", store, hex, hex);
+}
+
+static guint
+chunk_id_hash (gconstpointer key)
+{
+  guint h;
+
+  /* the ID is a SHA256 checksum, every part of it is a good hash */
+  memcpy(&h, key, sizeof(h));
+  return h;
+}
+
+static gboolean
+chunk_id_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp(a, b, 32) == 0;
+}
+
+/* Run all data through @conv, e.g. to compress or uncompress a chunk */
+static GByteArray *
+convert_data (GConverter *conv, const guint8 *data, gsize len, gsize hint,
+	      GError **error)
+{
+  GByteArray *out = g_byte_array_sized_new(hint);
+  GError *ierror = NULL;
+  gsize in_pos = 0, used = 0;
+
+  g_byte_array_set_size(out, MAX(hint, 4096));
+
+  for (;;)
+    {
+      gsize bytes_read = 0, bytes_written = 0;
+      GConverterResult r;
+
+      if (used == out->len)
+	g_byte_array_set_size(out, out->len * 2);
+
+      r = g_converter_convert(conv, data + in_pos, len - in_pos,
+			      out->data + used, out->len - used,
+			      G_CONVERTER_INPUT_AT_END,
+			      &bytes_read, &bytes_written, &ierror);
+      if (r == G_CONVERTER_ERROR)
+	{
+	  if (g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+	    {
+	      g_clear_error(&ierror);
+	      g_byte_array_set_size(out, out->len * 2);
+	      continue;
+	    }
+	  g_propagate_error(error, ierror);
+	  g_byte_array_unref(out);
+	  return NULL;
+	}
+      in_pos += bytes_read;
+      used += bytes_written;
+      if (r == G_CONVERTER_FINISHED)
+	break;
+    }
+
+  g_byte_array_set_size(out, used);
+
+  return out;
+}
+
+/* The index is a byte stream, the fields are not aligned */
+static inline guint32
+read_be32 (const guint8 *p)
+{
+  guint32 v;
+
+  memcpy(&v, p, sizeof(v));
+  return GUINT32_FROM_BE(v);
+}
+
+static inline guint64
+read_be64 (const guint8 *p)
+{
+  guint64 v;
+
+  memcpy(&v, p, sizeof(v));
+  return GUINT64_FROM_BE(v);
+}
+
+TIUChunkIndex *
+chunk_index_load (const gchar *filename, GError **error)
+{
+  g_autofree gchar *data = NULL;
+  TIUChunkIndex *idx;
+  const guint8 *p;
+  gsize len;
+  guint64 n_chunks, offset = 0;
+
+  g_return_val_if_fail(filename, NULL);
+  g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+  if (!g_file_get_contents(filename, &data, &len, error))
+    return NULL;
+
+  p = (const guint8 *)data;
+  if (len < INDEX_HEADER_SIZE ||
+      memcmp(p, CHUNK_INDEX_MAGIC, 8) != 0)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "'%s' is not a tiu chunk index", filename);
+      return NULL;
+    }
+
+  idx = g_new0(TIUChunkIndex, 1);
+  idx->min_size = read_be32(p + 8);
+  idx->avg_size = read_be32(p + 12);
+  idx->max_size = read_be32(p + 16);
+  idx->image_size = read_be64(p + 24);
+  n_chunks = read_be64(p + 32);
+  memcpy(idx->image_sha256, p + 40, 32);
+
+  if (n_chunks > (len - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE ||
+      len != INDEX_HEADER_SIZE + n_chunks * INDEX_ENTRY_SIZE ||
+      idx->min_size == 0 || idx->min_size > idx->avg_size ||
+      idx->avg_size > idx->max_size)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Chunk index '%s' is corrupt", filename);
+      chunk_index_free(idx);
+      return NULL;
+    }
+
+  idx->chunks = g_array_sized_new(FALSE, FALSE, sizeof(TIUChunk), n_chunks);
+  p += INDEX_HEADER_SIZE;
+  for (guint64 i = 0; i < n_chunks; i++, p += INDEX_ENTRY_SIZE)
+    {
+      TIUChunk chunk;
+
+      memcpy(chunk.id, p, 32);
+      chunk.size = read_be32(p + 32);
+      chunk.offset = offset;
+      offset += chunk.size;
+      g_array_append_val(idx->chunks, chunk);
+    }
+
+  if (offset != idx->image_size)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Chunk index '%s' is corrupt: chunks do not match image size",
+		  filename);
+      chunk_index_free(idx);
+      return NULL;
+    }
+
+  return idx;
+}
+
+void
+chunk_index_free (TIUChunkIndex *idx)
+{
+  if (idx == NULL)
+    return;
+
+  if (idx->chunks)
+    g_array_unref(idx->chunks);
+  g_free(idx);
+}
+
+static gboolean
+chunk_index_save (const TIUChunkIndex *idx, const gchar *filename,
+		  GError **error)
+{
+  g_autoptr(GByteArray) data = g_byte_array_new();
+  guint32 u32;
+  guint64 u64;
+
+  g_byte_array_append(data, (const guint8 *)CHUNK_INDEX_MAGIC, 8);
+  u32 = GUINT32_TO_BE(idx->min_size);
+  g_byte_array_append(data, (const guint8 *)&u32, 4);
+  u32 = GUINT32_TO_BE(idx->avg_size);
+  g_byte_array_append(data, (const guint8 *)&u32, 4);
+  u32 = GUINT32_TO_BE(idx->max_size);
+  g_byte_array_append(data, (const guint8 *)&u32, 4);
+  u32 = 0;
+  g_byte_array_append(data, (const guint8 *)&u32, 4);
+  u64 = GUINT64_TO_BE(idx->image_size);
+  g_byte_array_append(data, (const guint8 *)&u64, 8);
+  u64 = GUINT64_TO_BE(idx->chunks->len);
+  g_byte_array_append(data, (const guint8 *)&u64, 8);
+  g_byte_array_append(data, idx->image_sha256, 32);
+
+  for (guint i = 0; i < idx->chunks->len; i++)
+    {
+      const TIUChunk *chunk = &g_array_index(idx->chunks, TIUChunk, i);
+
+      g_byte_array_append(data, chunk->id, 32);
+      u32 = GUINT32_TO_BE(chunk->size);
+      g_byte_array_append(data, (const guint8 *)&u32, 4);
+    }
+
+  return g_file_set_contents(filename, (const gchar *)data->data, data->len,
+			     error);
+}
+
+typedef struct {
+  TIUChunkIndex *idx;
+  EVP_MD_CTX *md;
+  const gchar *store;
+  guint new_chunks;
+  guint64 stored_bytes;
+} CreateData;
+
+static gboolean
+store_chunk (const guint8 *data, gsize len, guint64 offset,
+	     gpointer user_data, GError **error)
+{
+  CreateData *cd = user_data;
+  TIUChunk chunk;
+  g_autofree gchar *path = NULL;
+
+  EVP_DigestUpdate(cd->md, data, len);
+  EVP_Digest(data, len, chunk.id, NULL, EVP_sha256(), NULL);
+  chunk.offset = offset;
+  chunk.size = len;
+  g_array_append_val(cd->idx->chunks, chunk);
+
+  path = chunk_path(cd->store, chunk.id);
+  if (!g_file_test(path, G_FILE_TEST_EXISTS))
+    {
+      g_autoptr(GZlibCompressor) comp = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 9);
+      g_autoptr(GByteArray) packed = NULL;
+      g_autofree gchar *dir = g_path_get_dirname(path);
+
+      packed = convert_data(G_CONVERTER(comp), data, len, len / 2, error);
+      if (packed == NULL)
+	return FALSE;
+
+      if (g_mkdir_with_parents(dir, 0755) != 0)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed creating directory '%s': %s", dir, g_strerror(err));
+	  return FALSE;
+	}
+      if (!g_file_set_contents(path, (const gchar *)packed->data, packed->len,
+			       error))
+	return FALSE;
+      cd->new_chunks++;
+      cd->stored_bytes += packed->len;
+    }
+
+  return TRUE;
+}
+
+/*
+  Split @image into chunks, add the missing ones to the chunk store
+  @store and write the description of the image to @index.
+*/
+gboolean
+chunk_index_create (const gchar *image, const gchar *index,
+		    const gchar *store, GError **error)
+{
+  CreateData cd = {0};
+  CDCParams params;
+  gboolean res = FALSE;
+  unsigned int md_len;
+  int fd;
+
+  g_return_val_if_fail(image, FALSE);
+  g_return_val_if_fail(index, FALSE);
+  g_return_val_if_fail(store, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  fd = open(image, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s': %s", image, g_strerror(err));
+      return FALSE;
+    }
+
+  cd.idx = g_new0(TIUChunkIndex, 1);
+  cd.idx->min_size = CHUNK_SIZE_MIN;
+  cd.idx->avg_size = CHUNK_SIZE_AVG;
+  cd.idx->max_size = CHUNK_SIZE_MAX;
+  cd.idx->chunks = g_array_new(FALSE, FALSE, sizeof(TIUChunk));
+  cd.store = store;
+  cd.md = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(cd.md, EVP_sha256(), NULL);
+
+  cdc_init(&params, CHUNK_SIZE_MIN, CHUNK_SIZE_AVG, CHUNK_SIZE_MAX);
+  if (!chunk_fd(fd, &params, store_chunk, &cd, error))
+    goto out;
+
+  EVP_DigestFinal_ex(cd.md, cd.idx->image_sha256, &md_len);
+  if (cd.idx->chunks->len > 0)
+    {
+      const TIUChunk *last = &g_array_index(cd.idx->chunks, TIUChunk,
+					    cd.idx->chunks->len - 1);
+      cd.idx->image_size = last->offset + last->size;
+    }
+
+  if (!chunk_index_save(cd.idx, index, error))
+    goto out;
+
+  if (verbose_flag)
+    g_printf("Created '%s': %u chunks, %u new chunks (%" G_GUINT64_FORMAT " bytes) in '%s'\n",
+	     index, cd.idx->chunks->len, cd.new_chunks, cd.stored_bytes, store);
+
+  res = TRUE;
+
+ out:
+  close(fd);
+  EVP_MD_CTX_free(cd.md);
+  chunk_index_free(cd.idx);
+
+  return res;
+}
+
+/* Where the data of a needed chunk can be found on this machine */
+typedef struct {
+  TIUChunk *chunk;
+  gboolean in_store;
+  gint64 seed_offset;   /* -1 if not in the seed */
+} ChunkSource;
+
+typedef struct {
+  GHashTable *needed;
+  guint found;
+} SeedData;
+
+static gboolean
+seed_chunk (const guint8 *data, gsize len, guint64 offset,
+	    gpointer user_data, GError **error __attribute__((unused)))
+{
+  SeedData *sd = user_data;
+  guint8 id[32];
+  ChunkSource *src;
+
+  EVP_Digest(data, len, id, NULL, EVP_sha256(), NULL);
+  src = g_hash_table_lookup(sd->needed, id);
+  if (src && !src->in_store && src->seed_offset < 0 &&
+      src->chunk->size == len)
+    {
+      src->seed_offset = offset;
+      sd->found++;
+    }
+
+  return TRUE;
+}
+
+/*
+  Find chunks in the image of the running system. If the index of
+  that image is known, it tells where the chunks are, otherwise the
+  device gets chunked the same way as the new image.
+*/
+static guint
+find_seed_chunks (GHashTable *needed, const TIUChunkIndex *idx, int seed_fd,
+		  const gchar *seed_index)
+{
+  SeedData sd = {needed, 0};
+  GError *ierror = NULL;
+
+  if (seed_index && g_file_test(seed_index, G_FILE_TEST_EXISTS))
+    {
+      TIUChunkIndex *sidx = chunk_index_load(seed_index, &ierror);
+
+      if (sidx)
+	{
+	  for (guint i = 0; i < sidx->chunks->len; i++)
+	    {
+	      const TIUChunk *chunk = &g_array_index(sidx->chunks, TIUChunk, i);
+	      ChunkSource *src = g_hash_table_lookup(needed, chunk->id);
+
+	      if (src && !src->in_store && src->seed_offset < 0)
+		{
+		  src->seed_offset = chunk->offset;
+		  sd.found++;
+		}
+	    }
+	  chunk_index_free(sidx);
+	  return sd.found;
+	}
+      if (debug_flag)
+	g_printf("Ignoring index of the running system: %s\n", ierror->message);
+      g_clear_error(&ierror);
+    }
+
+  CDCParams params;
+  cdc_init(&params, idx->min_size, idx->avg_size, idx->max_size);
+  if (!chunk_fd(seed_fd, &params, seed_chunk, &sd, &ierror))
+    {
+      /* not fatal, the chunks get downloaded instead */
+      if (verbose_flag)
+	g_printf("Reading the running system failed: %s\n", ierror->message);
+      g_clear_error(&ierror);
+    }
+
+  return sd.found;
+}
+
+static gboolean
+fetch_chunks (GPtrArray *missing, const gchar *store_url, guint64 *bytes,
+	      GError **error)
+{
+  g_autoptr(GPtrArray) urls = g_ptr_array_new_with_free_func(g_free);
+  g_autoptr(GPtrArray) targets = g_ptr_array_new_with_free_func(g_free);
+
+  for (guint i = 0; i < missing->len; i++)
+    {
+      const TIUChunk *chunk = g_ptr_array_index(missing, i);
+      gchar *target = chunk_path(TIU_CHUNK_STORE, chunk->id);
+      g_autofree gchar *dir = g_path_get_dirname(target);
+
+      if (g_mkdir_with_parents(dir, 0700) != 0)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed creating directory '%s': %s", dir, g_strerror(err));
+	  g_free(target);
+	  return FALSE;
+	}
+      g_ptr_array_add(urls, chunk_path(store_url, chunk->id));
+      g_ptr_array_add(targets, target);
+    }
+  g_ptr_array_add(urls, NULL);
+  g_ptr_array_add(targets, NULL);
+
+  if (!download_files((const gchar * const *)urls->pdata,
+		      (const gchar * const *)targets->pdata, error))
+    return FALSE;
+
+  for (guint i = 0; i < missing->len; i++)
+    {
+      GStatBuf st;
+
+      if (g_stat(g_ptr_array_index(targets, i), &st) == 0)
+	*bytes += st.st_size;
+    }
+
+  return TRUE;
+}
+
+/* Read a chunk from the local store and check that it is correct */
+static guint8 *
+read_store_chunk (const TIUChunk *chunk, GError **error)
+{
+  g_autofree gchar *path = chunk_path(TIU_CHUNK_STORE, chunk->id);
+  g_autofree gchar *packed = NULL;
+  g_autoptr(GZlibDecompressor) decomp = NULL;
+  GByteArray *data;
+  guint8 id[32];
+  gsize len;
+
+  if (!g_file_get_contents(path, &packed, &len, error))
+    return NULL;
+
+  decomp = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+  data = convert_data(G_CONVERTER(decomp), (const guint8 *)packed, len,
+		      chunk->size, error);
+  if (data == NULL)
+    {
+      g_prefix_error(error, "Chunk '%s' is corrupt: ", path);
+      g_remove(path);
+      return NULL;
+    }
+
+  EVP_Digest(data->data, data->len, id, NULL, EVP_sha256(), NULL);
+  if (data->len != chunk->size || memcmp(id, chunk->id, 32) != 0)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Chunk '%s' has wrong content", path);
+      g_remove(path);
+      g_byte_array_unref(data);
+      return NULL;
+    }
+
+  return g_byte_array_free(data, FALSE);
+}
+
+/* Read a chunk from the running system, NULL if it is not correct */
+static guint8 *
+read_seed_chunk (int fd, const ChunkSource *src)
+{
+  guint8 *data = g_malloc(src->chunk->size);
+  guint8 id[32];
+  gsize done = 0;
+
+  while (done < src->chunk->size)
+    {
+      ssize_t n = pread(fd, data + done, src->chunk->size - done,
+			src->seed_offset + done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  g_free(data);
+	  return NULL;
+	}
+      done += n;
+    }
+
+  EVP_Digest(data, done, id, NULL, EVP_sha256(), NULL);
+  if (memcmp(id, src->chunk->id, 32) != 0)
+    {
+      g_free(data);
+      return NULL;
+    }
+
+  return data;
+}
+
+/* Get the data of a chunk from the running system or the local store.
+   Chunks which are not what the index of the running system says get
+   downloaded. */
+static guint8 *
+get_chunk_data (ChunkSource *src, int seed_fd, const gchar *store_url,
+		guint64 *downloaded, GError **error)
+{
+  guint8 *data = NULL;
+
+  if (!src->in_store)
+    {
+      data = read_seed_chunk(seed_fd, src);
+      if (data != NULL)
+	return data;
+
+      /* the running system is not what its index says */
+      g_autoptr(GPtrArray) one = g_ptr_array_new();
+
+      g_ptr_array_add(one, src->chunk);
+      if (!fetch_chunks(one, store_url, downloaded, error))
+	return NULL;
+      src->in_store = TRUE;
+    }
+
+  return read_store_chunk(src->chunk, error);
+}
+
+/* Assemble the bytes @from to @to of the image into @buf */
+static gboolean
+read_image_range (const TIUChunkIndex *idx, GHashTable *needed, int seed_fd,
+		  const gchar *store_url, guint64 from, guint64 to,
+		  guint8 *buf, guint64 *downloaded, GError **error)
+{
+  guint lo = 0, hi = idx->chunks->len;
+
+  /* first chunk which ends behind @from */
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      const TIUChunk *chunk = &g_array_index(idx->chunks, TIUChunk, mid);
+
+      if (chunk->offset + chunk->size <= from)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  for (guint i = lo; i < idx->chunks->len; i++)
+    {
+      const TIUChunk *chunk = &g_array_index(idx->chunks, TIUChunk, i);
+      ChunkSource *src = g_hash_table_lookup(needed, chunk->id);
+      g_autofree guint8 *data = NULL;
+      guint64 start, end;
+
+      if (chunk->offset >= to)
+	break;
+
+      data = get_chunk_data(src, seed_fd, store_url, downloaded, error);
+      if (data == NULL)
+	return FALSE;
+
+      start = MAX(chunk->offset, from);
+      end = MIN(chunk->offset + chunk->size, to);
+      memcpy(buf + (start - from), data + (start - chunk->offset), end - start);
+    }
+
+  return TRUE;
+}
+
+/*
+  Read the verity manifest and hash tree at the end of the image
+  first, so that the slot writer can check every block before it
+  gets written. Images without verity data are written unchecked.
+*/
+static gboolean
+setup_verity (TIUSlotWriter *writer, const TIUChunkIndex *idx,
+	      GHashTable *needed, int seed_fd, const gchar *store_url,
+	      guint64 *downloaded, GError **error)
+{
+  gsize tail_len = MIN(VERITY_TRAILER_MAX, idx->image_size);
+  g_autofree guint8 *tail = g_malloc(tail_len);
+  g_autofree guint8 *tree = NULL;
+  GError *ierror = NULL;
+  VerityInfo info;
+
+  if (!read_image_range(idx, needed, seed_fd, store_url,
+			idx->image_size - tail_len, idx->image_size,
+			tail, downloaded, error))
+    return FALSE;
+
+  if (!verity_parse_trailer(tail, tail_len, idx->image_size, &info, &ierror))
+    {
+      if (verbose_flag)
+	g_printf("Image is not checked while writing: %s\n", ierror->message);
+      g_clear_error(&ierror);
+      return TRUE;
+    }
+
+  tree = g_malloc(info.tree_size ? info.tree_size : 1);
+  if (!read_image_range(idx, needed, seed_fd, store_url, info.data_size,
+			info.data_size + info.tree_size, tree, downloaded,
+			error))
+    return FALSE;
+
+  return slot_writer_set_verity(writer, &info, tree, error);
+}
+
+/* Remove all chunks from the local store which are not needed anymore */
+static void
+prune_store (GHashTable *needed)
+{
+  g_autoptr(GDir) store = g_dir_open(TIU_CHUNK_STORE, 0, NULL);
+  const gchar *subdir;
+
+  if (store == NULL)
+    return;
+
+  while ((subdir = g_dir_read_name(store)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename(TIU_CHUNK_STORE, subdir, NULL);
+      g_autoptr(GDir) dir = g_dir_open(path, 0, NULL);
+      const gchar *name;
+
+      if (dir == NULL)
+	continue;
+
+      while ((name = g_dir_read_name(dir)) != NULL)
+	{
+	  guint8 id[32];
+
+	  if (strlen(name) == 70 && g_str_has_suffix(name, ".chunk") &&
+	      hex_to_id(name, id) && g_hash_table_contains(needed, id))
+	    continue;
+
+	  g_autofree gchar *file = g_build_filename(path, name, NULL);
+	  g_remove(file);
+	}
+      g_rmdir(path);
+    }
+}
+
+/*
+  Write the image described by @index to @target. Chunks are taken
+  from the local chunk store, the running system @seed and, if they
+  cannot be found locally, downloaded from @store_url. @seed_index
+  is the index of the image in @seed, if known.
+*/
+gboolean
+chunk_update (const gchar *index, const gchar *store_url,
+	      const gchar *seed, const gchar *seed_index,
+	      const gchar *target, GError **error)
+{
+  TIUChunkIndex *idx = NULL;
+  g_autoptr(GHashTable) needed = NULL;
+  g_autoptr(GPtrArray) missing = NULL;
+  TIUSlotWriter *writer = NULL;
+  EVP_MD_CTX *md = NULL;
+  guint8 image_sha256[32];
+  unsigned int md_len;
+  guint n_store = 0, n_seed = 0;
+  guint64 downloaded = 0;
+  gboolean res = FALSE;
+  int seed_fd = -1;
+
+  g_return_val_if_fail(index, FALSE);
+  g_return_val_if_fail(store_url, FALSE);
+  g_return_val_if_fail(target, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  idx = chunk_index_load(index, error);
+  if (idx == NULL)
+    return FALSE;
+
+  needed = g_hash_table_new_full(chunk_id_hash, chunk_id_equal, NULL, g_free);
+  for (guint i = 0; i < idx->chunks->len; i++)
+    {
+      TIUChunk *chunk = &g_array_index(idx->chunks, TIUChunk, i);
+      ChunkSource *src;
+      g_autofree gchar *path = NULL;
+
+      if (g_hash_table_contains(needed, chunk->id))
+	continue;
+
+      src = g_new0(ChunkSource, 1);
+      src->chunk = chunk;
+      src->seed_offset = -1;
+      path = chunk_path(TIU_CHUNK_STORE, chunk->id);
+      src->in_store = g_file_test(path, G_FILE_TEST_EXISTS);
+      if (src->in_store)
+	n_store++;
+      g_hash_table_insert(needed, chunk->id, src);
+    }
+
+  if (seed && n_store < g_hash_table_size(needed))
+    {
+      seed_fd = open(seed, O_RDONLY|O_CLOEXEC);
+      if (seed_fd >= 0)
+	n_seed = find_seed_chunks(needed, idx, seed_fd, seed_index);
+      else if (verbose_flag)
+	g_printf("Cannot open '%s', all chunks get downloaded: %s\n",
+		 seed, g_strerror(errno));
+    }
+
+  missing = g_ptr_array_new();
+  {
+    GHashTableIter iter;
+    ChunkSource *src;
+
+    g_hash_table_iter_init(&iter, needed);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&src))
+      if (!src->in_store && src->seed_offset < 0)
+	g_ptr_array_add(missing, src->chunk);
+  }
+
+  if (!quiet_flag)
+    g_printf("Image has %u different chunks: %u in cache, %u in the running system, %u to download\n",
+	     g_hash_table_size(needed), n_store, n_seed, missing->len);
+
+  if (missing->len > 0)
+    {
+      if (!fetch_chunks(missing, store_url, &downloaded, error))
+	goto out;
+      for (guint i = 0; i < missing->len; i++)
+	{
+	  const TIUChunk *chunk = g_ptr_array_index(missing, i);
+	  ChunkSource *src = g_hash_table_lookup(needed, chunk->id);
+	  src->in_store = TRUE;
+	}
+    }
+
+  writer = slot_writer_new(target, idx->image_size, error);
+  if (writer == NULL)
+    goto out;
+
+  if (!setup_verity(writer, idx, needed, seed_fd, store_url, &downloaded,
+		    error))
+    goto out;
+
+  md = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+
+  for (guint i = 0; i < idx->chunks->len; i++)
+    {
+      const TIUChunk *chunk = &g_array_index(idx->chunks, TIUChunk, i);
+      ChunkSource *src = g_hash_table_lookup(needed, chunk->id);
+      g_autofree guint8 *data = NULL;
+
+      data = get_chunk_data(src, seed_fd, store_url, &downloaded, error);
+      if (data == NULL)
+	goto out;
+
+      EVP_DigestUpdate(md, data, chunk->size);
+      if (!slot_writer_write(writer, data, chunk->size, error))
+	goto out;
+    }
+
+  EVP_DigestFinal_ex(md, image_sha256, &md_len);
+  if (memcmp(image_sha256, idx->image_sha256, 32) != 0)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Checksum of the assembled image does not match the index");
+      goto out;
+    }
+
+  if (!slot_writer_finish(writer, error))
+    goto out;
+
+  if (verbose_flag)
+    g_printf("Downloaded %" G_GUINT64_FORMAT " bytes for an image of %" G_GUINT64_FORMAT " bytes\n",
+	     downloaded, idx->image_size);
+
+  /* only the chunks of the new image are worth keeping */
+  prune_store(needed);
+
+  res = TRUE;
+
+ out:
+  slot_writer_free(writer);
+  if (md)
+    EVP_MD_CTX_free(md);
+  if (seed_fd >= 0)
+    close(seed_fd);
+  /* the hash table points into the index */
+  g_clear_pointer(&needed, g_hash_table_unref);
+  chunk_index_free(idx);
+
+  return res;
+}
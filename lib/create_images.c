@@ -1,6 +1,11 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <libeconf.h>
 #include <glib/gprintf.h>
 #include <gio/gfiledescriptorbased.h>
@@ -11,20 +16,197 @@
 #include "tiu-internal.h"
 #include "verity_hash.h"
 #include "network.h"
+#include "tiu-chunk.h"
+#include "tiu-delta.h"
+#include "tiu-mount.h"
+#include "tiu-tar.h"
+
+/* Name of the catar archive until the product version is known */
+#define CATAR_TMPNAME ".tiu-rootfs.catar.tmp"
+
+/* Extension of the catar archive inside the image */
+#define CATAR "catar"
+
+/* Tar archive of /usr until the filesystem image is created from it */
+#define USR_TAR_TMPNAME ".tiu-usr.tar.tmp"
+
+/* Free space of the USR filesystem image before it gets shrunk */
+#define USR_IMAGE_SLACK (256*1024*1024)
+
+/* First version of mke2fs accepting a tar archive for -d */
+#define MKE2FS_TAR_VERSION 0x012f01  /* 1.47.1 */
+
+/* Fields of the ext4 superblock needed for the size of an image */
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPERBLOCK_SIZE 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x80
+
+/* Verity parameters appended to the image, the counterpart of
+   verity_parse_trailer() */
+typedef struct {
+  gchar *format;
+  gchar *verity_hash;
+  gchar *verity_salt;
+  guint64 verity_size;
+} tiu_manifest;
+
+/* Settings for mksquashfs */
+typedef struct {
+  const gchar *name;
+  const gchar *comp;     /* xz, zstd, lz4, gzip */
+  gint level;            /* 0: default of the compressor */
+  guint block_size;      /* 0: default of mksquashfs (128 KiB) */
+  gboolean fragments;
+  gboolean tail_ends;
+  guint processors;      /* 0: all */
+} SquashfsProfile;
+
+/* xz is the old default. How the others compare in size, build and
+   read speed depends on the rootfs, the "sweep" profile of
+   create_image() shows it. */
+static const SquashfsProfile squashfs_profiles[] = {
+  {"xz",       "xz",   0,  0,          TRUE,  FALSE, 0},
+  {"zstd",     "zstd", 15, 256*1024,   TRUE,  TRUE,  0},
+  {"zstd-max", "zstd", 19, 1024*1024,  TRUE,  TRUE,  0},
+  {"zstd-fast","zstd", 3,  128*1024,   TRUE,  TRUE,  0},
+  {"lz4",      "lz4",  0,  128*1024,   FALSE, FALSE, 0},
+  {"gzip",     "gzip", 9,  0,          TRUE,  FALSE, 0},
+};
+
+/* Levels accepted by the -Xcompression-level option of mksquashfs.
+   0 is the default of the compressor, xz has no levels and any
+   level of lz4 selects its high compression mode. */
+static gboolean
+check_level (const SquashfsProfile *profile, guint64 level,
+	     const gchar *desc, GError **error)
+{
+  guint64 max;
+
+  if (level == 0 || strcmp(profile->comp, "lz4") == 0)
+    return TRUE;
 
-static void
-cleanup(const gchar *tmpdir)
+  if (strcmp(profile->comp, "gzip") == 0)
+    max = 9;
+  else if (strcmp(profile->comp, "zstd") == 0)
+    max = 22;
+  else
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Invalid mksquashfs profile '%s': %s has no compression level",
+		  desc, profile->comp);
+      return FALSE;
+    }
+
+  if (level > max)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Invalid mksquashfs profile '%s': the level of %s is 1-%" G_GUINT64_FORMAT,
+		  desc, profile->comp, max);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+  Parse a profile description: the name of a predefined profile,
+  optionally followed by settings which override it, e.g.
+  "zstd:level=19,block=1M,processors=4,fragments=no,tail-ends=yes".
+*/
+static gboolean
+parse_squashfs_profile (const gchar *desc, SquashfsProfile *profile,
+			GError **error)
 {
-  workdir_destroy (tmpdir, NULL);
+  g_auto(GStrv) parts = g_strsplit(desc ? desc : "xz", ":", 2);
+  g_auto(GStrv) settings = NULL;
+  gboolean found = FALSE;
+
+  for (guint i = 0; i < G_N_ELEMENTS(squashfs_profiles); i++)
+    if (g_strcmp0(parts[0], squashfs_profiles[i].name) == 0)
+      {
+	*profile = squashfs_profiles[i];
+	found = TRUE;
+      }
+  if (!found)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Unknown mksquashfs profile '%s'", parts[0]);
+      return FALSE;
+    }
+
+  if (parts[1] == NULL)
+    return TRUE;
+
+  settings = g_strsplit(parts[1], ",", -1);
+  for (guint i = 0; settings[i] != NULL; i++)
+    {
+      g_auto(GStrv) kv = g_strsplit(settings[i], "=", 2);
+      gchar *end = NULL;
+      guint64 value;
+
+      if (kv[0] == NULL || kv[1] == NULL)
+	goto invalid;
+
+      if (strcmp(kv[0], "fragments") == 0 || strcmp(kv[0], "tail-ends") == 0)
+	{
+	  gboolean on;
+
+	  if (strcmp(kv[1], "yes") == 0)
+	    on = TRUE;
+	  else if (strcmp(kv[1], "no") == 0)
+	    on = FALSE;
+	  else
+	    goto invalid;
+	  if (kv[0][0] == 'f')
+	    profile->fragments = on;
+	  else
+	    profile->tail_ends = on;
+	  continue;
+	}
+
+      value = g_ascii_strtoull(kv[1], &end, 10);
+      if (end == kv[1])
+	goto invalid;
+      if (*end == 'K' || *end == 'k')
+	value *= 1024, end++;
+      else if (*end == 'M' || *end == 'm')
+	value *= 1024*1024, end++;
+      if (*end != '\0')
+	goto invalid;
+
+      if (strcmp(kv[0], "comp") == 0)
+	goto invalid;
+      else if (strcmp(kv[0], "level") == 0)
+	{
+	  if (!check_level(profile, value, desc, error))
+	    return FALSE;
+	  profile->level = value;
+	}
+      else if (strcmp(kv[0], "block") == 0)
+	profile->block_size = value;
+      else if (strcmp(kv[0], "processors") == 0)
+	profile->processors = value;
+      else
+	goto invalid;
+    }
+
+  return TRUE;
+
+ invalid:
+  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+	      "Invalid mksquashfs profile '%s'", desc);
+  return FALSE;
 }
 
 static gboolean
 mksquashfs (const gchar *manifest, const gchar *input1,
-	    const char *input2, const char *output, GError **error)
+	    const char *input2, const char *output,
+	    const SquashfsProfile *profile, GError **error)
 {
   g_autoptr (GSubprocess) sproc = NULL;
   GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(15, g_free);
+  GPtrArray *args = g_ptr_array_new_full(24, g_free);
 
   if (debug_flag)
     g_printf("Run mksquashfs to generate '%s'...\n", output);
@@ -36,7 +218,32 @@ mksquashfs (const gchar *manifest, const gchar *input1,
     g_ptr_array_add(args, g_strdup(input2));
   g_ptr_array_add(args, g_strdup(output));
   g_ptr_array_add(args, g_strdup("-comp"));
-  g_ptr_array_add(args, g_strdup("xz"));
+  g_ptr_array_add(args, g_strdup(profile->comp));
+  if (profile->level > 0)
+    {
+      if (strcmp(profile->comp, "lz4") == 0)
+	/* lz4 has no levels, only the high compression mode */
+	g_ptr_array_add(args, g_strdup("-Xhc"));
+      else
+	{
+	  g_ptr_array_add(args, g_strdup("-Xcompression-level"));
+	  g_ptr_array_add(args, g_strdup_printf("%i", profile->level));
+	}
+    }
+  if (profile->block_size > 0)
+    {
+      g_ptr_array_add(args, g_strdup("-b"));
+      g_ptr_array_add(args, g_strdup_printf("%u", profile->block_size));
+    }
+  if (!profile->fragments)
+    g_ptr_array_add(args, g_strdup("-no-fragments"));
+  if (profile->tail_ends)
+    g_ptr_array_add(args, g_strdup("-always-use-fragments"));
+  if (profile->processors > 0)
+    {
+      g_ptr_array_add(args, g_strdup("-processors"));
+      g_ptr_array_add(args, g_strdup_printf("%u", profile->processors));
+    }
   g_ptr_array_add(args, g_strdup("-all-root"));
   g_ptr_array_add(args, g_strdup("-no-xattrs"));
   g_ptr_array_add(args, g_strdup("-noappend"));
@@ -46,6 +253,7 @@ mksquashfs (const gchar *manifest, const gchar *input1,
 
   sproc = g_subprocess_newv((const gchar * const *)args->pdata,
                             G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+  g_ptr_array_free(args, TRUE);
   if (sproc == NULL)
     {
       g_propagate_prefixed_error(error, ierror, "Failed to start mksquashfs: ");
@@ -62,41 +270,471 @@ mksquashfs (const gchar *manifest, const gchar *input1,
   return TRUE;
 }
 
+/* Time to unpack @image completely, a measure for the read speed */
 static gboolean
-rm_dir_content (const gchar *dir, const gchar *tmpdir, GError **error)
+time_unsquashfs (const gchar *image, gdouble *seconds, GError **error)
 {
-  g_autoptr(GFileEnumerator) enumerator = NULL;
+  g_autoptr (GSubprocess) sproc = NULL;
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *dest = NULL;
+  GError *ierror = NULL;
+  gint64 start;
 
-  GFile *file = g_file_new_for_path (g_strjoin("/", tmpdir, dir, NULL));
-  enumerator = g_file_enumerate_children (file,
-					  G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                          NULL, NULL);
+  dir = g_dir_make_tmp("tiu-sweep-XXXXXX", &ierror);
+  if (dir == NULL)
+    {
+      g_propagate_error(error, ierror);
+      return FALSE;
+    }
+  dest = g_build_filename(dir, "root", NULL);
 
-  while (enumerator != NULL)
+  start = g_get_monotonic_time();
+  sproc = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror,
+			   "unsquashfs", "-no-progress", "-d", dest, image, NULL);
+  if (sproc == NULL || !g_subprocess_wait_check(sproc, NULL, &ierror))
     {
-      GFile *child;
+      g_propagate_prefixed_error(error, ierror, "Failed to run unsquashfs: ");
+      rmdir_rf(dir, NULL, NULL);
+      return FALSE;
+    }
+  *seconds = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
 
-      if (!g_file_enumerator_iterate (enumerator, NULL, &child, NULL, error))
-        return FALSE;
-      if (child == NULL)
-        break;
+  rmdir_rf(dir, NULL, NULL);
 
-      /* Don't follow symlinks! */
-      if (g_file_query_file_type (child, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-				  NULL) == G_FILE_TYPE_SYMBOLIC_LINK)
+  return TRUE;
+}
+
+/*
+  Build the image with every predefined profile and report size,
+  build time and decompression throughput of each.
+*/
+static gboolean
+sweep_squashfs_profiles (const gchar *manifest, const gchar *input,
+			 const gchar *output, GError **error)
+{
+  GStatBuf st;
+  guint64 input_size = 0;
+
+  if (g_stat(manifest, &st) == 0)
+    input_size += st.st_size;
+  if (g_stat(input, &st) == 0)
+    input_size += st.st_size;
+
+  g_printf("%-10s %14s %8s %10s %14s\n", "profile", "size", "ratio",
+	   "build(s)", "unpack(MiB/s)");
+
+  for (guint i = 0; i < G_N_ELEMENTS(squashfs_profiles); i++)
+    {
+      const SquashfsProfile *profile = &squashfs_profiles[i];
+      g_autofree gchar *image = g_strdup_printf("%s.%s", output, profile->name);
+      gdouble build, unpack = 0;
+      gint64 start;
+
+      start = g_get_monotonic_time();
+      if (!mksquashfs(manifest, input, NULL, image, profile, error))
+	return FALSE;
+      build = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      if (g_stat(image, &st) != 0)
 	{
-	  g_file_delete (child, NULL, error);
-	  continue;
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to stat '%s': %s", image, g_strerror(err));
+	  return FALSE;
+	}
+      if (!time_unsquashfs(image, &unpack, error))
+	{
+	  g_remove(image);
+	  return FALSE;
+	}
+      g_remove(image);
+
+      g_printf("%-10s %14" G_GINT64_FORMAT " %7.1f%% %10.1f %14.1f\n",
+	       profile->name, (gint64)st.st_size,
+	       input_size ? 100.0 * st.st_size / input_size : 0.0, build,
+	       unpack > 0 ? input_size / unpack / (1024*1024) : 0.0);
+    }
+
+  return TRUE;
+}
+
+/* Directories of the rootfs whose content is not part of the image */
+static const gchar * const catar_exclude[] = {
+  "boot/writable",
+  "usr/local",
+  NULL
+};
+
+/* Bind mounted by chroot_launcher_new() */
+static const gchar * const chroot_dirs[] = {"dev", "proc", "sys"};
+
+/*
+  Extract @input into @root and build a generic (not host-only) initrd
+  for every kernel in it, as usr/lib/modules/<version>/initrd like a
+  kernel package shipping a prebuilt one. Kernels which already have
+  one are skipped. The new files, relative to @root, are added to
+  @initrds.
+*/
+static gboolean
+build_initrds (const gchar *input, const gchar *root, GPtrArray *initrds,
+	       GError **error)
+{
+  g_autofree gchar *modules = g_build_filename(root, "usr/lib/modules", NULL);
+  g_autoptr(GDir) dir = NULL;
+  GError *ierror = NULL;
+  const gchar *kver;
+  gint64 start;
+
+  if (g_mkdir_with_parents(root, 0755) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", root, g_strerror(err));
+      return FALSE;
+    }
+
+  if (!tar_extract(input, root, NULL, NULL, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to extract '%s' for dracut: ", input);
+      return FALSE;
+    }
+
+  /* mount points of the chroot, a rootfs tarball may not have them;
+     this is only the scratch copy, the image is built from @input */
+  for (guint i = 0; i < G_N_ELEMENTS(chroot_dirs); i++)
+    {
+      g_autofree gchar *path = g_build_filename(root, chroot_dirs[i], NULL);
+
+      if (g_mkdir_with_parents(path, 0755) != 0)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to create '%s': %s", path, g_strerror(err));
+	  return FALSE;
+	}
+    }
+
+  if ((dir = g_dir_open(modules, 0, &ierror)) == NULL)
+    {
+      g_propagate_error(error, ierror);
+      return FALSE;
+    }
+
+  while ((kver = g_dir_read_name(dir)) != NULL)
+    {
+      g_autoptr(GSubprocessLauncher) launcher = NULL;
+      g_autoptr(GSubprocess) sproc = NULL;
+      g_autofree gchar *kernel = g_build_filename(modules, kver, "vmlinuz", NULL);
+      g_autofree gchar *initrd = g_build_filename("usr/lib/modules", kver, "initrd", NULL);
+      g_autofree gchar *target = g_strconcat("/", initrd, NULL);
+      g_autofree gchar *path = g_build_filename(root, initrd, NULL);
+      const gchar *argv[] = {"chroot", root, "dracut", "--no-hostonly",
+			     "--force", "--kver", kver, target, NULL};
+
+      if (!g_file_test(kernel, G_FILE_TEST_EXISTS) ||
+	  g_file_test(path, G_FILE_TEST_EXISTS))
+	continue;
+
+      if (verbose_flag)
+	g_printf("Building initrd for kernel %s...\n", kver);
+      start = g_get_monotonic_time();
+
+      launcher = chroot_launcher_new(NULL, root,
+				     G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+      if (launcher)
+	sproc = g_subprocess_launcher_spawnv(launcher, argv, &ierror);
+      if (sproc == NULL || !g_subprocess_wait_check(sproc, NULL, &ierror))
+	{
+	  g_propagate_prefixed_error(error, ierror,
+				     "Failed to build initrd for %s: ", kver);
+	  return FALSE;
 	}
+      g_ptr_array_add(initrds, g_steal_pointer(&initrd));
 
-      if (!rm_rf (child, NULL, error))
-        return FALSE;
+      if (verbose_flag)
+	g_printf("Built initrd for kernel %s in %.1f seconds\n", kver,
+		 (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC);
     }
 
   return TRUE;
 }
 
+/*
+  Stream the rootfs tarball @input through the needed rewrites into
+  "desync tar", which creates the catar archive @catar. The files in
+  @append (relative to @append_root) are added to it. The same
+  stream, restricted to /usr, is written to the tar archive @usr_tar
+  for the filesystem image of the USR partitions. The input is read
+  only once, the content of os-release is returned in @os_release.
+*/
+static gboolean
+create_catar (const gchar *input, const gchar *catar, const gchar *usr_tar,
+	      const gchar *append_root, const gchar * const *append,
+	      GBytes **os_release, GError **error)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GSubprocess) sproc = NULL;
+  TarRewrite rw = {
+    .relocate_from = "etc",
+    .relocate_to = "usr/share/factory/etc",
+    .exclude = catar_exclude,
+    .capture = "usr/lib/os-release",
+    .append_root = append_root,
+    .append = append,
+    .subtree = "usr",
+  };
+  const gchar *argv[] = {"desync", "tar", "--input-format", "tar",
+			 catar, "-", NULL};
+  GError *ierror = NULL;
+  sigset_t sigpipe, oldmask;
+  gboolean res;
+  int pfd[2];
+
+  rw.subtree_fd = open(usr_tar, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (rw.subtree_fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", usr_tar, g_strerror(err));
+      return FALSE;
+    }
+
+  if (pipe2(pfd, O_CLOEXEC) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create pipe: %s", g_strerror(err));
+      close(rw.subtree_fd);
+      return FALSE;
+    }
+
+  launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_take_stdin_fd(launcher, pfd[0]);
+  sproc = g_subprocess_launcher_spawnv(launcher, argv, &ierror);
+  /* the launcher owns the read end: if desync exits early, writing
+     must fail with EPIPE instead of blocking on a full pipe */
+  g_clear_object(&launcher);
+  if (sproc == NULL)
+    {
+      close(pfd[1]);
+      close(rw.subtree_fd);
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to start desync: ");
+      return FALSE;
+    }
+
+  if (debug_flag)
+    g_printf("Streaming '%s' into '%s'...\n", input, catar);
+
+  /* EPIPE becomes an error of tar_rewrite(), SIGPIPE must not kill us */
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &oldmask);
+  res = tar_rewrite(input, pfd[1], &rw, &ierror);
+  /* desync sees EOF only after the last writer is gone */
+  close(pfd[1]);
+  if (!res)
+    {
+      const struct timespec zero = {0, 0};
+
+      /* drop the SIGPIPE of the failed write */
+      while (sigtimedwait(&sigpipe, NULL, &zero) == SIGPIPE)
+	;
+    }
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  if (close(rw.subtree_fd) < 0 && res)
+    {
+      int err = errno;
+      g_set_error(&ierror, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to write '%s': %s", usr_tar, g_strerror(err));
+      res = FALSE;
+    }
+  if (!res)
+    {
+      g_subprocess_force_exit(sproc);
+      g_subprocess_wait(sproc, NULL, NULL);
+      g_clear_pointer(&rw.captured, g_bytes_unref);
+      /* desync exited on its own (it was not killed above), its
+	 failure is why the stream broke */
+      if (g_subprocess_get_if_exited(sproc) &&
+	  g_subprocess_get_exit_status(sproc) != 0)
+	{
+	  g_clear_error(&ierror);
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to create '%s': desync exited with code %i",
+		      catar, g_subprocess_get_exit_status(sproc));
+	}
+      else
+	g_propagate_error(error, ierror);
+      return FALSE;
+    }
+
+  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+    {
+      g_clear_pointer(&rw.captured, g_bytes_unref);
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to create '%s': ", catar);
+      return FALSE;
+    }
+
+  if (rw.captured == NULL)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+		  "'%s' contains no usr/lib/os-release", input);
+      return FALSE;
+    }
+
+  *os_release = rw.captured;
+  return TRUE;
+}
+
+static gboolean
+run_command (const gchar * const *argv, GError **error)
+{
+  g_autoptr(GSubprocess) sproc = NULL;
+  GError *ierror = NULL;
+
+  if (debug_flag)
+    g_printf("Run %s...\n", argv[0]);
+
+  sproc = g_subprocess_newv(argv, G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+  if (sproc == NULL || !g_subprocess_wait_check(sproc, NULL, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror, "Failed to run %s: ", argv[0]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static guint32
+get_le32 (const guint8 *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (guint32)p[3] << 24;
+}
+
+/* Size of the ext4 filesystem in @fd, from its superblock */
+static gboolean
+ext4_size (int fd, guint64 *size, GError **error)
+{
+  guint8 sb[EXT4_SUPERBLOCK_SIZE];
+  guint64 blocks;
+  guint32 log_block_size;
+
+  if (pread(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) != sizeof(sb) ||
+      (get_le32(sb + 0x38) & 0xffff) != EXT4_SUPER_MAGIC)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "No ext4 superblock found");
+      return FALSE;
+    }
+
+  blocks = get_le32(sb + 0x04);
+  if (get_le32(sb + 0x60) & EXT4_FEATURE_INCOMPAT_64BIT)
+    blocks |= (guint64)get_le32(sb + 0x150) << 32;
+  log_block_size = get_le32(sb + 0x18);
+
+  *size = blocks << (10 + log_block_size);
+  return TRUE;
+}
+
+/* mke2fs -V prints "mke2fs 1.47.1 (20-May-2024)" on stderr */
+static gboolean
+check_mke2fs (GError **error)
+{
+  g_autoptr(GSubprocess) sproc = NULL;
+  g_autofree gchar *out = NULL;
+  guint major = 0, minor = 0, micro = 0;
+
+  sproc = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE|
+			   G_SUBPROCESS_FLAGS_STDERR_MERGE, error,
+			   "mke2fs", "-V", NULL);
+  if (sproc == NULL ||
+      !g_subprocess_communicate_utf8(sproc, NULL, NULL, &out, NULL, error))
+    {
+      g_prefix_error(error, "Failed to run mke2fs: ");
+      return FALSE;
+    }
+
+  if (out == NULL ||
+      sscanf(out, "mke2fs %u.%u.%u", &major, &minor, &micro) < 2 ||
+      (major << 16 | minor << 8 | micro) < MKE2FS_TAR_VERSION)
+    {
+      if (out)
+	out[strcspn(out, "\n")] = '\0';
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "e2fsprogs 1.47.1 or newer is needed to create the USR "
+		  "image from a tar archive, found '%s'", out ? out : "");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+  Create the ext4 image @image of the USR partitions from the tar
+  archive @usr_tar. It is created with plenty of free space, shrunk
+  to the minimal size and cut behind the last block of the
+  filesystem, so the verity hash tree can be appended.
+*/
+static gboolean
+mkfs_usr (const gchar *usr_tar, const gchar *image, GError **error)
+{
+  g_autofree gchar *size_arg = NULL;
+  GStatBuf st;
+  guint64 size;
+  int fd;
+
+  if (g_stat(usr_tar, &st) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to stat '%s': %s", usr_tar, g_strerror(err));
+      return FALSE;
+    }
+  /* small files need a whole block each, the image file is sparse */
+  size_arg = g_strdup_printf("%" G_GUINT64_FORMAT "k",
+			     ((guint64)st.st_size * 2 + USR_IMAGE_SLACK) / 1024);
+
+  g_remove(image);
+  const gchar *mke2fs[] = {"mke2fs", "-q", "-F", "-t", "ext4", "-b", "4096",
+			   "-m", "0", "-L", "USR", "-d", usr_tar, image,
+			   size_arg, NULL};
+  if (!run_command(mke2fs, error))
+    return FALSE;
+
+  const gchar *resize2fs[] = {"resize2fs", "-M", image, NULL};
+  if (!run_command(resize2fs, error))
+    return FALSE;
+
+  fd = open(image, O_RDWR|O_CLOEXEC);
+  if (fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s': %s", image, g_strerror(err));
+      return FALSE;
+    }
+  if (!ext4_size(fd, &size, error))
+    {
+      g_prefix_error(error, "%s: ", image);
+      close(fd);
+      return FALSE;
+    }
+  if (ftruncate(fd, size) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to truncate '%s': %s", image, g_strerror(err));
+      close(fd);
+      return FALSE;
+    }
+  close(fd);
+
+  return TRUE;
+}
+
 static gchar *
 r_hex_encode(const guint8 *raw, size_t len)
 {
@@ -234,39 +872,28 @@ calc_verity (const gchar *tiufile, GError **error)
   /* dm-verity hash table generation */
   if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1)
     {
-      /* XXX
-      g_set_error(error,
-		  R_SIGNATURE_ERROR,
-		  R_SIGNATURE_ERROR_CREATE_SIG,
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
 		  "failed to generate verity salt");
-      */
       return FALSE;
     }
-  if (offset % 4096 != 0)
+  if (offset % VERITY_BLOCK_SIZE != 0)
     {
-      /* XXX
-      g_set_error(error,
-		  R_SIGNATURE_ERROR,
-		  R_SIGNATURE_ERROR_CREATE_SIG,
-		  "squashfs size (%"G_GUINT64_FORMAT ") is not a multiple of 4096 bytes", offset);
-      */
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "squashfs size (%" G_GUINT64_FORMAT ") is not a multiple of %i bytes",
+		  offset, VERITY_BLOCK_SIZE);
       return FALSE;
     }
-  if (verity_create_or_verify_hash(0, bundlefd, offset/4096,
+  if (verity_create_or_verify_hash(0, bundlefd, offset/VERITY_BLOCK_SIZE,
 				   &combined_size, hash, salt) != 0)
     {
-      /*
-	g_set_error(error,
-	R_SIGNATURE_ERROR,
-	R_SIGNATURE_ERROR_CREATE_SIG,
-	"failed to generate verity hash tree");
-      */
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "failed to generate verity hash tree");
       return FALSE;
     }
   /* for a squashfs <= 4096 bytes, we don't have a hash table */
-  g_assert(combined_size*4096 >= (off_t)offset);
-  verity_size = combined_size*4096 - offset;
-  g_assert(verity_size % 4096 == 0);
+  g_assert(combined_size*VERITY_BLOCK_SIZE >= (off_t)offset);
+  verity_size = combined_size*VERITY_BLOCK_SIZE - offset;
+  g_assert(verity_size % VERITY_BLOCK_SIZE == 0);
 
   manifest.format = g_strdup("verity");
   manifest.verity_salt = r_hex_encode(salt, sizeof(salt));
@@ -274,6 +901,9 @@ calc_verity (const gchar *tiufile, GError **error)
   manifest.verity_size = verity_size;
 
   convert_manifest_to_mem(&mem_manifest, &manifest);
+  g_free(manifest.format);
+  g_free(manifest.verity_salt);
+  g_free(manifest.verity_hash);
 
   if (!g_seekable_seek(G_SEEKABLE(stream), 0, G_SEEK_END, NULL, &ierror))
     {
@@ -308,21 +938,90 @@ calc_verity (const gchar *tiufile, GError **error)
   return TRUE;
 }
 
+/* Value of @key in os-release, NULL with @error set if it is missing */
+static gchar *
+os_release_get (econf_file *os_release, const gchar *key, GError **error)
+{
+  char *value = NULL;
+  econf_err ecerror;
+
+  if ((ecerror = econf_getStringValue (os_release, "", key, &value)))
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Couldn't read \"%s\" from os-release: %s", key,
+		  econf_errString(ecerror));
+      return NULL;
+    }
+
+  return value;
+}
+
+/*
+  Create the tiu images from @input in @outputdir: the squashfs image
+  with the catar archive of the rootfs and the ext4 image of the USR
+  partitions, both with a verity hash tree. If @store is set, the
+  chunks of the USR image are added to this chunk store and a chunk
+  index for it is written. If @previous is set, it is the USR image
+  (.img) of the previous release and a delta archive of the new USR
+  image against it is created, too.
+  @profile selects the mksquashfs
+  settings (see parse_squashfs_profile()), NULL for the default. With
+  "sweep" all profiles are compared first, the image is built with
+  the default. With @initrd, generic initrds are built into the
+  image, so devices don't need to run dracut during an update.
+*/
 gboolean
-create_image (const gchar *input, GError **gerror)
+create_image (const gchar *input, const gchar *outputdir,
+	      const gchar *previous, const gchar *store, const gchar *profile,
+	      gboolean initrd, GError **error)
 {
   const gchar *cachedir = "/var/cache/tiu";
-  const gchar *tmpdir = NULL;
+  g_autofree gchar *tmpdir = NULL;
+  g_autofree gchar *scheme = NULL;
+  g_autoptr(GBytes) os_release_data = NULL;
+  g_autoptr(GPtrArray) initrds = g_ptr_array_new_with_free_func(g_free);
   econf_file *os_release = NULL;
-  econf_err error;
+  econf_file *manifest = NULL;
+  econf_err ecerror;
   g_autofree gchar *lf = NULL;
+  g_autofree gchar *catar_tmp = NULL;
+  g_autofree gchar *usr_tmp = NULL;
+  g_autofree gchar *initrd_root = NULL;
+  g_autofree gchar *libosrelease = NULL;
+  g_autofree gchar *version_id = NULL;
+  g_autofree gchar *product_name = NULL;
+  g_autofree gchar *pretty_name = NULL;
+  g_autofree gchar *product_id = NULL;
+  g_autofree gchar *pvers = NULL;
+  g_autofree gchar *pvers_tar = NULL;
+  g_autofree gchar *catar = NULL;
+  g_autofree gchar *manifest_file = NULL;
+  g_autofree gchar *output_tiutar = NULL;
+  g_autofree gchar *output_img = NULL;
+  g_autofree gchar *output_tiuidx = NULL;
   GError *ierror = NULL;
+  gboolean sweep = (g_strcmp0 (profile, "sweep") == 0);
+  gboolean retval = FALSE;
+  SquashfsProfile squashfs_profile;
+
+  g_return_val_if_fail(input, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  if (outputdir == NULL)
+    outputdir = ".";
+
+  if (!parse_squashfs_profile (sweep ? NULL : profile, &squashfs_profile, error))
+    return FALSE;
+
+  /* fail before the long running steps, mkfs_usr() comes last */
+  if (!check_mke2fs (error))
+    return FALSE;
 
   if (debug_flag)
     g_printf("Start creating tiu update images from '%s'...\n",
 	     input);
 
-  gchar *scheme = g_uri_parse_scheme(input);
+  scheme = g_uri_parse_scheme(input);
 
   if (is_remote_scheme(scheme))
     {
@@ -330,7 +1029,7 @@ create_image (const gchar *input, GError **gerror)
 
       if (g_mkdir_with_parents(cachedir, 0700) != 0)
         {
-          g_set_error(gerror, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+          g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
                       "Failed creating cache directory '%s'", cachedir);
           return FALSE;
         }
@@ -340,15 +1039,15 @@ create_image (const gchar *input, GError **gerror)
 
       if (!network_init(&ierror))
         {
-          g_propagate_error(gerror, ierror);
+          g_propagate_error(error, ierror);
           return FALSE;
         }
 
       /* Make sure the file does not exist in the cache */
       g_remove (lf);
-      if (!download_file(lf, input, DEFAULT_MAX_DOWNLOAD_SIZE, &ierror))
+      if (!download_file(lf, input, NULL, DEFAULT_MAX_DOWNLOAD_SIZE, &ierror))
         {
-          g_propagate_prefixed_error(gerror, ierror,
+          g_propagate_prefixed_error(error, ierror,
 				     "Failed to download input archive %s: ",
 				     input);
           return FALSE;
@@ -361,123 +1060,80 @@ create_image (const gchar *input, GError **gerror)
       lf = g_strdup(input);
     }
 
-  if (!workdir_setup (lf, &tmpdir, &ierror))
+  if (g_mkdir_with_parents(outputdir, 0755) != 0)
     {
-      g_propagate_error(gerror, ierror);
-      cleanup (tmpdir);
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", outputdir, g_strerror(err));
       return FALSE;
     }
 
-  char *libosrelease = g_strjoin ("/", tmpdir, "usr", "lib/os-release", NULL);
-  if ((error = econf_readFile (&os_release, libosrelease, "=", "#")))
+  /* Only os-release, the manifest and the tree for dracut are
+     stored here */
+  tmpdir = g_dir_make_tmp ("tiu-XXXXXX", &ierror);
+  if (tmpdir == NULL)
     {
-      fprintf (stderr, "ERROR: couldn't read os-release: %s\n",
-	       econf_errString(error));
-      cleanup (tmpdir);
+      g_propagate_prefixed_error(error, ierror,
+				 "Failed to create working directory: ");
       return FALSE;
     }
 
-  char *version_id = NULL;
-  if ((error = econf_getStringValue (os_release, "", "VERSION_ID",
-				     &version_id)))
-    {
-      /* XXX g_set_error */
-      fprintf (stderr,
-	       "ERROR: couldn't read \"VERSION_ID\" from os-release: %s\n",
-	       econf_errString(error));
-      cleanup (tmpdir);
-      return FALSE;
-    }
-  char *product_name = NULL;
-  if ((error = econf_getStringValue (os_release, "", "NAME",
-				     &product_name)))
-    {
-      /* XXX g_set_error */
-      fprintf (stderr,
-	       "ERROR: couldn't read \"NAME\" from os-release: %s\n",
-	       econf_errString(error));
-      cleanup (tmpdir);
-      return FALSE;
-    }
-  for (size_t i = 0; i < strlen(product_name); i++)
+  initrd_root = g_build_filename (tmpdir, "root", NULL);
+  if (initrd && !build_initrds (lf, initrd_root, initrds, error))
+    goto out;
+  g_ptr_array_add (initrds, NULL);
+
+  /* The name of the catar archive is only known after os-release
+     was read, so create it with a temporary name first */
+  catar_tmp = g_build_filename (outputdir, CATAR_TMPNAME, NULL);
+  usr_tmp = g_build_filename (outputdir, USR_TAR_TMPNAME, NULL);
+  if (!create_catar (lf, catar_tmp, usr_tmp, initrd_root,
+		     (const gchar * const *)initrds->pdata,
+		     &os_release_data, error))
+    goto out;
+
+  libosrelease = g_build_filename (tmpdir, "os-release", NULL);
+  if (!g_file_set_contents (libosrelease,
+			    g_bytes_get_data (os_release_data, NULL),
+			    g_bytes_get_size (os_release_data), error))
+    goto out;
+
+  if ((ecerror = econf_readFile (&os_release, libosrelease, "=", "#")))
     {
-      if (product_name[i] == ' ')
-	product_name[i] = '-';
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Couldn't read os-release: %s", econf_errString(ecerror));
+      goto out;
     }
 
-  char *pretty_name = NULL;
-  if ((error = econf_getStringValue (os_release, "", "PRETTY_NAME",
-				     &pretty_name)))
-    {
-      /* XXX g_set_error */
-      fprintf (stderr,
-	       "ERROR: couldn't read \"PRETTY_NAME\" from os-release: %s\n",
-	       econf_errString(error));
-      cleanup (tmpdir);
-      return FALSE;
-    }
+  if ((version_id = os_release_get (os_release, "VERSION_ID", error)) == NULL ||
+      (product_name = os_release_get (os_release, "NAME", error)) == NULL ||
+      (pretty_name = os_release_get (os_release, "PRETTY_NAME", error)) == NULL ||
+      (product_id = os_release_get (os_release, "ID", error)) == NULL)
+    goto out;
 
-  if (debug_flag)
-    g_printf("Product: \"%s-%s\" (%s)\n", product_name, version_id, pretty_name);
+  g_strdelimit (product_name, " ", '-');
 
-  char *product_id = NULL;
-  if ((error = econf_getStringValue (os_release, "", "ID",
-				     &product_id)))
-    {
-      /* XXX g_set_error */
-      fprintf (stderr,
-	       "ERROR: couldn't read \"ID\" from os-release: %s\n",
-	       econf_errString(error));
-      cleanup (tmpdir);
-      return FALSE;
-    }
-
-  /* Cleanup subvolumes */
   if (debug_flag)
-    g_print("Cleanup of subvolumes...\n");
-  rm_dir_content("boot/writable", tmpdir, gerror);
-  rm_dir_content("usr/local", tmpdir, gerror);
-
-  gchar *pvers = g_strjoin("-", product_name, version_id, NULL);
-  gchar *pvers_tar = g_strjoin(".", pvers, CATAR, NULL);
-
-#if 0 /* XXX introduce --with-casync? */
-  gchar *pvers_idx = g_strjoin(".", pvers, CAIDX, NULL);
-  gchar *pvers_str = g_strjoin(".", pvers, CASTR, NULL);
+    g_printf("Product: \"%s-%s\" (%s)\n", product_name, version_id, pretty_name);
 
-  if (!casync_make (tmpdir, pvers_idx, pvers_str, gerror))
-    {
-      if (debug_flag)
-	fprintf (stderr, "ERROR: no caidx archive created, aborting...\n");
-      cleanup (tmpdir);
-      return FALSE;
-    }
+  pvers = g_strjoin("-", product_name, version_id, NULL);
+  pvers_tar = g_strjoin(".", pvers, CATAR, NULL);
+  catar = g_build_filename (outputdir, pvers_tar, NULL);
 
-  if (!casync_make (tmpdir, pvers_tar, NULL, gerror))
+  if (g_rename (catar_tmp, catar) != 0)
     {
-      if (debug_flag)
-	fprintf (stderr, "ERROR: no catar archive created, aborting...\n");
-      cleanup (tmpdir);
-      return FALSE;
-    }
-#else
-    if (!desync_tar (tmpdir, pvers_tar, NULL, gerror))
-    {
-      if (debug_flag)
-	fprintf (stderr, "ERROR: no catar archive created, aborting...\n");
-      cleanup (tmpdir);
-      return FALSE;
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to rename '%s' to '%s': %s", catar_tmp,
+		  catar, g_strerror(err));
+      goto out;
     }
-#endif
 
-  econf_file *manifest;
-  if ((error = econf_newKeyFile(&manifest, '=', '#')))
+  if ((ecerror = econf_newKeyFile(&manifest, '=', '#')))
     {
-      if (debug_flag)
-	fprintf (stderr, "ERROR: couldn't create manifest file: %s\n",
-		 econf_errString(error));
-      cleanup (tmpdir);
-      return FALSE;
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Couldn't create manifest file: %s", econf_errString(ecerror));
+      goto out;
     }
 
   econf_setStringValue(manifest, "global", "ID", product_id);
@@ -488,52 +1144,72 @@ create_image (const gchar *input, GError **gerror)
   econf_setStringValue(manifest, "global", "FORMAT", "catar");
   econf_setStringValue(manifest, "global", "ARCHIVE", pvers_tar);
   econf_setStringValue(manifest, "update", "MIN_VERSION", "20220101");
-  econf_writeFile(manifest, tmpdir, "manifest.tiu");
-
-  gchar *manifest_file = g_strjoin("/", tmpdir, "manifest.tiu", NULL);
-  gchar *output_tiutar = g_strjoin(".", pvers, "tiutar", NULL);
-#if 0 /* XXX --with-casync */
-  gchar *output_tiuidx = g_strjoin(".", pvers, "tiuidx", NULL);
-#endif
-
-  if (!mksquashfs (manifest_file, pvers_tar, NULL, output_tiutar, gerror))
+  if ((ecerror = econf_writeFile(manifest, tmpdir, "manifest.tiu")))
     {
-      cleanup (tmpdir);
-      return FALSE;
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Couldn't write manifest file: %s", econf_errString(ecerror));
+      goto out;
     }
 
-#if 0 /* XXX caidx not created yet */
-  /* overwrite some values and create a tiuidx file */
-  econf_setStringValue(manifest, "global", "FORMAT", "caidx");
-  econf_setStringValue(manifest, "global", "ARCHIVE", pvers_idx);
-  econf_writeFile(manifest, tmpdir, "manifest.tiu");
+  manifest_file = g_build_filename(tmpdir, "manifest.tiu", NULL);
+  output_tiutar = g_strconcat(outputdir, "/", pvers, ".tiutar", NULL);
+  output_img = g_strconcat(outputdir, "/", pvers, ".img", NULL);
+  output_tiuidx = g_strconcat(outputdir, "/", pvers, ".tiuidx", NULL);
 
-  if (!mksquashfs (manifest_file, pvers_idx, NULL, output_tiuidx, gerror))
-    {
-      cleanup (tmpdir);
-      return FALSE;
-    }
+  if (sweep &&
+      !sweep_squashfs_profiles (manifest_file, catar, output_tiutar, error))
+    goto out;
 
-  /* XXX error handling */
-  if (!calc_verity(output_tiuidx, gerror))
-    {
-      cleanup (tmpdir);
-      return FALSE;
-    }
-#endif
+  if (!mksquashfs (manifest_file, catar, NULL, output_tiutar,
+		   &squashfs_profile, error))
+    goto out;
+
+  if (!calc_verity(output_tiutar, error))
+    goto out;
+
+  /* The image written to the USR partitions */
+  if (!mkfs_usr (usr_tmp, output_img, error) ||
+      !calc_verity(output_img, error))
+    goto out;
+
+  /* Chunk index of the USR image, devices download only the chunks
+     from the store they don't have already. */
+  if (store != NULL &&
+      !chunk_index_create (output_img, output_tiuidx, store, error))
+    goto out;
 
-  /* XXX error handling */
-  if (!calc_verity(output_tiutar, gerror))
+  if (previous != NULL)
     {
-      cleanup (tmpdir);
-      return FALSE;
+      g_autofree gchar *output_tiudelta =
+	g_strconcat(outputdir, "/", pvers, ".tiudelta", NULL);
+
+      if (!delta_create (previous, output_img, output_tiudelta, error))
+	goto out;
     }
 
-  if (!workdir_destroy (tmpdir, NULL))
+  if (!quiet_flag)
+    g_printf("Created %s and %s\n", output_tiutar, output_img);
+
+  retval = TRUE;
+
+ out:
+  if (catar_tmp)
+    g_remove (catar_tmp);
+  if (usr_tmp)
+    g_remove (usr_tmp);
+  if (manifest)
+    econf_free (manifest);
+  if (os_release)
+    econf_free (os_release);
+  if (!workdir_destroy (tmpdir, &ierror))
     {
-      /* XXX g_set_error */
-      return FALSE;
+      if (retval)
+	g_propagate_prefixed_error(error, ierror,
+				   "Failed to remove working directory: ");
+      else
+	g_clear_error(&ierror);
+      retval = FALSE;
     }
 
-  return TRUE;
+  return retval;
 }
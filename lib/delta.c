@@ -0,0 +1,754 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "tiu-chunk.h"
+#include "tiu-delta.h"
+#include "tiu-slot.h"
+
+#define DELTA_HEADER_SIZE 96
+#define DELTA_IO_BUFSIZE (1024*1024)
+
+/*
+  rsync style rolling checksum over a block: a is the sum of all
+  bytes, b the sum weighted by the distance to the end of the block.
+  Only the lower 16 bits of both are used.
+*/
+typedef struct {
+  guint32 a;
+  guint32 b;
+} RollSum;
+
+static void
+rollsum_init (RollSum *s, const guint8 *data, gsize len)
+{
+  s->a = 0;
+  s->b = 0;
+  for (gsize i = 0; i < len; i++)
+    {
+      s->a += data[i];
+      s->b += (len - i) * data[i];
+    }
+}
+
+static inline void
+rollsum_roll (RollSum *s, guint8 out, guint8 in, gsize len)
+{
+  s->a = s->a - out + in;
+  s->b = s->b - len * out + s->a;
+}
+
+static inline guint32
+rollsum_digest (const RollSum *s)
+{
+  return ((s->b & 0xffff) << 16) | (s->a & 0xffff);
+}
+
+/* Hash table of the blocks of the base image by their rolling checksum */
+typedef struct {
+  guint32 mask;
+  gint32 *heads;
+  gint32 *next;
+  guint32 *weak;
+} BlockTable;
+
+static inline guint32
+bucket (const BlockTable *t, guint32 weak)
+{
+  return ((weak ^ (weak >> 15)) * 0x2c1b3c6dU) & t->mask;
+}
+
+static void
+block_table_init (BlockTable *t, const guint8 *base, guint64 base_size)
+{
+  guint32 nblocks = base_size / DELTA_BLOCK_SIZE;
+  guint32 nbuckets = 1024;
+
+  while (nbuckets < 2 * nblocks)
+    nbuckets *= 2;
+
+  t->mask = nbuckets - 1;
+  t->heads = g_new(gint32, nbuckets);
+  memset(t->heads, 0xff, nbuckets * sizeof(gint32));
+  t->next = g_new(gint32, MAX(nblocks, 1));
+  t->weak = g_new(guint32, MAX(nblocks, 1));
+
+  /* insert backwards, so that the lists start with the first block */
+  for (gint32 i = (gint32)nblocks - 1; i >= 0; i--)
+    {
+      RollSum s;
+      guint32 h;
+
+      rollsum_init(&s, base + (guint64)i * DELTA_BLOCK_SIZE, DELTA_BLOCK_SIZE);
+      t->weak[i] = rollsum_digest(&s);
+      h = bucket(t, t->weak[i]);
+      t->next[i] = t->heads[h];
+      t->heads[h] = i;
+    }
+}
+
+static void
+block_table_clear (BlockTable *t)
+{
+  g_free(t->heads);
+  g_free(t->next);
+  g_free(t->weak);
+}
+
+typedef struct {
+  GOutputStream *out;
+  const guint8 *image;
+  guint64 copy_offset;   /* copy operation not written yet */
+  guint64 copy_len;
+  guint64 literal_bytes;
+  guint64 copy_bytes;
+} DeltaWriter;
+
+static gboolean
+write_op (GOutputStream *out, guchar op, guint64 v1, guint64 v2, guint nvals,
+	  GError **error)
+{
+  guint8 buf[17];
+  gsize len = 1;
+
+  buf[0] = op;
+  if (nvals > 0)
+    {
+      v1 = GUINT64_TO_BE(v1);
+      memcpy(buf + len, &v1, 8);
+      len += 8;
+    }
+  if (nvals > 1)
+    {
+      v2 = GUINT64_TO_BE(v2);
+      memcpy(buf + len, &v2, 8);
+      len += 8;
+    }
+
+  return g_output_stream_write_all(out, buf, len, NULL, NULL, error);
+}
+
+static gboolean
+flush_copy (DeltaWriter *dw, GError **error)
+{
+  if (dw->copy_len == 0)
+    return TRUE;
+
+  if (!write_op(dw->out, 'C', dw->copy_offset, dw->copy_len, 2, error))
+    return FALSE;
+  dw->copy_bytes += dw->copy_len;
+  dw->copy_len = 0;
+
+  return TRUE;
+}
+
+static gboolean
+emit_literal (DeltaWriter *dw, guint64 from, guint64 to, GError **error)
+{
+  if (from == to)
+    return TRUE;
+
+  if (!flush_copy(dw, error) ||
+      !write_op(dw->out, 'D', to - from, 0, 1, error) ||
+      !g_output_stream_write_all(dw->out, dw->image + from, to - from,
+				 NULL, NULL, error))
+    return FALSE;
+  dw->literal_bytes += to - from;
+
+  return TRUE;
+}
+
+static gboolean
+emit_copy (DeltaWriter *dw, guint64 offset, guint64 len, GError **error)
+{
+  /* continue the previous copy if the data follows directly */
+  if (dw->copy_len > 0 && dw->copy_offset + dw->copy_len == offset)
+    {
+      dw->copy_len += len;
+      return TRUE;
+    }
+
+  if (!flush_copy(dw, error))
+    return FALSE;
+  dw->copy_offset = offset;
+  dw->copy_len = len;
+
+  return TRUE;
+}
+
+static gboolean
+write_header (GOutputStream *out, guint64 base_size, const guint8 *base_sha256,
+	      guint64 image_size, const guint8 *image_sha256, GError **error)
+{
+  guint8 header[DELTA_HEADER_SIZE] = {0};
+  guint64 u64;
+  guint32 u32;
+
+  memcpy(header, DELTA_MAGIC, 8);
+  u64 = GUINT64_TO_BE(base_size);
+  memcpy(header + 8, &u64, 8);
+  memcpy(header + 16, base_sha256, 32);
+  u64 = GUINT64_TO_BE(image_size);
+  memcpy(header + 48, &u64, 8);
+  memcpy(header + 56, image_sha256, 32);
+  u32 = GUINT32_TO_BE(DELTA_BLOCK_SIZE);
+  memcpy(header + 88, &u32, 4);
+
+  return g_output_stream_write_all(out, header, sizeof(header), NULL, NULL,
+				   error);
+}
+
+/*
+  Create @delta, which turns the image @base into @image. Blocks of
+  @base are searched at every byte offset of @image, matches get
+  extended as far as possible.
+*/
+gboolean
+delta_create (const gchar *base, const gchar *image, const gchar *delta,
+	      GError **error)
+{
+  g_autoptr(GMappedFile) base_map = NULL;
+  g_autoptr(GMappedFile) image_map = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileOutputStream) fout = NULL;
+  g_autoptr(GZlibCompressor) comp = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+  const guint8 *b, *img;
+  guint64 base_size, image_size, pos = 0, lit_start = 0;
+  guint8 base_sha256[32], image_sha256[32];
+  DeltaWriter dw = {0};
+  BlockTable table = {0};
+  RollSum sum;
+  gint64 start = g_get_monotonic_time();
+  gboolean res = FALSE;
+
+  g_return_val_if_fail(base, FALSE);
+  g_return_val_if_fail(image, FALSE);
+  g_return_val_if_fail(delta, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  base_map = g_mapped_file_new(base, FALSE, error);
+  if (base_map == NULL)
+    return FALSE;
+  image_map = g_mapped_file_new(image, FALSE, error);
+  if (image_map == NULL)
+    return FALSE;
+
+  b = (const guint8 *)g_mapped_file_get_contents(base_map);
+  base_size = g_mapped_file_get_length(base_map);
+  img = (const guint8 *)g_mapped_file_get_contents(image_map);
+  image_size = g_mapped_file_get_length(image_map);
+
+  EVP_Digest(b, base_size, base_sha256, NULL, EVP_sha256(), NULL);
+  EVP_Digest(img, image_size, image_sha256, NULL, EVP_sha256(), NULL);
+
+  file = g_file_new_for_path(delta);
+  fout = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+			NULL, error);
+  if (fout == NULL)
+    return FALSE;
+
+  if (!write_header(G_OUTPUT_STREAM(fout), base_size, base_sha256,
+		    image_size, image_sha256, error))
+    goto out;
+
+  comp = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 9);
+  out = g_converter_output_stream_new(G_OUTPUT_STREAM(fout), G_CONVERTER(comp));
+  dw.out = out;
+  dw.image = img;
+
+  block_table_init(&table, b, base_size);
+
+  if (image_size >= DELTA_BLOCK_SIZE)
+    rollsum_init(&sum, img, DELTA_BLOCK_SIZE);
+
+  while (pos + DELTA_BLOCK_SIZE <= image_size)
+    {
+      guint32 weak = rollsum_digest(&sum);
+      gint32 match = -1;
+
+      for (gint32 k = table.heads[bucket(&table, weak)]; k >= 0; k = table.next[k])
+	{
+	  if (table.weak[k] == weak &&
+	      memcmp(img + pos, b + (guint64)k * DELTA_BLOCK_SIZE,
+		     DELTA_BLOCK_SIZE) == 0)
+	    {
+	      match = k;
+	      break;
+	    }
+	}
+
+      if (match < 0)
+	{
+	  if (pos + DELTA_BLOCK_SIZE < image_size)
+	    rollsum_roll(&sum, img[pos], img[pos + DELTA_BLOCK_SIZE],
+			 DELTA_BLOCK_SIZE);
+	  pos++;
+	  continue;
+	}
+
+      guint64 boff = (guint64)match * DELTA_BLOCK_SIZE;
+      guint64 len = DELTA_BLOCK_SIZE;
+
+      /* extend the match, first block wise, then byte wise */
+      while (pos + len + DELTA_BLOCK_SIZE <= image_size &&
+	     boff + len + DELTA_BLOCK_SIZE <= base_size &&
+	     memcmp(img + pos + len, b + boff + len, DELTA_BLOCK_SIZE) == 0)
+	len += DELTA_BLOCK_SIZE;
+      while (pos + len < image_size && boff + len < base_size &&
+	     img[pos + len] == b[boff + len])
+	len++;
+
+      if (!emit_literal(&dw, lit_start, pos, error) ||
+	  !emit_copy(&dw, boff, len, error))
+	goto out;
+
+      pos += len;
+      lit_start = pos;
+      if (pos + DELTA_BLOCK_SIZE <= image_size)
+	rollsum_init(&sum, img + pos, DELTA_BLOCK_SIZE);
+    }
+
+  if (!emit_literal(&dw, lit_start, image_size, error) ||
+      !flush_copy(&dw, error) ||
+      !write_op(out, 'E', 0, 0, 0, error) ||
+      !g_output_stream_close(out, NULL, error))
+    goto out;
+
+  if (verbose_flag)
+    {
+      GStatBuf st;
+
+      g_printf("Created '%s' in %.1f seconds: %" G_GUINT64_FORMAT " bytes copied from the base, %" G_GUINT64_FORMAT " bytes new, %" G_GINT64_FORMAT " bytes compressed\n",
+	       delta, (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC,
+	       dw.copy_bytes, dw.literal_bytes,
+	       g_stat(delta, &st) == 0 ? (gint64)st.st_size : (gint64)-1);
+    }
+
+  res = TRUE;
+
+ out:
+  block_table_clear(&table);
+  if (!res)
+    g_file_delete(file, NULL, NULL);
+
+  return res;
+}
+
+static gboolean
+read_exact (GInputStream *in, void *buf, gsize len, GError **error)
+{
+  gsize bytes_read = 0;
+
+  if (!g_input_stream_read_all(in, buf, len, &bytes_read, NULL, error))
+    return FALSE;
+
+  if (bytes_read != len)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Delta archive is truncated");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+read_u64 (GInputStream *in, guint64 *value, GError **error)
+{
+  if (!read_exact(in, value, sizeof(*value), error))
+    return FALSE;
+  *value = GUINT64_FROM_BE(*value);
+
+  return TRUE;
+}
+
+/*
+  Make sure that @base contains the image the delta was created
+  against. If the index of the image in that slot is known, this
+  needs no reading of the partition.
+*/
+static gboolean
+check_base (int fd, const gchar *base, const gchar *base_index,
+	    guint64 size, const guint8 *sha256, GError **error)
+{
+  guint8 digest[32];
+
+  if (base_index && g_file_test(base_index, G_FILE_TEST_EXISTS))
+    {
+      TIUChunkIndex *idx = chunk_index_load(base_index, NULL);
+
+      if (idx)
+	{
+	  gboolean match = (idx->image_size == size &&
+			    memcmp(idx->image_sha256, sha256, 32) == 0);
+
+	  chunk_index_free(idx);
+	  if (match)
+	    return TRUE;
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "The installed image is not the base of the delta archive, a full update is needed");
+	  return FALSE;
+	}
+    }
+
+  if (verbose_flag)
+    g_printf("Checking installed image on '%s'...\n", base);
+
+  g_autofree guint8 *buf = g_malloc(DELTA_IO_BUFSIZE);
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  guint64 done = 0;
+  unsigned int md_len;
+
+  EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+  while (done < size)
+    {
+      ssize_t n = pread(fd, buf, MIN(DELTA_IO_BUFSIZE, size - done), done);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  /* device smaller than the base image */
+	  break;
+	}
+      EVP_DigestUpdate(md, buf, n);
+      done += n;
+    }
+  EVP_DigestFinal_ex(md, digest, &md_len);
+  EVP_MD_CTX_free(md);
+
+  if (done != size || memcmp(digest, sha256, 32) != 0)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "The installed image is not the base of the delta archive, a full update is needed");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Open the delta archive, returns the stream of operations */
+static GInputStream *
+open_delta (const gchar *delta, guint8 *header, GError **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path(delta);
+  g_autoptr(GFileInputStream) fin = NULL;
+  g_autoptr(GZlibDecompressor) decomp = NULL;
+
+  fin = g_file_read(file, NULL, error);
+  if (fin == NULL)
+    return NULL;
+
+  if (!read_exact(G_INPUT_STREAM(fin), header, DELTA_HEADER_SIZE, error))
+    return NULL;
+  if (memcmp(header, DELTA_MAGIC, 8) != 0)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "'%s' is not a tiu delta archive", delta);
+      return NULL;
+    }
+
+  decomp = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+  return g_converter_input_stream_new(G_INPUT_STREAM(fin), G_CONVERTER(decomp));
+}
+
+typedef gboolean (*DeltaSink) (const guint8 *data, gsize len,
+			       gpointer user_data, GError **error);
+
+/*
+  Run the operations from @in and hand the new image to @sink,
+  starting at byte @from of the image. Data in front of @from is
+  skipped without reading the base.
+*/
+static gboolean
+run_ops (GInputStream *in, int fd, const gchar *base, guint64 base_size,
+	 guint64 image_size, guint64 from, guint8 *buf, DeltaSink sink,
+	 gpointer user_data, guint64 *copied, guint64 *literal,
+	 GError **error)
+{
+  guint64 pos = 0;
+
+  for (;;)
+    {
+      guchar op;
+      guint64 offset = 0, len = 0;
+
+      if (!read_exact(in, &op, 1, error))
+	return FALSE;
+
+      if (op == 'E')
+	break;
+
+      if (op == 'C')
+	{
+	  if (!read_u64(in, &offset, error) || !read_u64(in, &len, error))
+	    return FALSE;
+	  if (offset + len < offset || offset + len > base_size)
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+			  "Delta archive is corrupt: copy outside of the base image");
+	      return FALSE;
+	    }
+	  if (copied)
+	    *copied += len;
+	}
+      else if (op == 'D')
+	{
+	  if (!read_u64(in, &len, error))
+	    return FALSE;
+	  if (literal)
+	    *literal += len;
+	}
+      else
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Delta archive is corrupt: unknown operation");
+	  return FALSE;
+	}
+
+      if (pos + len > image_size)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Delta archive is corrupt: image too large");
+	  return FALSE;
+	}
+
+      while (len > 0)
+	{
+	  gsize n = MIN(len, DELTA_IO_BUFSIZE);
+	  gsize skip;
+
+	  if (op == 'C')
+	    {
+	      ssize_t r;
+
+	      if (pos + n <= from)
+		{
+		  offset += n;
+		  pos += n;
+		  len -= n;
+		  continue;
+		}
+
+	      r = pread(fd, buf, n, offset);
+	      if (r < 0 && errno == EINTR)
+		continue;
+	      if (r <= 0)
+		{
+		  int err = r < 0 ? errno : EIO;
+		  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			      "Failed to read '%s': %s", base, g_strerror(err));
+		  return FALSE;
+		}
+	      n = r;
+	      offset += n;
+	    }
+	  else if (!read_exact(in, buf, n, error))
+	    return FALSE;
+
+	  skip = pos < from ? MIN(from - pos, n) : 0;
+	  if (skip < n && !sink(buf + skip, n - skip, user_data, error))
+	    return FALSE;
+	  pos += n;
+	  len -= n;
+	}
+    }
+
+  if (pos != image_size)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Delta archive is corrupt: image incomplete");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  guint8 *buf;
+  gsize fill;
+} TailData;
+
+static gboolean
+tail_sink (const guint8 *data, gsize len, gpointer user_data,
+	   GError **error __attribute__((unused)))
+{
+  TailData *td = user_data;
+
+  memcpy(td->buf + td->fill, data, len);
+  td->fill += len;
+
+  return TRUE;
+}
+
+typedef struct {
+  TIUSlotWriter *writer;
+  EVP_MD_CTX *md;
+} WriteData;
+
+static gboolean
+write_sink (const guint8 *data, gsize len, gpointer user_data,
+	    GError **error)
+{
+  WriteData *wd = user_data;
+
+  EVP_DigestUpdate(wd->md, data, len);
+  return slot_writer_write(wd->writer, data, len, error);
+}
+
+/*
+  The verity manifest and hash tree are at the end of the new image.
+  Run the operations once without writing to get them, so that the
+  slot writer can check every block before it gets written. Images
+  without verity data are written unchecked.
+*/
+static gboolean
+setup_verity (TIUSlotWriter *writer, const gchar *delta, int fd,
+	      const gchar *base, guint64 base_size, guint64 image_size,
+	      guint8 *buf, GError **error)
+{
+  gsize tail_len = MIN(image_size, VERITY_TREE_MAX(image_size) + VERITY_TRAILER_MAX);
+  gsize trailer_len = MIN(tail_len, VERITY_TRAILER_MAX);
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guint8 *tail = g_malloc(tail_len);
+  guint8 header[DELTA_HEADER_SIZE];
+  TailData td = {tail, 0};
+  GError *ierror = NULL;
+  VerityInfo info;
+
+  in = open_delta(delta, header, error);
+  if (in == NULL)
+    return FALSE;
+
+  if (!run_ops(in, fd, base, base_size, image_size, image_size - tail_len,
+	       buf, tail_sink, &td, NULL, NULL, error))
+    return FALSE;
+
+  if (!verity_parse_trailer(tail + tail_len - trailer_len, trailer_len,
+			    image_size, &info, &ierror))
+    {
+      if (verbose_flag)
+	g_printf("Image is not checked while writing: %s\n", ierror->message);
+      g_clear_error(&ierror);
+      return TRUE;
+    }
+  if (info.data_size < image_size - tail_len)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Verity hash tree of the new image is too large");
+      return FALSE;
+    }
+
+  return slot_writer_set_verity(writer, &info,
+				tail + (info.data_size - (image_size - tail_len)),
+				error);
+}
+
+/*
+  Write the image described by @delta to @target, using the image in
+  @base as reference. @base_index is the chunk index of @base, if
+  known, to check the base without reading it.
+*/
+gboolean
+delta_apply (const gchar *delta, const gchar *base, const gchar *base_index,
+	     const gchar *target, GError **error)
+{
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guint8 *buf = NULL;
+  guint8 header[DELTA_HEADER_SIZE];
+  guint8 digest[32];
+  guint64 base_size, image_size, copied = 0, literal = 0;
+  WriteData wd = {NULL, NULL};
+  unsigned int md_len;
+  gboolean res = FALSE;
+  int fd = -1;
+
+  g_return_val_if_fail(delta, FALSE);
+  g_return_val_if_fail(base, FALSE);
+  g_return_val_if_fail(target, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  in = open_delta(delta, header, error);
+  if (in == NULL)
+    return FALSE;
+  memcpy(&base_size, header + 8, 8);
+  base_size = GUINT64_FROM_BE(base_size);
+  memcpy(&image_size, header + 48, 8);
+  image_size = GUINT64_FROM_BE(image_size);
+
+  fd = open(base, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s': %s", base, g_strerror(err));
+      return FALSE;
+    }
+
+  if (!check_base(fd, base, base_index, base_size, header + 16, error))
+    goto out;
+
+  wd.writer = slot_writer_new(target, image_size, error);
+  if (wd.writer == NULL)
+    goto out;
+
+  buf = g_malloc(DELTA_IO_BUFSIZE);
+  if (!setup_verity(wd.writer, delta, fd, base, base_size, image_size, buf,
+		    error))
+    goto out;
+
+  wd.md = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(wd.md, EVP_sha256(), NULL);
+
+  if (!run_ops(in, fd, base, base_size, image_size, 0, buf, write_sink, &wd,
+	       &copied, &literal, error))
+    goto out;
+
+  EVP_DigestFinal_ex(wd.md, digest, &md_len);
+  if (memcmp(digest, header + 56, 32) != 0)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Checksum of the new image does not match the delta archive");
+      goto out;
+    }
+
+  if (!slot_writer_finish(wd.writer, error))
+    goto out;
+
+  if (verbose_flag)
+    g_printf("Applied delta: %" G_GUINT64_FORMAT " bytes from the installed image, %" G_GUINT64_FORMAT " bytes from the archive\n",
+	     copied, literal);
+
+  res = TRUE;
+
+ out:
+  slot_writer_free(wd.writer);
+  if (wd.md)
+    EVP_MD_CTX_free(wd.md);
+  close(fd);
+
+  return res;
+}
@@ -0,0 +1,303 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gprintf.h>
+
+#include "tiu-internal.h"
+#include "tiu-grubenv.h"
+
+static gint
+find_var (TIUGrubenv *env, const gchar *name)
+{
+  for (guint i = 0; i < env->names->len; i++)
+    if (strcmp(g_ptr_array_index(env->names, i), name) == 0)
+      return i;
+
+  return -1;
+}
+
+/* "name=value\n", a backslash escapes the next character in the value,
+   so values can contain newlines. Lines starting with '#' are comments
+   or the padding of the block. */
+static gboolean
+parse_block (TIUGrubenv *env, const gchar *block, gsize len)
+{
+  const gchar *p = block + strlen(GRUBENV_HEADER);
+  const gchar *end = block + len;
+
+  while (p < end)
+    {
+      const gchar *eq;
+      GString *value;
+
+      if (*p == '#' || *p == '\n')
+	{
+	  while (p < end && *p != '\n')
+	    p++;
+	  p++;
+	  continue;
+	}
+
+      eq = memchr(p, '=', end - p);
+      if (eq == NULL || memchr(p, '\n', eq - p) != NULL)
+	return FALSE;
+
+      value = g_string_new(NULL);
+      for (eq++; eq < end && *eq != '\n'; eq++)
+	{
+	  if (*eq == '\\' && eq + 1 < end)
+	    eq++;
+	  g_string_append_c(value, *eq);
+	}
+      if (eq == end)
+	{
+	  g_string_free(value, TRUE);
+	  return FALSE;
+	}
+
+      g_ptr_array_add(env->names, g_strndup(p, strcspn(p, "=")));
+      g_ptr_array_add(env->values, g_string_free(value, FALSE));
+      p = eq + 1;
+    }
+
+  return TRUE;
+}
+
+/*
+  Read the grub environment block @path. A missing file is an empty
+  environment, it is created by grubenv_write().
+*/
+TIUGrubenv *
+grubenv_read (const gchar *path, GError **error)
+{
+  g_autofree gchar *block = NULL;
+  gsize len = 0;
+  GError *ierror = NULL;
+  TIUGrubenv *env;
+
+  if (!g_file_get_contents(path, &block, &len, &ierror))
+    {
+      if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+	{
+	  g_propagate_prefixed_error(error, ierror,
+				     "Failed to read grub environment: ");
+	  return NULL;
+	}
+      g_clear_error(&ierror);
+    }
+
+  env = g_new0(TIUGrubenv, 1);
+  env->path = g_strdup(path);
+  env->names = g_ptr_array_new_with_free_func(g_free);
+  env->values = g_ptr_array_new_with_free_func(g_free);
+
+  if (block && (len != GRUBENV_SIZE ||
+		strncmp(block, GRUBENV_HEADER, strlen(GRUBENV_HEADER)) != 0 ||
+		!parse_block(env, block, len)))
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Invalid grub environment block '%s'", path);
+      grubenv_free(env);
+      return NULL;
+    }
+
+  return env;
+}
+
+void
+grubenv_free (TIUGrubenv *env)
+{
+  if (env == NULL)
+    return;
+
+  g_free(env->path);
+  g_ptr_array_free(env->names, TRUE);
+  g_ptr_array_free(env->values, TRUE);
+  g_free(env);
+}
+
+const gchar *
+grubenv_get (TIUGrubenv *env, const gchar *name)
+{
+  gint i = find_var(env, name);
+
+  return i < 0 ? NULL : g_ptr_array_index(env->values, i);
+}
+
+void
+grubenv_set (TIUGrubenv *env, const gchar *name, const gchar *value)
+{
+  gint i = find_var(env, name);
+
+  g_return_if_fail(name[0] != '\0' && strpbrk(name, "=\n#") == NULL);
+
+  if (i < 0)
+    {
+      g_ptr_array_add(env->names, g_strdup(name));
+      g_ptr_array_add(env->values, g_strdup(value));
+    }
+  else
+    {
+      g_free(env->values->pdata[i]);
+      env->values->pdata[i] = g_strdup(value);
+    }
+}
+
+void
+grubenv_unset (TIUGrubenv *env, const gchar *name)
+{
+  gint i = find_var(env, name);
+
+  if (i >= 0)
+    {
+      g_ptr_array_remove_index(env->names, i);
+      g_ptr_array_remove_index(env->values, i);
+    }
+}
+
+/* Create a missing environment block, there are no old blocks grub
+   could know about, so a rename is fine here. */
+static gboolean
+create_block (const gchar *path, const gchar *block, GError **error)
+{
+  g_autofree gchar *tmpfile = g_strjoin("", path, ".tmp", NULL);
+  g_autofree gchar *dir = g_path_get_dirname(path);
+  int fd, dfd;
+
+  fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0 ||
+      write(fd, block, GRUBENV_SIZE) != GRUBENV_SIZE ||
+      fsync(fd) < 0)
+    {
+      int err = errno;
+
+      if (fd >= 0)
+	{
+	  close(fd);
+	  unlink(tmpfile);
+	}
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to write '%s': %s", tmpfile, g_strerror(err));
+      return FALSE;
+    }
+  close(fd);
+
+  if (rename(tmpfile, path) < 0)
+    {
+      int err = errno;
+
+      unlink(tmpfile);
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to rename '%s' to '%s': %s", tmpfile, path,
+		  g_strerror(err));
+      return FALSE;
+    }
+
+  if ((dfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0)
+    {
+      fsync(dfd);
+      close(dfd);
+    }
+
+  return TRUE;
+}
+
+/*
+  Write all variables of @env back. An existing block is overwritten in
+  place with one write of GRUBENV_SIZE bytes from an aligned buffer at
+  offset 0, followed by fsync: grub itself writes to the blocks of the
+  file and the write covers a single filesystem block, so after a crash
+  either the old or the new environment is there.
+*/
+gboolean
+grubenv_write (TIUGrubenv *env, GError **error)
+{
+  g_autoptr(GString) content = g_string_new(GRUBENV_HEADER);
+  gint64 start = g_get_monotonic_time();
+  gchar *block = NULL;
+  gboolean retval = TRUE;
+  ssize_t n;
+  int fd;
+
+  for (guint i = 0; i < env->names->len; i++)
+    {
+      const gchar *value = g_ptr_array_index(env->values, i);
+
+      g_string_append_printf(content, "%s=",
+			     (gchar *)g_ptr_array_index(env->names, i));
+      for (; *value; value++)
+	{
+	  if (*value == '\\' || *value == '\n')
+	    g_string_append_c(content, '\\');
+	  g_string_append_c(content, *value);
+	}
+      g_string_append_c(content, '\n');
+    }
+
+  if (content->len > GRUBENV_SIZE)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOSPC,
+		  "Grub environment too big (%" G_GSIZE_FORMAT " of %i bytes)",
+		  content->len, GRUBENV_SIZE);
+      return FALSE;
+    }
+
+  if (posix_memalign((void **)&block, GRUBENV_SIZE, GRUBENV_SIZE) != 0)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+		  "Failed to allocate grub environment block");
+      return FALSE;
+    }
+  memset(block, '#', GRUBENV_SIZE);
+  memcpy(block, content->str, content->len);
+
+  fd = open(env->path, O_WRONLY|O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT)
+    retval = create_block(env->path, block, error);
+  else if (fd < 0 ||
+	   (n = pwrite(fd, block, GRUBENV_SIZE, 0)) < 0 ||
+	   fsync(fd) < 0)
+    {
+      int err = errno;
+
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to write '%s': %s", env->path, g_strerror(err));
+      retval = FALSE;
+    }
+  else if (n != GRUBENV_SIZE)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+		  "Short write to '%s'", env->path);
+      retval = FALSE;
+    }
+  if (fd >= 0)
+    close(fd);
+  free(block);
+
+  if (retval && debug_flag)
+    g_printf("Wrote %u variables to %s in %.2f ms\n", env->names->len,
+	     env->path, (g_get_monotonic_time() - start) / 1000.0);
+
+  return retval;
+}
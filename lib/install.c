@@ -28,10 +28,14 @@
 
 #define LIBEXEC_TIU "/usr/libexec/tiu"
 
+/* If @chroot_target is set, the script runs in a private mount
+   namespace with it prepared as TIU_ROOT_DIR, see chroot_launcher_new() */
 static gboolean
 exec_script (const gchar *script, const gchar *device, GError **error,
-	     const gchar *disk_layout, const gchar *logfile)
+	     const gchar *disk_layout, const gchar *logfile,
+	     const gchar *chroot_target)
 {
+  g_autoptr (GSubprocessLauncher) launcher = NULL;
   g_autoptr (GSubprocess) sproc = NULL;
   GError *ierror = NULL;
   GPtrArray *args = g_ptr_array_new_full(8, g_free);
@@ -62,8 +66,15 @@ exec_script (const gchar *script, const gchar *device, GError **error,
     }
   g_ptr_array_add(args, NULL);
 
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+  if (chroot_target)
+    launcher = chroot_launcher_new(chroot_target, TIU_ROOT_DIR,
+				   G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+  else
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_SILENCE);
+  if (launcher)
+    sproc = g_subprocess_launcher_spawnv(launcher,
+					 (const gchar * const *)args->pdata,
+					 &ierror);
   if (sproc == NULL)
     {
       g_propagate_prefixed_error(error, ierror, "Failed to start sub-process (%s): ", script);
@@ -80,33 +91,6 @@ exec_script (const gchar *script, const gchar *device, GError **error,
   return TRUE;
 }
 
-/* XXX make this available in mount.c as rec_umount and merge with
-   umount_chroot() */
-static void
-rec_umount(const gchar *mountpoint)
-{
-   g_autoptr (GSubprocess) sproc = NULL;
-   GError *ierror = NULL;
-
-   if (mountpoint == NULL) return;
-   if (verbose_flag)
-     g_printf("  * unmount %s...\n", mountpoint);
-
-   GPtrArray *args = g_ptr_array_new_full(4, g_free);
-   g_ptr_array_add(args, "umount");
-   g_ptr_array_add(args, "-R");
-   g_ptr_array_add(args,  g_strdup(mountpoint));
-   g_ptr_array_add(args, NULL);
-   sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-			     G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
-   if (sproc != NULL)
-     {
-       g_subprocess_wait_check(sproc, NULL, &ierror);
-     }
-   g_ptr_array_free(args, FALSE);
-   g_clear_error(&ierror);
-}
-
 #if 0 /* keep as backup */
 static gboolean
 call_swupdate(const gchar *archive, GError **error)
@@ -152,69 +136,102 @@ call_swupdate(const gchar *archive, GError **error)
 static void
 cleanup_install (void)
 {
-   g_autoptr (GSubprocess) sproc = NULL;
    GError *ierror = NULL;
 
    if (verbose_flag)
      g_printf("Cleanup system:\n");
 
-   /* if /usr is mounted, umount that first, could shadow /usr/local */
-   if (is_mounted ("/mnt/usr", &ierror))
-     rec_umount("/mnt/usr");
-   rec_umount("/mnt");
+   /* /mnt/usr can be mounted without /mnt being a mount point, if
+      the root filesystem was not mounted there. umount_recursive()
+      unmounts /mnt/usr before /mnt/usr/local, which it could shadow. */
+   static const gchar * const mounts[] = {"/mnt/usr", "/mnt"};
+
+   for (guint i = 0; i < G_N_ELEMENTS(mounts); i++)
+     {
+       if (!is_mounted (mounts[i], NULL))
+	 continue;
+
+       if (verbose_flag)
+	 g_printf("  * unmount %s...\n", mounts[i]);
+       if (!umount_recursive (mounts[i], FALSE, &ierror))
+	 {
+	   if (verbose_flag)
+	     g_printf("  * %s\n", ierror->message);
+	   g_clear_error(&ierror);
+	 }
+     }
 }
 
-gboolean
-install_system (const gchar *archive, const gchar *device,
-		const gchar *disk_layout, GError **error)
-{
-  GError *ierror = NULL;
-  gboolean retval = FALSE;
 
-  if (archive == NULL)
-    {
-      /* XXX
-      g_set_error_literal (error,
-			   T_ARCHIVE_ERROR,
-			   T_ARCHIVE_ERROR_NO_DATA,
-			   "No valid archive available.");
-			   */
-      return FALSE;
-    }
-
-  if (device == NULL)
-    {
-      /* XXX Error message */
-      return FALSE;
-    }
+/*
+  The installation is a graph of steps. A step is started as soon as
+  all steps in its deps mask are done, so independent steps run
+  concurrently, e.g. the root filesystem skeleton is created while
+  swupdate writes the image to USR_A.
+*/
+typedef enum {
+  STEP_SETUP_DISK,
+  STEP_HWREVISION_INSTSYS,
+  STEP_SETUP_ROOT,
+  STEP_PREPARE_USR,
+  STEP_SWUPDATE,
+  STEP_MOUNT_USR,
+  STEP_HWREVISION,
+  STEP_POPULATE_ETC,
+  STEP_BOOTLOADER,
+  STEP_FINISH,
+  N_INSTALL_STEPS
+} InstallStepId;
+
+#define DEP(step) (1u << (step))
+
+typedef struct {
+  const gchar *archive;
+  const gchar *archive_sha256sum;
+  const gchar *device;
+  const gchar *disk_layout;
+} InstallContext;
+
+typedef struct {
+  const gchar *name;
+  gboolean (*run) (InstallContext *ctx, GError **error);
+  guint deps;
+} InstallStep;
 
-  if (disk_layout == NULL)
-    {
-      /* XXX Error message */
-      return FALSE;
-    }
+static gboolean
+step_setup_disk (InstallContext *ctx, GError **error)
+{
+  return exec_script (LIBEXEC_TIU"/setup-disk", ctx->device, error,
+		      ctx->disk_layout, LOG"setup-disk.log", NULL);
+}
 
-  if (!exec_script (LIBEXEC_TIU"/setup-disk", device, &ierror,
-		    disk_layout, LOG"setup-disk.log"))
-    {
-      g_propagate_error(error, ierror);
-      goto cleanup;
-    }
+/* Create hwrevision file inside install environment, else
+   swupdate will not write the image */
+static gboolean
+step_hwrevision_instsys (InstallContext *ctx __attribute__((unused)),
+			 GError **error)
+{
+  return create_etc_hwrevision (NULL, error);
+}
 
-  if (!exec_script (LIBEXEC_TIU"/setup-root", device,
-		    &ierror, NULL, LOG"setup-root.log"))
-    {
-      g_propagate_error(error, ierror);
-      goto cleanup;
-    }
+static gboolean
+step_setup_root (InstallContext *ctx, GError **error)
+{
+  return exec_script (LIBEXEC_TIU"/setup-root", ctx->device, error,
+		      NULL, LOG"setup-root.log", NULL);
+}
 
+static gboolean
+step_prepare_usr (InstallContext *ctx __attribute__((unused)),
+		  GError **error)
+{
   /* Make sure usr/local is not mounted */
   if (umount2 ("/mnt/usr/local", UMOUNT_NOFOLLOW))
     {
       int err = errno;
       g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 		  "failed to umount usr/local: %s", g_strerror(err));
-      goto cleanup;
+      return FALSE;
     }
 
   /* Remove /usr/local to avoid warning about shadowing files when
@@ -230,81 +247,269 @@ install_system (const gchar *archive, const gchar *device,
       int err = errno;
       g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 		  "failed to create symlink: %s", g_strerror(err));
-      goto cleanup;
+      return FALSE;
     }
 
-  /* Create hwrevision file inside install environment, else
-     swupdate will not write the image */
-  if (!create_etc_hwrevision(NULL, &ierror))
-    {
-      g_propagate_error(error, ierror);
-      goto cleanup;
-    }
+  return TRUE;
+}
 
+static gboolean
+step_swupdate (InstallContext *ctx, GError **error)
+{
 #if 1
-  if (!swupdate_deploy (archive, &ierror))
+  if (!swupdate_deploy (ctx->archive, ctx->archive_sha256sum, NULL, error))
 #else
-  if (!call_swupdate (archive, &ierror))
+  if (!call_swupdate (ctx->archive, error))
 #endif
-    {
-      g_propagate_error(error, ierror);
-      goto cleanup;
-    }
+    return FALSE;
 
   /* Symlink for swupdate no longer needed */
   remove("/dev/update-image-usr");
 
-  /* mount /usr so that we can setup the rest of the system */
+  return TRUE;
+}
+
+/* mount /usr so that we can setup the rest of the system */
+static gboolean
+step_mount_usr (InstallContext *ctx __attribute__((unused)),
+		GError **error)
+{
   /* XXX replace hard coded filesystem value */
   if (mount("/dev/disk/by-partlabel/USR_A", "/mnt/usr", "ext4", 0, NULL))
     {
       int err = errno;
       g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 		  "failed to re-mount /usr read-write: %s", g_strerror(err));
-      goto cleanup;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Create hwrevision file inside freshly installed system
+   for updates. Needs only the root filesystem, not /usr. */
+static gboolean
+step_hwrevision (InstallContext *ctx __attribute__((unused)),
+		 GError **error)
+{
+  if (g_mkdir_with_parents ("/mnt/etc", 0755) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "failed to create /mnt/etc: %s", g_strerror(err));
+      return FALSE;
+    }
+
+  return create_etc_hwrevision ("/mnt", error);
+}
+
+static gboolean
+step_populate_etc (InstallContext *ctx, GError **error)
+{
+  return exec_script (LIBEXEC_TIU"/populate-etc", ctx->device, error,
+		      NULL, LOG"populate-etc.log", "/mnt");
+}
+
+static gboolean
+step_bootloader (InstallContext *ctx, GError **error)
+{
+  return exec_script (LIBEXEC_TIU"/setup-bootloader-sd-boot", ctx->device,
+		      error, NULL, LOG"setup-bootloader-sd-boot.log", "/mnt");
+}
+
+/* finish copies the logs into the new system, so it has to be last */
+static gboolean
+step_finish (InstallContext *ctx, GError **error)
+{
+  return exec_script (LIBEXEC_TIU"/finish", ctx->device, error,
+		      NULL, LOG"finish.log", "/mnt");
+}
+
+static const InstallStep install_steps[N_INSTALL_STEPS] = {
+  [STEP_SETUP_DISK] = { "setup-disk", step_setup_disk, 0 },
+  [STEP_HWREVISION_INSTSYS] = { "hwrevision-instsys",
+				step_hwrevision_instsys, 0 },
+  [STEP_SETUP_ROOT] = { "setup-root", step_setup_root,
+			DEP(STEP_SETUP_DISK) },
+  [STEP_PREPARE_USR] = { "prepare-usr", step_prepare_usr,
+			 DEP(STEP_SETUP_DISK) },
+  [STEP_SWUPDATE] = { "swupdate", step_swupdate,
+		      DEP(STEP_PREPARE_USR)|DEP(STEP_HWREVISION_INSTSYS) },
+  [STEP_MOUNT_USR] = { "mount-usr", step_mount_usr, DEP(STEP_SWUPDATE) },
+  [STEP_POPULATE_ETC] = { "populate-etc", step_populate_etc,
+			  DEP(STEP_SETUP_ROOT)|DEP(STEP_MOUNT_USR) },
+  /* populate-etc may replace /mnt/etc, so never write into it
+     concurrently */
+  [STEP_HWREVISION] = { "hwrevision", step_hwrevision,
+			DEP(STEP_POPULATE_ETC) },
+  [STEP_BOOTLOADER] = { "setup-bootloader", step_bootloader,
+			DEP(STEP_POPULATE_ETC) },
+  [STEP_FINISH] = { "finish", step_finish,
+		    DEP(STEP_BOOTLOADER)|DEP(STEP_HWREVISION) },
+};
+
+typedef struct {
+  InstallContext *ctx;
+  GMutex lock;
+  GCond cond;
+  guint done;
+  guint running;
+  gint64 start[N_INSTALL_STEPS];
+  gint64 end[N_INSTALL_STEPS];
+  GError *error;
+} InstallGraph;
+
+static void
+run_step (gpointer data, gpointer user_data)
+{
+  InstallStepId id = GPOINTER_TO_UINT(data) - 1;
+  InstallGraph *graph = user_data;
+  GError *ierror = NULL;
+  gboolean ok;
+
+  ok = install_steps[id].run (graph->ctx, &ierror);
+
+  g_mutex_lock(&graph->lock);
+  graph->end[id] = g_get_monotonic_time();
+  if (ok)
+    graph->done |= DEP(id);
+  else if (graph->error == NULL)
+    graph->error = ierror;
+  else
+    g_error_free(ierror);
+  graph->running--;
+  g_cond_signal(&graph->cond);
+  g_mutex_unlock(&graph->lock);
+
+  if (debug_flag)
+    g_printf("Step '%s' %s after %.2f seconds\n", install_steps[id].name,
+	     ok ? "finished" : "failed",
+	     (graph->end[id] - graph->start[id]) / (gdouble)G_USEC_PER_SEC);
+}
+
+/* The critical path is the chain of steps where each one was the last
+   dependency to finish before the next could start. */
+static void
+print_critical_path (InstallGraph *graph, gint64 start)
+{
+  g_autoptr(GString) path = g_string_new(NULL);
+  InstallStepId id = STEP_FINISH;
+
+  for (;;)
+    {
+      gint64 last = -1;
+      InstallStepId prev = N_INSTALL_STEPS;
+      g_autofree gchar *entry =
+	g_strdup_printf("%s (%.2fs)", install_steps[id].name,
+			(graph->end[id] - graph->start[id]) /
+			(gdouble)G_USEC_PER_SEC);
+
+      g_string_prepend(path, entry);
+      for (guint i = 0; i < N_INSTALL_STEPS; i++)
+	if ((install_steps[id].deps & DEP(i)) && graph->end[i] > last)
+	  {
+	    last = graph->end[i];
+	    prev = i;
+	  }
+      if (prev == N_INSTALL_STEPS)
+	break;
+      g_string_prepend(path, " -> ");
+      id = prev;
     }
 
-  if (!exec_script (LIBEXEC_TIU"/populate-etc", device,
-		    &ierror, NULL, LOG"populate-etc.log"))
+  g_printf("Installation took %.2f seconds, critical path: %s\n",
+	   (graph->end[STEP_FINISH] - start) / (gdouble)G_USEC_PER_SEC,
+	   path->str);
+}
+
+/* Start every step whose dependencies are done, until all are done or
+   one failed. After a failure the running steps are waited for. */
+static gboolean
+run_install_graph (InstallContext *ctx, GError **error)
+{
+  InstallGraph graph = { .ctx = ctx };
+  GThreadPool *pool;
+  guint started = 0;
+  gint64 start = g_get_monotonic_time();
+
+  g_mutex_init(&graph.lock);
+  g_cond_init(&graph.cond);
+  pool = g_thread_pool_new(run_step, &graph, N_INSTALL_STEPS, FALSE, NULL);
+
+  g_mutex_lock(&graph.lock);
+  for (;;)
     {
-      g_propagate_error(error, ierror);
-      goto cleanup;
+      if (graph.error == NULL)
+	for (guint i = 0; i < N_INSTALL_STEPS; i++)
+	  if (!(started & DEP(i)) &&
+	      (install_steps[i].deps & graph.done) == install_steps[i].deps)
+	    {
+	      started |= DEP(i);
+	      graph.running++;
+	      graph.start[i] = g_get_monotonic_time();
+	      g_thread_pool_push(pool, GUINT_TO_POINTER(i + 1), NULL);
+	    }
+      if (graph.running == 0)
+	break;
+      g_cond_wait(&graph.cond, &graph.lock);
     }
+  g_mutex_unlock(&graph.lock);
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_mutex_clear(&graph.lock);
+  g_cond_clear(&graph.cond);
 
-  /* Create hwrevision file inside freshly installed system
-     for updates. */
-  if (!create_etc_hwrevision ("/mnt", &ierror))
+  if (graph.error)
     {
-      g_propagate_error(error, ierror);
-      goto cleanup;
+      g_propagate_error(error, graph.error);
+      return FALSE;
     }
 
-  if (!setup_chroot ("/mnt", TIU_ROOT_DIR, &ierror))
+  if (verbose_flag)
+    print_critical_path(&graph, start);
+
+  return TRUE;
+}
+
+gboolean
+install_system (const gchar *archive, const gchar *archive_sha256sum,
+		const gchar *device, const gchar *disk_layout, GError **error)
+{
+  InstallContext ctx = {
+    .archive = archive,
+    .archive_sha256sum = archive_sha256sum,
+    .device = device,
+    .disk_layout = disk_layout,
+  };
+  gboolean retval;
+
+  if (archive == NULL)
     {
-      g_propagate_error(error, ierror);
-      goto cleanup;
+      /* XXX
+      g_set_error_literal (error,
+			   T_ARCHIVE_ERROR,
+			   T_ARCHIVE_ERROR_NO_DATA,
+			   "No valid archive available.");
+			   */
+      return FALSE;
     }
 
-  if (!exec_script (LIBEXEC_TIU"/setup-bootloader-sd-boot", device,
-		    &ierror, NULL, LOG"setup-bootloader-sd-boot.log"))
+  if (device == NULL)
     {
-      g_propagate_error(error, ierror);
-      goto cleanup;
+      /* XXX Error message */
+      return FALSE;
     }
 
-  if (!exec_script (LIBEXEC_TIU"/finish", device,
-		    &ierror, NULL, LOG"finish.log"))
+  if (disk_layout == NULL)
     {
-      g_propagate_error(error, ierror);
-      goto cleanup;
+      /* XXX Error message */
+      return FALSE;
     }
 
-  retval = TRUE;
+  retval = run_install_graph (&ctx, error);
 
- cleanup:
   /* Umount /mnt/usr first, since it could hide /mnt/usr/local */
   umount2 ("/mnt/usr", UMOUNT_NOFOLLOW);
-  umount_chroot(TIU_ROOT_DIR, TRUE, NULL);
   cleanup_install ();
 
   return retval;
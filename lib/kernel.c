@@ -0,0 +1,607 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "tiu-kernel.h"
+#include "tiu-mount.h"
+
+/* Upper limit of kernels staged in parallel */
+#define STAGE_MAX_THREADS 8
+/* Bytes per copy_file_range() or sendfile() call */
+#define STAGE_COPY_CHUNK (16*1024*1024)
+
+/* Files of a kernel in /usr/lib/modules/<version>, staged as
+   /boot/<slot>/<name>-<version>. Only vmlinuz is required. */
+static const gchar * const kernel_files[] = {
+  "vmlinuz", ".vmlinuz.hmac", "System.map", "sysctl.conf", NULL
+};
+
+/* dracut configuration, part of the initrd cache key */
+static const gchar * const dracut_conf[] = {
+  "/etc/dracut.conf",
+  "/etc/dracut.conf.d",
+  "/usr/lib/dracut/dracut.conf.d",
+  NULL
+};
+
+typedef struct {
+  const gchar *chroot;
+  const gchar *root;      /* prefix of all paths, "" for / */
+  const gchar *slot_name;
+  gchar *modules;
+  gchar *bootdir;
+  gchar *cachedir;
+  GMutex lock;
+  GHashTable *wanted;     /* files in bootdir staged by this run */
+  GError *error;
+  gint copied;
+  gint unchanged;
+  gint cache_hits;
+} StageContext;
+
+static void
+set_error (StageContext *ctx, GError *error)
+{
+  g_mutex_lock(&ctx->lock);
+  if (ctx->error == NULL)
+    ctx->error = error;
+  else
+    g_error_free(error);
+  g_mutex_unlock(&ctx->lock);
+}
+
+static void
+add_wanted (StageContext *ctx, const gchar *name)
+{
+  g_mutex_lock(&ctx->lock);
+  g_hash_table_add(ctx->wanted, g_strdup(name));
+  g_mutex_unlock(&ctx->lock);
+}
+
+/* Copy the content with @in and @out in the kernel: reflink if the
+   filesystem can share the extents, else copy_file_range(), else
+   sendfile(). */
+static gboolean
+copy_data (int in, int out, off_t size)
+{
+  gboolean use_cfr = TRUE;
+  off_t left = size;
+
+  if (ioctl(out, FICLONE, in) == 0)
+    return TRUE;
+
+  while (left > 0)
+    {
+      ssize_t n;
+
+      if (use_cfr)
+	{
+	  n = copy_file_range(in, NULL, out, NULL, MIN(left, STAGE_COPY_CHUNK), 0);
+	  /* different filesystems on old kernels, or not supported */
+	  if (n < 0 && left == size &&
+	      (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+	       errno == EOPNOTSUPP))
+	    {
+	      use_cfr = FALSE;
+	      continue;
+	    }
+	}
+      else
+	n = sendfile(out, in, NULL, MIN(left, STAGE_COPY_CHUNK));
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	return FALSE;
+      if (n == 0)
+	{
+	  /* the source got shorter while copying */
+	  errno = EIO;
+	  return FALSE;
+	}
+      left -= n;
+    }
+
+  return TRUE;
+}
+
+/*
+  Copy @src to @dst with mode and timestamps like "cp -a", via a
+  temporary file and rename. If @dst has the same size and mtime
+  already, nothing is done and @copied is FALSE.
+*/
+static gboolean
+copy_file (const gchar *src, const gchar *dst, gboolean *copied,
+	   GError **error)
+{
+  g_autofree gchar *tmp = g_strconcat(dst, ".tmp", NULL);
+  struct stat st, dst_st;
+  int in, out;
+
+  *copied = FALSE;
+
+  in = open(src, O_RDONLY|O_CLOEXEC);
+  if (in < 0 || fstat(in, &st) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s': %s", src, g_strerror(err));
+      if (in >= 0)
+	close(in);
+      return FALSE;
+    }
+
+  if (stat(dst, &dst_st) == 0 && dst_st.st_size == st.st_size &&
+      dst_st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+      dst_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+    {
+      close(in);
+      return TRUE;
+    }
+
+  out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (out < 0 || !copy_data(in, out, st.st_size) ||
+      fchmod(out, st.st_mode & 07777) < 0 ||
+      futimens(out, (struct timespec[2]){st.st_atim, st.st_mtim}) < 0 ||
+      close(out) < 0 || (out = -1, rename(tmp, dst) < 0))
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to copy '%s' to '%s': %s", src, dst, g_strerror(err));
+      if (out >= 0)
+	close(out);
+      unlink(tmp);
+      close(in);
+      return FALSE;
+    }
+  close(in);
+
+  *copied = TRUE;
+  return TRUE;
+}
+
+static gboolean
+stage_file (StageContext *ctx, const gchar *src, const gchar *name,
+	    GError **error)
+{
+  g_autofree gchar *dst = g_build_filename(ctx->bootdir, name, NULL);
+  gboolean copied;
+
+  if (!copy_file(src, dst, &copied, error))
+    return FALSE;
+
+  add_wanted(ctx, name);
+  g_atomic_int_inc(copied ? &ctx->copied : &ctx->unchanged);
+
+  return TRUE;
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+/* Only the metadata of the module tree, reading all modules would
+   take longer than most dracut runs. */
+static void
+hash_tree (EVP_MD_CTX *md, const gchar *dir, const gchar *rel)
+{
+  g_autoptr(GDir) d = g_dir_open(dir, 0, NULL);
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+  const gchar *name;
+
+  if (d == NULL)
+    return;
+  while ((name = g_dir_read_name(d)) != NULL)
+    g_ptr_array_add(names, g_strdup(name));
+  g_ptr_array_sort(names, compare_names);
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      g_autofree gchar *path = g_build_filename(dir, names->pdata[i], NULL);
+      g_autofree gchar *sub = g_build_filename(rel, names->pdata[i], NULL);
+      struct stat st;
+
+      if (lstat(path, &st) < 0)
+	continue;
+      EVP_DigestUpdate(md, sub, strlen(sub) + 1);
+      EVP_DigestUpdate(md, &st.st_mode, sizeof(st.st_mode));
+      EVP_DigestUpdate(md, &st.st_size, sizeof(st.st_size));
+      EVP_DigestUpdate(md, &st.st_mtim, sizeof(st.st_mtim));
+      if (S_ISDIR(st.st_mode))
+	hash_tree(md, path, sub);
+    }
+}
+
+static gboolean
+hash_file (EVP_MD_CTX *md, const gchar *path)
+{
+  g_autofree gchar *content = NULL;
+  gsize len;
+
+  if (!g_file_get_contents(path, &content, &len, NULL))
+    return FALSE;
+  EVP_DigestUpdate(md, path, strlen(path) + 1);
+  EVP_DigestUpdate(md, content, len);
+
+  return TRUE;
+}
+
+/*
+  Key of the initrd of @kver in the cache: sha256 of the kernel, the
+  metadata of its module tree and the dracut configuration and
+  program.
+*/
+static gchar *
+initrd_cache_key (StageContext *ctx, const gchar *kver)
+{
+  g_autofree gchar *kernel = g_build_filename(ctx->modules, kver, "vmlinuz", NULL);
+  g_autofree gchar *tree = g_build_filename(ctx->modules, kver, NULL);
+  g_autofree gchar *dracut = g_strconcat(ctx->root, "/usr/bin/dracut", NULL);
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_MD_CTX *md;
+  struct stat st;
+  gchar *key;
+
+  md = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+  EVP_DigestUpdate(md, kver, strlen(kver) + 1);
+  if (!hash_file(md, kernel))
+    {
+      EVP_MD_CTX_free(md);
+      return NULL;
+    }
+  hash_tree(md, tree, "");
+
+  for (guint i = 0; dracut_conf[i]; i++)
+    {
+      g_autofree gchar *path = g_strconcat(ctx->root, dracut_conf[i], NULL);
+
+      if (g_file_test(path, G_FILE_TEST_IS_DIR))
+	{
+	  g_autoptr(GDir) d = g_dir_open(path, 0, NULL);
+	  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+	  const gchar *name;
+
+	  while (d && (name = g_dir_read_name(d)) != NULL)
+	    if (g_str_has_suffix(name, ".conf"))
+	      g_ptr_array_add(names, g_build_filename(path, name, NULL));
+	  g_ptr_array_sort(names, compare_names);
+	  for (guint j = 0; j < names->len; j++)
+	    hash_file(md, names->pdata[j]);
+	}
+      else
+	hash_file(md, path);
+    }
+  if (stat(dracut, &st) == 0)
+    {
+      EVP_DigestUpdate(md, &st.st_size, sizeof(st.st_size));
+      EVP_DigestUpdate(md, &st.st_mtim, sizeof(st.st_mtim));
+    }
+
+  EVP_DigestFinal_ex(md, md_value, &md_len);
+  EVP_MD_CTX_free(md);
+
+  key = g_malloc(md_len * 2 + 1);
+  for (unsigned int i = 0; i < md_len; i++)
+    g_snprintf(&key[i * 2], 3, "%02x", md_value[i]);
+
+  return key;
+}
+
+static gboolean
+run_dracut (StageContext *ctx, const gchar *kver, GError **error)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GSubprocess) sproc = NULL;
+  g_autofree gchar *kernel = g_strdup_printf("/boot/%s/vmlinuz-%s", ctx->slot_name, kver);
+  g_autofree gchar *initrd = g_strdup_printf("/boot/%s/initrd-%s", ctx->slot_name, kver);
+  const gchar *argv[] = {"chroot", ctx->chroot, "dracut", "-f", "--kver", kver,
+			 "--kernel-image", kernel, initrd, NULL};
+  GError *ierror = NULL;
+  gint64 start = g_get_monotonic_time();
+
+  if (verbose_flag)
+    g_printf("No initrd for kernel %s in the image, running dracut...\n", kver);
+
+  /* /dev, /proc and /sys in the chroot are only visible to dracut */
+  if (ctx->chroot)
+    launcher = chroot_launcher_new(NULL, ctx->chroot,
+				   G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
+  else
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_SILENCE);
+  if (launcher)
+    sproc = g_subprocess_launcher_spawnv(launcher,
+					 ctx->chroot ? argv : argv + 2,
+					 &ierror);
+  if (sproc == NULL || !g_subprocess_wait_check(sproc, NULL, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror,
+                                 "Failed to run dracut for %s: ", kver);
+      return FALSE;
+    }
+
+  if (verbose_flag)
+    g_printf("dracut for kernel %s took %.1f seconds\n", kver,
+	     (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC);
+
+  return TRUE;
+}
+
+/* Take the initrd from the cache or run dracut and add the result */
+static gboolean
+stage_cached_initrd (StageContext *ctx, const gchar *kver, GError **error)
+{
+  g_autofree gchar *name = g_strconcat("initrd-", kver, NULL);
+  g_autofree gchar *dst = g_build_filename(ctx->bootdir, name, NULL);
+  g_autofree gchar *key = initrd_cache_key(ctx, kver);
+  g_autofree gchar *cached = NULL;
+  GError *ierror = NULL;
+  gboolean copied;
+
+  if (key == NULL)
+    return run_dracut(ctx, kver, error);
+
+  cached = g_strdup_printf("%s/%s.img", ctx->cachedir, key);
+  if (g_file_test(cached, G_FILE_TEST_IS_REGULAR))
+    {
+      /* the access time orders the cache for pruning */
+      utimensat(AT_FDCWD, cached,
+		(struct timespec[2]){{0, UTIME_NOW}, {0, UTIME_OMIT}}, 0);
+      g_atomic_int_inc(&ctx->cache_hits);
+      return stage_file(ctx, cached, name, error);
+    }
+
+  if (!run_dracut(ctx, kver, error))
+    return FALSE;
+  add_wanted(ctx, name);
+  g_atomic_int_inc(&ctx->copied);
+
+  /* a full cache is no reason to fail the update */
+  if (g_mkdir_with_parents(ctx->cachedir, 0700) != 0 ||
+      !copy_file(dst, cached, &copied, &ierror))
+    {
+      if (debug_flag)
+	g_printf("Cannot cache initrd of %s: %s\n", kver,
+		 ierror ? ierror->message : g_strerror(errno));
+      g_clear_error(&ierror);
+    }
+
+  return TRUE;
+}
+
+static void
+stage_job (gpointer data, gpointer user_data)
+{
+  gchar *kver = data;
+  StageContext *ctx = user_data;
+  g_autofree gchar *prebuilt = g_build_filename(ctx->modules, kver, "initrd", NULL);
+  GError *ierror = NULL;
+
+  for (guint i = 0; kernel_files[i]; i++)
+    {
+      g_autofree gchar *src = g_build_filename(ctx->modules, kver, kernel_files[i], NULL);
+      g_autofree gchar *name = g_strdup_printf("%s-%s", kernel_files[i], kver);
+
+      if (i > 0 && !g_file_test(src, G_FILE_TEST_EXISTS))
+	continue;
+      if (!stage_file(ctx, src, name, &ierror))
+	goto out;
+    }
+
+  if (g_file_test(prebuilt, G_FILE_TEST_EXISTS))
+    {
+      g_autofree gchar *name = g_strconcat("initrd-", kver, NULL);
+
+      stage_file(ctx, prebuilt, name, &ierror);
+    }
+  else if (!dracut_fallback)
+    g_set_error(&ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+		"The image contains no initrd for kernel %s and dracut_fallback is disabled in tiu.conf",
+		kver);
+  else
+    stage_cached_initrd(ctx, kver, &ierror);
+
+ out:
+  if (ierror)
+    set_error(ctx, ierror);
+  g_free(kver);
+}
+
+/* Files of kernels which are no longer in the image */
+static void
+remove_stale (StageContext *ctx)
+{
+  g_autoptr(GDir) dir = g_dir_open(ctx->bootdir, 0, NULL);
+  const gchar *name;
+
+  while (dir && (name = g_dir_read_name(dir)) != NULL)
+    {
+      gboolean staged = g_str_has_prefix(name, "initrd-");
+
+      for (guint i = 0; !staged && kernel_files[i]; i++)
+	staged = g_str_has_prefix(name, kernel_files[i]) &&
+	  name[strlen(kernel_files[i])] == '-';
+      if (staged && !g_hash_table_contains(ctx->wanted, name))
+	{
+	  g_autofree gchar *path = g_build_filename(ctx->bootdir, name, NULL);
+
+	  if (debug_flag)
+	    g_printf("Removing old %s\n", path);
+	  g_remove(path);
+	}
+    }
+}
+
+typedef struct {
+  gchar *path;
+  gint64 atime;
+} CacheEntry;
+
+static gint
+compare_atime (gconstpointer a, gconstpointer b)
+{
+  const CacheEntry *ea = *(CacheEntry * const *)a;
+  const CacheEntry *eb = *(CacheEntry * const *)b;
+
+  return ea->atime < eb->atime ? 1 : ea->atime > eb->atime ? -1 : 0;
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *e = data;
+
+  g_free(e->path);
+  g_free(e);
+}
+
+/* Keep the INITRD_CACHE_MAX most recently used initrds */
+static void
+prune_cache (StageContext *ctx)
+{
+  g_autoptr(GDir) dir = g_dir_open(ctx->cachedir, 0, NULL);
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func(cache_entry_free);
+  const gchar *name;
+
+  while (dir && (name = g_dir_read_name(dir)) != NULL)
+    {
+      CacheEntry *e;
+      struct stat st;
+
+      if (!g_str_has_suffix(name, ".img"))
+	continue;
+      e = g_new0(CacheEntry, 1);
+      e->path = g_build_filename(ctx->cachedir, name, NULL);
+      if (stat(e->path, &st) == 0)
+	e->atime = st.st_atim.tv_sec * G_USEC_PER_SEC + st.st_atim.tv_nsec / 1000;
+      g_ptr_array_add(entries, e);
+    }
+
+  g_ptr_array_sort(entries, compare_atime);
+  for (guint i = INITRD_CACHE_MAX; i < entries->len; i++)
+    g_remove(((CacheEntry *)entries->pdata[i])->path);
+}
+
+/*
+  Stage every kernel in /usr/lib/modules with its initrd into
+  /boot/@slot_name, below @chroot if not NULL. The kernels are handled
+  in parallel, unchanged files are not copied again. The initrd comes
+  from the image (/usr/lib/modules/<version>/initrd, see
+  create_image()); if there is none and dracut_fallback is set (the
+  default), it is built with dracut and then cached under
+  INITRD_CACHE_DIR.
+*/
+gboolean
+stage_kernels (const gchar *chroot, const gchar *slot_name, GError **error)
+{
+  StageContext ctx = {
+    .chroot = chroot,
+    .root = chroot ? chroot : "",
+    .slot_name = slot_name,
+  };
+  g_autoptr(GDir) dir = NULL;
+  GThreadPool *pool;
+  GError *ierror = NULL;
+  const gchar *kver;
+  gint64 start = g_get_monotonic_time();
+  guint kernels = 0;
+  gboolean retval = TRUE;
+
+  ctx.modules = g_strconcat(ctx.root, "/usr/lib/modules", NULL);
+  ctx.bootdir = g_strdup_printf("%s/boot/%s", ctx.root, slot_name);
+  ctx.cachedir = g_strconcat(ctx.root, INITRD_CACHE_DIR, NULL);
+  ctx.wanted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  g_mutex_init(&ctx.lock);
+
+  if (g_mkdir_with_parents(ctx.bootdir, 0755) != 0)
+    {
+      int err = errno;
+      g_set_error(&ierror, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create '%s': %s", ctx.bootdir, g_strerror(err));
+      goto out;
+    }
+
+  if ((dir = g_dir_open(ctx.modules, 0, &ierror)) == NULL)
+    goto out;
+
+  pool = g_thread_pool_new(stage_job, &ctx,
+			   CLAMP(g_get_num_processors(), 1, STAGE_MAX_THREADS),
+			   FALSE, NULL);
+  while ((kver = g_dir_read_name(dir)) != NULL)
+    {
+      g_autofree gchar *kernel = g_build_filename(ctx.modules, kver, "vmlinuz", NULL);
+
+      if (!g_file_test(kernel, G_FILE_TEST_EXISTS))
+	continue;
+      g_thread_pool_push(pool, g_strdup(kver), NULL);
+      kernels++;
+    }
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  ierror = ctx.error;
+  if (ierror == NULL)
+    {
+      remove_stale(&ctx);
+      prune_cache(&ctx);
+      if (ctx.copied > 0)
+	{
+	  int fd = open(ctx.bootdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	  if (fd >= 0)
+	    {
+	      syncfs(fd);
+	      close(fd);
+	    }
+	}
+    }
+
+  if (ierror == NULL && verbose_flag)
+    g_printf("Staged %u kernels into %s in %.2f seconds (%i files copied, %i unchanged, %i initrds from cache)\n",
+	     kernels, ctx.bootdir,
+	     (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC,
+	     ctx.copied, ctx.unchanged, ctx.cache_hits);
+
+ out:
+  if (ierror)
+    {
+      g_propagate_prefixed_error(error, ierror, "Failed to update kernel: ");
+      retval = FALSE;
+    }
+  g_hash_table_destroy(ctx.wanted);
+  g_mutex_clear(&ctx.lock);
+  g_free(ctx.modules);
+  g_free(ctx.bootdir);
+  g_free(ctx.cachedir);
+
+  return retval;
+}
@@ -15,7 +15,11 @@
 */
 
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
 
@@ -63,124 +67,267 @@ is_mounted (const gchar *target, GError **error)
     return TRUE;
 }
 
-gboolean
-bind_mount (const gchar *source, const gchar *target, const gchar *dir,
-	    GError **error)
+typedef struct MountEntry {
+  gint id;
+  gint parent;
+  gchar *path;
+  GPtrArray *children;   /* in the order of mountinfo */
+} MountEntry;
+
+static void
+mount_entry_free (gpointer data)
 {
-  gboolean retval = TRUE;
-  gchar *target_path = NULL;
+  MountEntry *m = data;
 
-  if (dir != NULL)
-    target_path = g_strjoin("/", target, dir, NULL);
-  else
-    target_path = g_strjoin("", target, source, NULL);
+  g_free(m->path);
+  if (m->children)
+    g_ptr_array_free(m->children, TRUE);
+  g_free(m);
+}
 
-  if (debug_flag)
-    printf ("Mount %s into %s...\n", source, target_path);
+/* Mount points in mountinfo have " \t\n\\" as octal escapes */
+static gchar *
+unescape_path (const gchar *s)
+{
+  gchar *res = g_malloc(strlen(s) + 1), *d = res;
 
-  if (mount(source, target_path, "bind", MS_BIND|MS_REC, NULL) < 0)
-    {
-      int err = errno;
-      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-                  "failed to bind mount %s on %s: %s",
-		  source, target_path, g_strerror(err));
-      retval = FALSE;
-    }
-  else if (mount(source, target_path, "bind", MS_REC|MS_SLAVE, NULL) < 0)
+  while (*s)
     {
-      int err = errno;
-      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-                  "failed to make mount %s a slave: %s",
-		  target_path, g_strerror(err));
-      retval = FALSE;
+      if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+	  s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7')
+	{
+	  *d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+	  s += 4;
+	}
+      else
+	*d++ = *s++;
     }
+  *d = '\0';
 
-  free (target_path);
+  return res;
+}
 
-  return retval;
+/* Children before their parent. Later siblings first, they may hide
+   earlier ones (/mnt/usr mounted after /mnt/usr/local). */
+static void
+collect_mounts (MountEntry *m, GPtrArray *order)
+{
+  for (guint i = m->children ? m->children->len : 0; i > 0; i--)
+    collect_mounts(g_ptr_array_index(m->children, i - 1), order);
+  g_ptr_array_add(order, m);
 }
 
+/*
+  Unmount @target and everything mounted below it, deepest first.
+  /proc/self/mountinfo is read only once. With @lazy the mounts are
+  detached even if they are busy. Every failure is reported, the
+  remaining mounts are still tried.
+*/
 gboolean
-umount_chroot (const gchar *target, gboolean force, GError **error)
+umount_recursive (const gchar *target, gboolean lazy, GError **error)
 {
-  g_autoptr (GSubprocess) sproc = NULL;
+  g_autofree gchar *content = NULL;
+  g_autofree gchar *real = NULL;
+  g_auto(GStrv) lines = NULL;
+  GPtrArray *entries, *order;
+  GHashTable *by_id;
+  MountEntry *top = NULL;
+  GString *failed = NULL;
   GError *ierror = NULL;
-  gboolean retval = TRUE;
+  guint done = 0;
 
   if (debug_flag)
-    printf ("Umount %s...\n", target);
-
-  GPtrArray *args = g_ptr_array_new_full(4, NULL);
-  g_ptr_array_add(args, "umount");
-  g_ptr_array_add(args, "-R");
-  g_ptr_array_add(args, strdup(target));
-  g_ptr_array_add(args, NULL);
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-			    G_SUBPROCESS_FLAGS_STDOUT_SILENCE, &ierror);
-  if (sproc == NULL)
+    printf ("Umount %s%s...\n", target, lazy ? " (lazy)" : "");
+
+  real = realpath(target, NULL);
+  if (real == NULL)
     {
-      if (!force)
-	{
-	  g_propagate_prefixed_error(error, ierror,
-				     "Failed to umount chroot environment: ");
-	  retval = FALSE;
-	}
-      goto cleanup;
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+                  "failed to umount %s: %s", target, g_strerror(err));
+      return FALSE;
     }
-  else if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+
+  if (!g_file_get_contents("/proc/self/mountinfo", &content, NULL, &ierror))
     {
-      if (!force)
-	{
-	  g_propagate_prefixed_error(error, ierror,
-				     "Failed to umount chroot environment: ");
-	  retval = FALSE;
-	}
-      goto cleanup;
+      g_propagate_prefixed_error(error, ierror, "failed to umount %s: ", target);
+      return FALSE;
     }
 
- cleanup:
-  g_ptr_array_free(args, TRUE);
-  return retval;
-}
-
-gboolean
-setup_chroot (const gchar *target, const gchar *root_dir, GError **error)
-{
-  GError *ierror = NULL;
+  entries = g_ptr_array_new_with_free_func(mount_entry_free);
+  by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+  lines = g_strsplit(content, "\n", -1);
+  for (guint i = 0; lines[i]; i++)
+    {
+      MountEntry *m;
+      gint id, parent;
+      char path[4096];
 
-  /* bind mount the whole stuff below /var/lib/tiu to make
-     grub2-mkconfig working */
+      /* "36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 ..." */
+      if (sscanf(lines[i], "%d %d %*s %*s %4095s", &id, &parent, path) != 3)
+	continue;
 
-  if (!g_file_test(root_dir, G_FILE_TEST_IS_DIR))
+      m = g_new0(MountEntry, 1);
+      m->id = id;
+      m->parent = parent;
+      m->path = unescape_path(path);
+      g_ptr_array_add(entries, m);
+      g_hash_table_insert(by_id, GINT_TO_POINTER(id), m);
+      /* the last mount on the target is the visible one */
+      if (strcmp(m->path, real) == 0)
+	top = m;
+    }
+  for (guint i = 0; i < entries->len; i++)
     {
-      gint ret;
-      ret = g_mkdir_with_parents(root_dir, 0700);
-
-      if (ret != 0)
-        {
-          g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                      "Failed creating mount path '%s'", root_dir);
-          return FALSE;
-        }
+      MountEntry *m = g_ptr_array_index(entries, i);
+      MountEntry *p = g_hash_table_lookup(by_id, GINT_TO_POINTER(m->parent));
+
+      if (p && p != m)
+	{
+	  if (p->children == NULL)
+	    p->children = g_ptr_array_new();
+	  g_ptr_array_add(p->children, m);
+	}
     }
 
-  if (target != NULL && !bind_mount(target, root_dir, "", &ierror))
+  if (top == NULL)
     {
-      g_propagate_error(error, ierror);
-      umount_chroot (target, TRUE, &ierror);
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                  "failed to umount %s: not mounted", target);
+      g_hash_table_destroy(by_id);
+      g_ptr_array_free(entries, TRUE);
       return FALSE;
     }
 
-  for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++)
+  order = g_ptr_array_new();
+  collect_mounts(top, order);
+
+  for (guint i = 0; i < order->len; i++)
     {
-      if (!bind_mount(devices[i], root_dir, NULL, &ierror))
+      MountEntry *m = g_ptr_array_index(order, i);
+
+      if (umount2(m->path, UMOUNT_NOFOLLOW | (lazy ? MNT_DETACH : 0)) == 0)
 	{
-	  g_propagate_error(error, ierror);
-	  umount_chroot (root_dir, TRUE, &ierror);
-	  return FALSE;
+	  done++;
+	  continue;
 	}
+      /* already gone, e.g. by propagation from another mount */
+      if (errno == EINVAL || errno == ENOENT)
+	continue;
+
+      if (failed == NULL)
+	failed = g_string_new(NULL);
+      else
+	g_string_append(failed, ", ");
+      g_string_append_printf(failed, "%s: %s", m->path, g_strerror(errno));
     }
 
+  if (debug_flag)
+    printf ("Unmounted %u of %u mounts below %s\n", done, order->len, target);
+
+  g_ptr_array_free(order, TRUE);
+  g_hash_table_destroy(by_id);
+  g_ptr_array_free(entries, TRUE);
+
+  if (failed)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                  "failed to umount %s (%s)", target, failed->str);
+      g_string_free(failed, TRUE);
+      return FALSE;
+    }
 
   return TRUE;
 }
+
+/* All paths are prepared by the parent, after fork() the child only
+   does syscalls. */
+typedef struct {
+  gchar *target;
+  gchar *root_dir;
+  gchar *device_dirs[G_N_ELEMENTS(devices)];
+} ChrootSetup;
+
+static void
+chroot_setup_free (gpointer data)
+{
+  ChrootSetup *setup = data;
+
+  g_free(setup->target);
+  g_free(setup->root_dir);
+  for (size_t i = 0; i < G_N_ELEMENTS(devices); i++)
+    g_free(setup->device_dirs[i]);
+  g_free(setup);
+}
+
+static void G_GNUC_NORETURN
+child_setup_failed (const char *what, const char *path)
+{
+  int err = errno;
+
+  dprintf(STDERR_FILENO, "Failed to setup chroot environment (%s %s): %s\n",
+	  what, path, strerror(err));
+  _exit(127);
+}
+
+/* Runs in the child before exec: everything is mounted into a private
+   mount namespace, which vanishes with the last process in it. */
+static void
+chroot_child_setup (gpointer user_data)
+{
+  ChrootSetup *setup = user_data;
+
+  if (unshare(CLONE_NEWNS) < 0)
+    child_setup_failed("unshare", "mount namespace");
+  /* nothing may propagate back into the host */
+  if (mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) < 0)
+    child_setup_failed("make private", "/");
+
+  if (setup->target &&
+      mount(setup->target, setup->root_dir, NULL, MS_BIND|MS_REC, NULL) < 0)
+    child_setup_failed("bind mount", setup->target);
+
+  for (size_t i = 0; i < G_N_ELEMENTS(devices); i++)
+    if (mount(devices[i], setup->device_dirs[i], NULL, MS_BIND|MS_REC, NULL) < 0)
+      child_setup_failed("bind mount", devices[i]);
+}
+
+/*
+  Create a launcher for processes which chroot into @root_dir: they run
+  in their own mount namespace with @target (if not NULL), /dev, /proc
+  and /sys bind mounted below @root_dir. The host never sees these
+  mounts and nothing has to be unmounted afterwards.
+*/
+GSubprocessLauncher *
+chroot_launcher_new (const gchar *target, const gchar *root_dir,
+		     GSubprocessFlags flags, GError **error)
+{
+  GSubprocessLauncher *launcher;
+  ChrootSetup *setup;
+
+  if (!g_file_test(root_dir, G_FILE_TEST_IS_DIR) &&
+      g_mkdir_with_parents(root_dir, 0700) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+                  "Failed creating mount path '%s': %s", root_dir,
+                  g_strerror(err));
+      return NULL;
+    }
+
+  if (debug_flag)
+    printf ("Prepare private chroot environment %s%s%s...\n", root_dir,
+	    target ? " for " : "", target ? target : "");
+
+  setup = g_new0(ChrootSetup, 1);
+  setup->target = g_strdup(target);
+  setup->root_dir = g_strdup(root_dir);
+  for (size_t i = 0; i < G_N_ELEMENTS(devices); i++)
+    setup->device_dirs[i] = g_strjoin("", root_dir, devices[i], NULL);
+
+  launcher = g_subprocess_launcher_new(flags);
+  g_subprocess_launcher_set_child_setup(launcher, chroot_child_setup,
+					setup, chroot_setup_free);
+
+  return launcher;
+}
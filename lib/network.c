@@ -1,12 +1,17 @@
 #include <curl/curl.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <gio/gio.h>
+#include <glib/gprintf.h>
 #include <glib/gstdio.h>
+#include <openssl/evp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "tiu-internal.h"
+#include "tiu-ringbuf.h"
 #include "network.h"
 
 gboolean
@@ -24,9 +29,28 @@ G_STATIC_ASSERT(sizeof(curl_off_t) == 8);
 typedef struct {
   const gchar *url;
   FILE *dl;
+  TIURingBuf *ring;
   curl_off_t pos;
   curl_off_t limit;
   gchar *err;
+  /* resume support */
+  CURL *curl;
+  curl_off_t resume_from;
+  const gchar *if_range;
+  const gchar *info;
+  gboolean started;
+  gchar *etag;
+  gchar *last_modified;
+  gboolean accept_ranges;
+  /* result of the last transfer, needed to decide about a retry */
+  CURLcode result;
+  long response_code;
+  /* digest of the data written to the file so far */
+  EVP_MD_CTX *md;
+  curl_off_t hashed;
+  /* end of a checksummed stream, not handed over before it is verified */
+  guint8 *hold;
+  gsize hold_fill;
 } IMGTransfer;
 
 gboolean
@@ -47,11 +71,149 @@ network_init (GError **error)
   return TRUE;
 }
 
+/*
+  Remember the validators of a partial download, so that the next
+  attempt can ask the server to continue only if the file did not
+  change in between.
+*/
+static void
+save_part_info (IMGTransfer *xfer)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new();
+  GError *ierror = NULL;
+
+  g_key_file_set_string(key_file, "download", "url", xfer->url);
+  if (xfer->etag)
+    g_key_file_set_string(key_file, "download", "etag", xfer->etag);
+  if (xfer->last_modified)
+    g_key_file_set_string(key_file, "download", "last-modified",
+			  xfer->last_modified);
+
+  if (!g_key_file_save_to_file(key_file, xfer->info, &ierror))
+    {
+      /* not fatal, the next attempt has to start from the beginning */
+      if (debug_flag)
+	g_printf("Cannot save download state: %s\n", ierror->message);
+      g_clear_error(&ierror);
+    }
+}
+
+static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	IMGTransfer *xfer = userdata;
+	size_t len = size*nitems;
+	const gchar *value;
+
+	if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		/* new response, e.g. after a redirect */
+		g_clear_pointer(&xfer->etag, g_free);
+		g_clear_pointer(&xfer->last_modified, g_free);
+		xfer->accept_ranges = FALSE;
+		return len;
+	}
+
+	if (len > 14 && g_ascii_strncasecmp(buffer, "Accept-Ranges:", 14) == 0) {
+		g_autofree gchar *str = g_strstrip(g_strndup(buffer + 14, len - 14));
+		xfer->accept_ranges = (g_ascii_strcasecmp(str, "bytes") == 0);
+		return len;
+	}
+
+	if (len > 5 && g_ascii_strncasecmp(buffer, "ETag:", 5) == 0)
+		value = buffer + 5;
+	else if (len > 14 && g_ascii_strncasecmp(buffer, "Last-Modified:", 14) == 0)
+		value = buffer + 14;
+	else
+		return len;
+
+	gchar *str = g_strstrip(g_strndup(value, len - (value - buffer)));
+	if (buffer[0] == 'E' || buffer[0] == 'e') {
+		g_free(xfer->etag);
+		xfer->etag = str;
+	} else {
+		g_free(xfer->last_modified);
+		xfer->last_modified = str;
+	}
+
+	return len;
+}
+
+/*
+  Called with the first data of a response. If we asked for a range
+  but the server sends the whole file (not supporting ranges or the
+  file changed), the partial data is thrown away.
+*/
+static gboolean
+start_of_data(IMGTransfer *xfer)
+{
+	xfer->started = TRUE;
+	curl_easy_getinfo(xfer->curl, CURLINFO_RESPONSE_CODE, &xfer->response_code);
+
+	if (xfer->resume_from > 0 && xfer->response_code == 200) {
+		if (verbose_flag)
+			g_printf("Server sent the complete file, restarting download from the beginning\n");
+		fflush(xfer->dl);
+		if (ftruncate(fileno(xfer->dl), 0) != 0) {
+			xfer->err = g_strdup_printf("Cannot truncate partial download: %s",
+						    g_strerror(errno));
+			return FALSE;
+		}
+		xfer->resume_from = 0;
+		xfer->pos = 0;
+		if (xfer->md) {
+			EVP_DigestInit_ex(xfer->md, EVP_sha256(), NULL);
+			xfer->hashed = 0;
+		}
+	}
+
+	if (xfer->info)
+		save_part_info(xfer);
+
+	return TRUE;
+}
+
+/*
+  Hand @len bytes of a stream over to the consumer. If the stream has
+  a checksum, the last DOWNLOAD_STREAM_HOLD bytes are always kept
+  back, so that swupdate cannot see the end of the archive before
+  download_stream() has verified it.
+*/
+static gboolean
+stream_write(IMGTransfer *xfer, const char *ptr, size_t len)
+{
+	size_t flush, from_hold;
+
+	if (xfer->hold == NULL)
+		return ringbuf_write(xfer->ring, ptr, len);
+
+	if (xfer->hold_fill + len <= 2 * DOWNLOAD_STREAM_HOLD) {
+		memcpy(xfer->hold + xfer->hold_fill, ptr, len);
+		xfer->hold_fill += len;
+		return TRUE;
+	}
+
+	/* pass on everything but the last DOWNLOAD_STREAM_HOLD bytes */
+	flush = xfer->hold_fill + len - DOWNLOAD_STREAM_HOLD;
+	from_hold = MIN(flush, xfer->hold_fill);
+	if (!ringbuf_write(xfer->ring, xfer->hold, from_hold) ||
+	    !ringbuf_write(xfer->ring, ptr, flush - from_hold))
+		return FALSE;
+	memmove(xfer->hold, xfer->hold + from_hold, xfer->hold_fill - from_hold);
+	xfer->hold_fill -= from_hold;
+	memcpy(xfer->hold + xfer->hold_fill, ptr + (flush - from_hold),
+	       len - (flush - from_hold));
+	xfer->hold_fill += len - (flush - from_hold);
+
+	return TRUE;
+}
+
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	IMGTransfer *xfer = userdata;
 	size_t res;
 
+	if (!xfer->started && xfer->dl && !start_of_data(xfer))
+		return 0;
+
 	/* check transfer limit */
 	if (xfer->limit) {
 		if ((guint64)(xfer->pos + size*nmemb) > (guint64)xfer->limit) {
@@ -60,9 +222,28 @@ static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 		}
 	}
 
+	if (xfer->ring) {
+		if (xfer->md) {
+			EVP_DigestUpdate(xfer->md, ptr, size*nmemb);
+			xfer->hashed += size*nmemb;
+		}
+		if (!stream_write(xfer, ptr, size*nmemb)) {
+			xfer->err = g_strdup("Consumer stopped reading. Download aborted.");
+			return 0;
+		}
+		xfer->pos += size*nmemb;
+		return nmemb;
+	}
+
 	res = fwrite(ptr, size, nmemb, xfer->dl);
 	xfer->pos += size*res;
 
+	/* hash the data while we have it, no second read of the file */
+	if (xfer->md) {
+		EVP_DigestUpdate(xfer->md, ptr, size*res);
+		xfer->hashed += size*res;
+	}
+
 	return res;
 }
 
@@ -72,10 +253,10 @@ static int xfer_cb(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
 {
 	IMGTransfer *xfer = clientp;
 
-	/* check transfer limit */
+	/* check transfer limit, a resumed transfer counts only the rest */
 	if (xfer->limit) {
-		if ((dlnow > xfer->limit)
-		    || (dltotal > xfer->limit)) {
+		if ((xfer->resume_from + dlnow > xfer->limit)
+		    || (xfer->resume_from + dltotal > xfer->limit)) {
 			xfer->err = g_strdup("Maximum bundle download size exceeded. Download aborted.");
 			return 1;
 		}
@@ -90,43 +271,73 @@ transfer(IMGTransfer *xfer, GError **error)
 	CURL *curl = NULL;
 	CURLcode r;
 	char errbuf[CURL_ERROR_SIZE];
+	struct curl_slist *headers = NULL;
 	gboolean res = FALSE;
 
 	g_return_val_if_fail(xfer, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	xfer->result = CURLE_OK;
+	xfer->response_code = 0;
+	xfer->started = FALSE;
+
 	curl = curl_easy_init();
 	if (curl == NULL) {
 		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unable to start libcurl easy session");
 		goto out;
 	}
+	xfer->curl = curl;
 
 	if (debug_flag)
 	  curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-	// curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
 	curl_easy_setopt(curl, CURLOPT_URL, xfer->url);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 8L);
 	//curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, 1048576L); /* bytes per second */
-	//curl_easy_setopt(curl,  CURLOPT_LOW_SPEED_LIMIT, 1024L);
-	//curl_easy_setopt(curl,  CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+	/* abort stalled file downloads, they will be resumed by the next
+	   attempt. A stream has no resume, and it stalls whenever the
+	   consumer is slow, e.g. swupdate waiting for the disk. */
+	if (xfer->dl) {
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	}
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, xfer);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, xfer);
 	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xfer_cb);
 	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, xfer);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
 	curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, xfer->limit);
-	/* decode all supported Accept-Encoding headers */
-	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	/* decode all supported Accept-Encoding headers. Not for files,
+	   byte ranges of an encoded stream would not match the data on
+	   disk if the download gets resumed. */
+	if (xfer->ring)
+	  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 	curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
+	if (xfer->resume_from > 0) {
+		curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, xfer->resume_from);
+		if (xfer->if_range) {
+			gchar *hdr = g_strdup_printf("If-Range: %s", xfer->if_range);
+			headers = curl_slist_append(headers, hdr);
+			g_free(hdr);
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		}
+	}
+
 	/* set error buffer empty before performing a request */
 	errbuf[0] = 0;
 
 	r = curl_easy_perform(curl);
+	xfer->result = r;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &xfer->response_code);
 	if (r == CURLE_HTTP_RETURNED_ERROR) {
-		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "HTTP returned >=400");
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "HTTP returned %ld", xfer->response_code);
 		goto out;
 	} else if (r != CURLE_OK) {
 		size_t len = strlen(errbuf);
@@ -146,51 +357,1024 @@ transfer(IMGTransfer *xfer, GError **error)
 		fflush(xfer->dl);
 
 out:
+	g_clear_pointer(&headers, curl_slist_free_all);
 	g_clear_pointer(&curl, curl_easy_cleanup);
+	xfer->curl = NULL;
 	return res;
 }
 
+/* Only temporary network and server problems are worth a retry */
+static gboolean
+is_retryable_result(CURLcode result, long response_code)
+{
+  switch (result)
+    {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return TRUE;
+    case CURLE_HTTP_RETURNED_ERROR:
+      return response_code == 408 || response_code == 429 ||
+	response_code >= 500;
+    default:
+      return FALSE;
+    }
+}
+
+static gboolean
+is_retryable(const IMGTransfer *xfer)
+{
+  return is_retryable_result(xfer->result, xfer->response_code);
+}
+
+/* Choose the value for an If-Range header */
+static const gchar *
+pick_validator (const gchar *etag, const gchar *last_modified)
+{
+  /* weak entity tags are not allowed in If-Range */
+  if (etag && !g_str_has_prefix(etag, "W/"))
+    return etag;
+
+  return last_modified;
+}
+
+/*
+  Prepare the resume of a partial download. Returns the value for
+  the If-Range header, or NULL if the partial data cannot be validated
+  and the download has to start from the beginning.
+*/
+static gchar *
+load_part_info (const gchar *info, const gchar *url)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new();
+  g_autofree gchar *saved_url = NULL;
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+
+  if (!g_key_file_load_from_file(key_file, info, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  saved_url = g_key_file_get_string(key_file, "download", "url", NULL);
+  if (g_strcmp0(saved_url, url) != 0)
+    return NULL;
+
+  etag = g_key_file_get_string(key_file, "download", "etag", NULL);
+  last_modified = g_key_file_get_string(key_file, "download", "last-modified", NULL);
+
+  return g_strdup(pick_validator(etag, last_modified));
+}
+
+/*
+  Add the bytes from @from to @to of @fd to the digest. Used for data
+  which was not seen by the write callback, like a partial download of
+  an earlier run. Normally this is still in the page cache.
+*/
+static gboolean
+hash_file_range (EVP_MD_CTX *md, int fd, curl_off_t from, curl_off_t to,
+		 GError **error)
+{
+  g_autofree guchar *buf = g_malloc(DOWNLOAD_HASH_BUFSIZE);
+
+  while (from < to)
+    {
+      ssize_t n = pread(fd, buf, MIN(DOWNLOAD_HASH_BUFSIZE, to - from), from);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  int err = n < 0 ? errno : EIO;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read downloaded data: %s", g_strerror(err));
+	  return FALSE;
+	}
+      EVP_DigestUpdate(md, buf, n);
+      from += n;
+    }
+
+  return TRUE;
+}
+
+/* Compare the final digest with the expected hex string */
+static gboolean
+verify_digest (EVP_MD_CTX *md, const gchar *sha256sum, GError **error)
+{
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  gchar hex[2 * EVP_MAX_MD_SIZE + 1];
+
+  EVP_DigestFinal_ex(md, md_value, &md_len);
+  for (unsigned int i = 0; i < md_len; i++)
+    g_snprintf(&hex[i * 2], 3, "%02x", md_value[i]);
+
+  if (g_ascii_strcasecmp(hex, sha256sum) != 0)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "SHA256 checksum mismatch: expected %s, got %s",
+		  sha256sum, hex);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  curl_off_t offset;
+  curl_off_t length;
+  curl_off_t done;
+  guint attempts;
+  guint8 *data;        /* received data not yet in the digest */
+} DLPiece;
+
+/* Data of a segmented download with several parallel connections */
+typedef struct {
+  int fd;
+  const gchar *url;
+  struct curl_slist *headers;
+  GQueue pending;      /* DLPiece, not yet downloaded parts */
+  GList *conns;        /* DLConn, running connections */
+  guint active;        /* number of running connections */
+  curl_off_t received;
+  gboolean no_range;   /* server ignored a range request */
+  EVP_MD_CTX *md;      /* digest of the file, NULL if not needed */
+  curl_off_t hashed;   /* the first bytes already in the digest */
+  DLPiece *pieces;     /* all parts, in file order */
+  guint n_pieces;
+} DLSegmented;
+
+typedef struct {
+  DLSegmented *dl;
+  DLPiece *piece;
+  CURL *curl;
+  gboolean started;
+  gchar *err;
+  char errbuf[CURL_ERROR_SIZE];
+} DLConn;
+
+static size_t segment_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	DLConn *conn = userdata;
+	DLPiece *piece = conn->piece;
+	size_t len = size*nmemb;
+
+	if (!conn->started) {
+		long code = 0;
+
+		conn->started = TRUE;
+		curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &code);
+		if (code != 206) {
+			/* range ignored or file changed (If-Range) */
+			conn->dl->no_range = TRUE;
+			return 0;
+		}
+	}
+
+	if (piece->done + (curl_off_t)len > piece->length) {
+		conn->err = g_strdup("Server sent more data than requested");
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t n = pwrite(conn->dl->fd, ptr, len, piece->offset + piece->done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			conn->err = g_strdup_printf("Writing downloaded data failed: %s",
+						    g_strerror(errno));
+			return 0;
+		}
+		/* the piece at the end of the hashed data gets added to
+		   the digest directly, the others are kept until it is
+		   their turn, see download_segmented() */
+		if (conn->dl->md && piece->offset + piece->done == conn->dl->hashed) {
+			EVP_DigestUpdate(conn->dl->md, ptr, n);
+			conn->dl->hashed += n;
+		} else if (conn->dl->md) {
+			if (piece->data == NULL)
+				piece->data = g_malloc(piece->length);
+			memcpy(piece->data + piece->done, ptr, n);
+		}
+		ptr += n;
+		len -= n;
+		piece->done += n;
+		conn->dl->received += n;
+	}
+
+	/* the kept part was caught up with, the rest went in directly */
+	if (piece->data && piece->done == piece->length &&
+	    conn->dl->hashed == piece->offset + piece->length)
+		g_clear_pointer(&piece->data, g_free);
+
+	return nmemb;
+}
+
+static gboolean
+start_connection (CURLM *multi, DLSegmented *dl, DLPiece *piece,
+		  GError **error)
+{
+  DLConn *conn = g_new0(DLConn, 1);
+  g_autofree gchar *range = NULL;
+
+  conn->dl = dl;
+  conn->piece = piece;
+  conn->curl = curl_easy_init();
+  if (conn->curl == NULL)
+    {
+      g_free(conn);
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Unable to start libcurl easy session");
+      return FALSE;
+    }
+
+  range = g_strdup_printf("%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT,
+			  (gint64)(piece->offset + piece->done),
+			  (gint64)(piece->offset + piece->length - 1));
+
+  if (debug_flag)
+    curl_easy_setopt(conn->curl, CURLOPT_VERBOSE, 1L);
+  curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(conn->curl, CURLOPT_URL, dl->url);
+  curl_easy_setopt(conn->curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(conn->curl, CURLOPT_HTTPHEADER, dl->headers);
+  curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(conn->curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+  curl_easy_setopt(conn->curl, CURLOPT_LOW_SPEED_TIME, 60L);
+  curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+  curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, conn);
+  curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, conn);
+  curl_easy_setopt(conn->curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, conn->errbuf);
+  curl_easy_setopt(conn->curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+  conn->errbuf[0] = 0;
+
+  curl_multi_add_handle(multi, conn->curl);
+  dl->conns = g_list_prepend(dl->conns, conn);
+  dl->active++;
+
+  return TRUE;
+}
+
+static void
+free_connection (CURLM *multi, DLConn *conn)
+{
+  curl_multi_remove_handle(multi, conn->curl);
+  curl_easy_cleanup(conn->curl);
+  conn->dl->conns = g_list_remove(conn->dl->conns, conn);
+  conn->dl->active--;
+  g_free(conn->err);
+  g_free(conn);
+}
+
+/*
+  Ask the server for the size of the file and if it supports byte
+  ranges. Returns FALSE if a segmented download is not possible.
+*/
+static gboolean
+probe_ranges (const gchar *url, curl_off_t *size, gchar **effective_url,
+	      gchar **validator)
+{
+  IMGTransfer xfer = {0};
+  CURL *curl;
+  CURLcode r;
+  long code = 0;
+  char *eurl = NULL;
+  gboolean res = FALSE;
+
+  curl = curl_easy_init();
+  if (curl == NULL)
+    return FALSE;
+
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 8L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &xfer);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+
+  r = curl_easy_perform(curl);
+  if (r != CURLE_OK)
+    goto out;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, size);
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &eurl);
+
+  if (code != 200 || !xfer.accept_ranges || *size <= 0 || eurl == NULL)
+    goto out;
+
+  *effective_url = g_strdup(eurl);
+  *validator = g_strdup(pick_validator(xfer.etag, xfer.last_modified));
+  res = TRUE;
+
+ out:
+  g_clear_pointer(&xfer.etag, g_free);
+  g_clear_pointer(&xfer.last_modified, g_free);
+  curl_easy_cleanup(curl);
+
+  return res;
+}
+
+/*
+  Download @url into @target with several parallel connections, each
+  fetching byte ranges of DOWNLOAD_SEGMENT_SIZE bytes. The number of
+  connections starts small and grows as long as this increases the
+  throughput, up to download_connections.
+
+  If the server does not support byte ranges, FALSE is returned and
+  @fallback is set, so that the caller can use a single stream.
+
+  If @md is set, the file gets hashed in order while the pieces arrive,
+  it is never read again. Pieces ahead of the hashed data are kept in
+  memory until it is their turn. Only pieces up to download_connections
+  ahead of the first one not hashed yet get started, this bounds the
+  memory to download_connections * DOWNLOAD_SEGMENT_SIZE.
+*/
+static gboolean
+download_segmented (const gchar *target, const gchar *url, goffset limit,
+		    EVP_MD_CTX *md, gboolean *fallback, GError **error)
+{
+  DLSegmented dl = {0};
+  CURLM *multi = NULL;
+  curl_off_t size = 0;
+  g_autofree gchar *effective_url = NULL;
+  g_autofree gchar *validator = NULL;
+  guint want, max_conns, window;
+  gboolean growing = TRUE;
+  gdouble best_rate = 0;
+  gint64 last_sample;
+  curl_off_t last_received = 0;
+  gboolean res = FALSE;
+
+  *fallback = TRUE;
+  g_queue_init(&dl.pending);
+  dl.fd = -1;
+
+  if (!probe_ranges(url, &size, &effective_url, &validator) ||
+      size < 2 * DOWNLOAD_SEGMENT_SIZE)
+    return FALSE;
+
+  *fallback = FALSE;
+
+  if (limit && size > limit)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Transfer failed: Maximum bundle download size exceeded. Download aborted.");
+      return FALSE;
+    }
+
+  dl.fd = open(target, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (dl.fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed opening target file: %s", g_strerror(err));
+      return FALSE;
+    }
+  /* Reserve the space now, the segments get written out of order */
+  if (posix_fallocate(dl.fd, 0, size) != 0 && ftruncate(dl.fd, size) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to allocate %" G_GINT64_FORMAT " bytes for the download: %s",
+		  (gint64)size, g_strerror(err));
+      goto out;
+    }
+
+  dl.url = effective_url;
+  if (validator)
+    {
+      g_autofree gchar *hdr = g_strdup_printf("If-Range: %s", validator);
+      dl.headers = curl_slist_append(NULL, hdr);
+    }
+
+  dl.n_pieces = (size + DOWNLOAD_SEGMENT_SIZE - 1) / DOWNLOAD_SEGMENT_SIZE;
+  dl.pieces = g_new0(DLPiece, dl.n_pieces);
+  for (guint i = 0; i < dl.n_pieces; i++)
+    {
+      DLPiece *piece = &dl.pieces[i];
+      piece->offset = (curl_off_t)i * DOWNLOAD_SEGMENT_SIZE;
+      piece->length = MIN(DOWNLOAD_SEGMENT_SIZE, size - piece->offset);
+      g_queue_push_tail(&dl.pending, piece);
+    }
+
+  dl.md = md;
+  if (md)
+    EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+
+  max_conns = MAX(download_connections, 1);
+  want = MIN(2, max_conns);
+  /* without a digest the order does not matter */
+  window = md ? max_conns + 1 : dl.n_pieces;
+  if (verbose_flag)
+    g_printf("Downloading %" G_GINT64_FORMAT " bytes with up to %u connections\n",
+	     (gint64)size, max_conns);
+
+  multi = curl_multi_init();
+  last_sample = g_get_monotonic_time();
+
+  while (dl.active > 0 || !g_queue_is_empty(&dl.pending))
+    {
+      CURLMsg *msg;
+      int running, left;
+      gint64 now;
+
+      while (dl.active < want && !g_queue_is_empty(&dl.pending))
+	{
+	  DLPiece *next = g_queue_peek_head(&dl.pending);
+
+	  if ((next - dl.pieces) >= dl.hashed / DOWNLOAD_SEGMENT_SIZE + window)
+	    break;
+	  if (!start_connection(multi, &dl, g_queue_pop_head(&dl.pending), error))
+	    goto out;
+	}
+
+      if (curl_multi_perform(multi, &running) != CURLM_OK ||
+	  curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+	{
+	  g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		      "Transfer failed: curl multi interface error");
+	  goto out;
+	}
+
+      while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+	{
+	  DLConn *conn = NULL;
+	  DLPiece *piece;
+	  long code = 0;
+
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&conn);
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+	  piece = conn->piece;
+
+	  if (dl.no_range)
+	    {
+	      /* The file changed on the server or the server does not
+		 support ranges after all, start again with a single stream. */
+	      free_connection(multi, conn);
+	      *fallback = TRUE;
+	      goto out;
+	    }
+
+	  if (msg->data.result == CURLE_OK && piece->done == piece->length)
+	    {
+	      free_connection(multi, conn);
+	      continue;
+	    }
+
+	  piece->attempts++;
+	  if (conn->err != NULL ||
+	      (msg->data.result != CURLE_OK &&
+	       !is_retryable_result(msg->data.result, code)) ||
+	      piece->attempts >= DOWNLOAD_RETRIES)
+	    {
+	      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			  "Transfer failed: %s",
+			  conn->err ? conn->err :
+			  (conn->errbuf[0] ? conn->errbuf :
+			   curl_easy_strerror(msg->data.result)));
+	      free_connection(multi, conn);
+	      goto out;
+	    }
+
+	  /* continue the rest of this piece with a new connection */
+	  if (verbose_flag)
+	    g_printf("Segment at %" G_GINT64_FORMAT " failed: %s, retrying...\n",
+		     (gint64)piece->offset,
+		     conn->errbuf[0] ? conn->errbuf : curl_easy_strerror(msg->data.result));
+	  g_queue_push_head(&dl.pending, piece);
+	  free_connection(multi, conn);
+	}
+
+      /* Add the pieces which arrived ahead of the hashed data */
+      while (dl.md && dl.hashed < size)
+	{
+	  DLPiece *piece = &dl.pieces[dl.hashed / DOWNLOAD_SEGMENT_SIZE];
+	  curl_off_t end = piece->offset + piece->done;
+
+	  if (end <= dl.hashed)
+	    break;
+	  EVP_DigestUpdate(dl.md, piece->data + (dl.hashed - piece->offset),
+			   end - dl.hashed);
+	  dl.hashed = end;
+	  if (piece->done == piece->length)
+	    g_clear_pointer(&piece->data, g_free);
+	}
+
+      /* Adapt the number of connections to the measured throughput:
+	 add one more as long as the last one made things faster. */
+      now = g_get_monotonic_time();
+      if (growing && now - last_sample >= 2 * G_USEC_PER_SEC)
+	{
+	  gdouble rate = (dl.received - last_received) * (gdouble)G_USEC_PER_SEC /
+	    (now - last_sample);
+
+	  if (want < max_conns && rate > best_rate * 1.1)
+	    {
+	      best_rate = rate;
+	      want++;
+	      if (debug_flag)
+		g_printf("Throughput %.1f MiB/s, using %u connections\n",
+			 rate / (1024*1024), want);
+	    }
+	  else
+	    growing = FALSE;
+	  last_sample = now;
+	  last_received = dl.received;
+	}
+    }
+
+  if (fsync(dl.fd) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to sync '%s': %s", target, g_strerror(err));
+      goto out;
+    }
+
+  res = TRUE;
+
+ out:
+  /* abort remaining connections */
+  while (dl.conns != NULL)
+    {
+      DLConn *conn = dl.conns->data;
+      free_connection(multi, conn);
+    }
+  if (multi)
+    curl_multi_cleanup(multi);
+  g_queue_clear(&dl.pending);
+  for (guint i = 0; dl.pieces && i < dl.n_pieces; i++)
+    g_free(dl.pieces[i].data);
+  g_free(dl.pieces);
+  g_clear_pointer(&dl.headers, curl_slist_free_all);
+  if (dl.fd >= 0)
+    close(dl.fd);
+  if (!res)
+    g_remove(target);
+
+  return res;
+}
+
 gboolean
-download_file(const gchar *target, const gchar *url,
+download_file(const gchar *target, const gchar *url, const gchar *sha256sum,
 	      goffset limit, GError **error)
 {
   IMGTransfer xfer = {0};
   gboolean res = FALSE;
   GError *ierror = NULL;
+  g_autofree gchar *part = NULL;
+  g_autofree gchar *info = NULL;
+  gulong backoff = DOWNLOAD_RETRY_DELAY;
 
   g_return_val_if_fail(target, FALSE);
   g_return_val_if_fail(url, FALSE);
   g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+  /* Download into a separate file, so that an interrupted download
+     can be continued later and the target is never incomplete. */
+  part = g_strconcat(target, ".part", NULL);
+  info = g_strconcat(target, ".part.info", NULL);
+
   xfer.url = url;
   xfer.limit = limit;
+  xfer.info = info;
+  if (sha256sum)
+    {
+      xfer.md = EVP_MD_CTX_new();
+      /* force hashing of an existing partial download */
+      xfer.hashed = -1;
+    }
 
-  xfer.dl = fopen(target, "wbx");
-  if (xfer.dl == NULL)
+  /* A fresh download of a large file from a HTTP server can use
+     several connections in parallel. A partial download is always
+     continued with a single stream. */
+  if (download_connections > 1 && !g_file_test(part, G_FILE_TEST_EXISTS))
     {
-      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
-		  "Failed opening target file");
+      g_autofree gchar *scheme = g_uri_parse_scheme(url);
+
+      if (g_strcmp0(scheme, "http") == 0 || g_strcmp0(scheme, "https") == 0)
+	{
+	  gboolean fallback = FALSE;
+
+	  if (download_segmented(part, url, limit, xfer.md, &fallback, &ierror))
+	    goto done;
+	  if (!fallback)
+	    {
+	      g_propagate_error(error, ierror);
+	      goto out;
+	    }
+	  g_clear_error(&ierror);
+	  if (debug_flag)
+	    g_printf("Server does not support byte ranges, using a single stream\n");
+	}
+    }
+
+  for (guint attempt = 1; ; attempt++)
+    {
+      g_autofree gchar *if_range = NULL;
+
+      xfer.dl = fopen(part, "ab");
+      if (xfer.dl == NULL)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed opening target file: %s", g_strerror(err));
+	  goto out;
+	}
+
+      xfer.resume_from = ftello(xfer.dl);
+      if (xfer.resume_from > 0)
+	{
+	  if_range = load_part_info(info, url);
+	  if (if_range == NULL)
+	    {
+	      /* nothing to validate the partial data against */
+	      if (ftruncate(fileno(xfer.dl), 0) != 0)
+		{
+		  int err = errno;
+		  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			      "Failed truncating partial download: %s",
+			      g_strerror(err));
+		  goto out;
+		}
+	      xfer.resume_from = 0;
+	    }
+	  else if (verbose_flag)
+	    g_printf("Resuming download of '%s' at byte %" G_GINT64_FORMAT "\n",
+		     url, (gint64)xfer.resume_from);
+	}
+      xfer.pos = xfer.resume_from;
+      xfer.if_range = if_range;
+
+      /* The digest has to cover the data of an earlier run or a
+	 restart, the rest is hashed while downloading. */
+      if (xfer.md && xfer.hashed != xfer.resume_from)
+	{
+	  EVP_DigestInit_ex(xfer.md, EVP_sha256(), NULL);
+	  xfer.hashed = 0;
+	  if (xfer.resume_from > 0)
+	    {
+	      int fd = open(part, O_RDONLY|O_CLOEXEC);
+
+	      if (fd < 0)
+		{
+		  int err = errno;
+		  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			      "Failed opening partial download: %s",
+			      g_strerror(err));
+		  goto out;
+		}
+	      res = hash_file_range(xfer.md, fd, 0, xfer.resume_from, error);
+	      close(fd);
+	      if (!res)
+		goto out;
+	      xfer.hashed = xfer.resume_from;
+	    }
+	}
+
+      res = transfer(&xfer, &ierror);
+
+      g_clear_pointer(&xfer.etag, g_free);
+      g_clear_pointer(&xfer.last_modified, g_free);
+      if (fclose(xfer.dl) != 0 && res)
+	{
+	  int err = errno;
+	  g_set_error(&ierror, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to close download file '%s': %s",
+		      part, g_strerror(err));
+	  res = FALSE;
+	}
+      xfer.dl = NULL;
+
+      if (res)
+	break;
+
+      if (attempt >= DOWNLOAD_RETRIES ||
+	  (!is_retryable(&xfer) && xfer.response_code != 416))
+	{
+	  g_propagate_error(error, ierror);
+	  goto out;
+	}
+
+      if (xfer.response_code == 416)
+	{
+	  /* Requested range not satisfiable: the partial file does
+	     not fit to the file on the server. Start from scratch. */
+	  if (verbose_flag)
+	    g_printf("Partial download of '%s' is outdated, restarting...\n",
+		     url);
+	  g_remove(part);
+	  g_remove(info);
+	}
+      else
+	{
+	  if (!quiet_flag)
+	    g_printf("%s, retrying in %lu seconds (attempt %u of %u)...\n",
+		     ierror->message, backoff, attempt + 1, DOWNLOAD_RETRIES);
+	  g_usleep(backoff * G_USEC_PER_SEC);
+	  backoff = MIN(backoff * 2, DOWNLOAD_MAX_RETRY_DELAY);
+	}
+      g_clear_error(&ierror);
+    }
+
+ done:
+  if (xfer.md && !verify_digest(xfer.md, sha256sum, error))
+    {
+      /* useless for a resume, the next try has to start from scratch */
+      res = FALSE;
+      g_remove(part);
+      g_remove(info);
       goto out;
     }
 
-  res = transfer(&xfer, &ierror);
-  if (!res)
+  res = TRUE;
+  if (g_rename(part, target) != 0)
     {
-      g_propagate_error(error, ierror);
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to rename '%s' to '%s': %s",
+		  part, target, g_strerror(err));
+      res = FALSE;
       goto out;
     }
+  g_remove(info);
 
  out:
   if (xfer.dl)
+    fclose(xfer.dl);
+  g_clear_pointer(&xfer.md, EVP_MD_CTX_free);
+
+  return res;
+}
+
+/*
+  Download @url and hand the data over to @ring instead of writing
+  it to disk. The ring buffer is closed at the end of the transfer,
+  so that the consumer knows if the stream was complete or not.
+  With @sha256sum the stream is hashed while it passes, and a
+  mismatch closes the ring buffer as failed before the consumer got
+  the end of the data.
+*/
+gboolean
+download_stream(const gchar *url, const gchar *sha256sum, goffset limit,
+		TIURingBuf *ring, GError **error)
+{
+  IMGTransfer xfer = {0};
+  gboolean res;
+
+  g_return_val_if_fail(url, FALSE);
+  g_return_val_if_fail(ring, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  xfer.url = url;
+  xfer.limit = limit;
+  xfer.ring = ring;
+  if (sha256sum)
     {
-      if (fclose(xfer.dl))
+      xfer.md = EVP_MD_CTX_new();
+      EVP_DigestInit_ex(xfer.md, EVP_sha256(), NULL);
+      xfer.hold = g_malloc(2 * DOWNLOAD_STREAM_HOLD);
+    }
+
+  res = transfer(&xfer, error);
+  g_clear_pointer(&xfer.etag, g_free);
+  g_clear_pointer(&xfer.last_modified, g_free);
+
+  if (res && xfer.md)
+    {
+      res = verify_digest(xfer.md, sha256sum, error);
+      if (res && !ringbuf_write(ring, xfer.hold, xfer.hold_fill))
 	{
-	  int err = errno;
-	  fprintf (stderr, "Failed to close download file '%s': %s\n",
-		   target, g_strerror(err));
+	  g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		      "Transfer failed: Consumer stopped reading. Download aborted.");
+	  res = FALSE;
 	}
-      xfer.dl = NULL;
     }
+  ringbuf_close(ring, !res);
+
+  g_clear_pointer(&xfer.md, EVP_MD_CTX_free);
+  g_free(xfer.hold);
 
   return res;
 }
+
+static size_t file_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	return fwrite(ptr, size, nmemb, userdata);
+}
+
+/*
+  Download many small files, like the chunks of an image. All of them
+  use the same curl handle, so that the connection to the server is
+  kept open instead of a new connection for every file.
+*/
+gboolean
+download_files(const gchar * const *urls, const gchar * const *targets,
+	       GError **error)
+{
+  CURL *curl;
+  char errbuf[CURL_ERROR_SIZE];
+  gboolean res = TRUE;
+
+  g_return_val_if_fail(urls, FALSE);
+  g_return_val_if_fail(targets, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  curl = curl_easy_init();
+  if (curl == NULL)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Unable to start libcurl easy session");
+      return FALSE;
+    }
+
+  if (debug_flag)
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 8L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, file_write_cb);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+  curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+
+  for (guint i = 0; urls[i] != NULL && res; i++)
+    {
+      g_autofree gchar *part = g_strconcat(targets[i], ".part", NULL);
+      gulong backoff = DOWNLOAD_RETRY_DELAY;
+
+      curl_easy_setopt(curl, CURLOPT_URL, urls[i]);
+
+      for (guint attempt = 1; ; attempt++)
+	{
+	  FILE *fp;
+	  CURLcode r;
+	  long code = 0;
+
+	  fp = fopen(part, "wb");
+	  if (fp == NULL)
+	    {
+	      int err = errno;
+	      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			  "Failed opening target file '%s': %s", part,
+			  g_strerror(err));
+	      res = FALSE;
+	      break;
+	    }
+
+	  errbuf[0] = 0;
+	  curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+	  r = curl_easy_perform(curl);
+	  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	  if (fclose(fp) != 0 && r == CURLE_OK)
+	    r = CURLE_WRITE_ERROR;
+
+	  if (r == CURLE_OK)
+	    {
+	      if (g_rename(part, targets[i]) != 0)
+		{
+		  int err = errno;
+		  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			      "Failed to rename '%s' to '%s': %s",
+			      part, targets[i], g_strerror(err));
+		  res = FALSE;
+		}
+	      break;
+	    }
+
+	  if (attempt >= DOWNLOAD_RETRIES || !is_retryable_result(r, code))
+	    {
+	      if (r == CURLE_HTTP_RETURNED_ERROR)
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "Downloading '%s' failed: HTTP returned %ld",
+			    urls[i], code);
+	      else
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "Downloading '%s' failed: %s", urls[i],
+			    errbuf[0] ? errbuf : curl_easy_strerror(r));
+	      g_remove(part);
+	      res = FALSE;
+	      break;
+	    }
+
+	  if (verbose_flag)
+	    g_printf("Downloading '%s' failed, retrying in %lu seconds...\n",
+		     urls[i], backoff);
+	  g_usleep(backoff * G_USEC_PER_SEC);
+	  backoff = MIN(backoff * 2, DOWNLOAD_MAX_RETRY_DELAY);
+	}
+    }
+
+  curl_easy_cleanup(curl);
+
+  return res;
+}
+
+typedef struct {
+  guint8 *buf;
+  gsize len;
+  gsize fill;
+} RangeBuf;
+
+static size_t range_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	RangeBuf *rb = userdata;
+	size_t n = size * nmemb;
+
+	/* more than asked for, the server ignored the range */
+	if (n > rb->len - rb->fill)
+		return 0;
+	memcpy(rb->buf + rb->fill, ptr, n);
+	rb->fill += n;
+	return n;
+}
+
+/*
+  Fetch a small part of a remote file into memory, like the header of
+  an archive.
+*/
+gboolean
+download_range(const gchar *url, guint64 offset, guint8 *buf, gsize len,
+	       GError **error)
+{
+  g_autofree gchar *range = NULL;
+  char errbuf[CURL_ERROR_SIZE];
+  RangeBuf rb = {buf, len, 0};
+  CURL *curl;
+  CURLcode r;
+
+  g_return_val_if_fail(url, FALSE);
+  g_return_val_if_fail(buf, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  if (len == 0)
+    return TRUE;
+
+  curl = curl_easy_init();
+  if (curl == NULL)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Unable to start libcurl easy session");
+      return FALSE;
+    }
+
+  range = g_strdup_printf("%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+			  offset, offset + len - 1);
+  errbuf[0] = 0;
+  if (debug_flag)
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 8L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rb);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+  curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+
+  r = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+
+  if (r == CURLE_WRITE_ERROR)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+		  "Server of '%s' does not support byte ranges", url);
+      return FALSE;
+    }
+  if (r != CURLE_OK)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Downloading '%s' failed: %s", url,
+		  errbuf[0] ? errbuf : curl_easy_strerror(r));
+      return FALSE;
+    }
+  if (rb.fill != len)
+    {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		  "Downloading '%s' failed: got %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes",
+		  url, rb.fill, len);
+      return FALSE;
+    }
+
+  return TRUE;
+}
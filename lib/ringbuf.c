@@ -0,0 +1,150 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "tiu-ringbuf.h"
+
+struct _TIURingBuf {
+  GMutex lock;
+  GCond cond;
+  guint8 *data;
+  gsize size;
+  gsize head;     /* read position */
+  gsize fill;     /* number of bytes available for reading */
+  gboolean closed;  /* producer is done */
+  gboolean failed;  /* producer is done, but did not finish successfully */
+  gboolean aborted; /* consumer is gone, producer should stop */
+};
+
+TIURingBuf *
+ringbuf_new (gsize size)
+{
+  TIURingBuf *rb;
+
+  g_return_val_if_fail(size > 0, NULL);
+
+  rb = g_new0(TIURingBuf, 1);
+  g_mutex_init(&rb->lock);
+  g_cond_init(&rb->cond);
+  rb->data = g_malloc(size);
+  rb->size = size;
+
+  return rb;
+}
+
+void
+ringbuf_free (TIURingBuf *rb)
+{
+  if (rb == NULL)
+    return;
+
+  g_mutex_clear(&rb->lock);
+  g_cond_clear(&rb->cond);
+  g_free(rb->data);
+  g_free(rb);
+}
+
+/*
+  Append @len bytes to the buffer, blocks until there is enough space.
+  Returns FALSE if the consumer aborted and the data was not consumed.
+*/
+gboolean
+ringbuf_write (TIURingBuf *rb, const void *data, gsize len)
+{
+  const guint8 *p = data;
+
+  g_mutex_lock(&rb->lock);
+  while (len > 0)
+    {
+      gsize tail, n;
+
+      while (rb->fill == rb->size && !rb->aborted)
+	g_cond_wait(&rb->cond, &rb->lock);
+
+      if (rb->aborted)
+	{
+	  g_mutex_unlock(&rb->lock);
+	  return FALSE;
+	}
+
+      tail = (rb->head + rb->fill) % rb->size;
+      n = MIN(len, rb->size - rb->fill);
+      n = MIN(n, rb->size - tail);
+      memcpy(rb->data + tail, p, n);
+      rb->fill += n;
+      p += n;
+      len -= n;
+      g_cond_broadcast(&rb->cond);
+    }
+  g_mutex_unlock(&rb->lock);
+
+  return TRUE;
+}
+
+/*
+  Read up to @len bytes, blocks until data is available.
+  Returns the number of bytes read, 0 at the end of a successful
+  stream and -1 if the producer failed.
+*/
+gssize
+ringbuf_read (TIURingBuf *rb, void *data, gsize len)
+{
+  gsize n;
+
+  g_mutex_lock(&rb->lock);
+  while (rb->fill == 0 && !rb->closed && !rb->aborted)
+    g_cond_wait(&rb->cond, &rb->lock);
+
+  if (rb->fill == 0)
+    {
+      gssize ret = (rb->failed || rb->aborted) ? -1 : 0;
+      g_mutex_unlock(&rb->lock);
+      return ret;
+    }
+
+  n = MIN(len, rb->fill);
+  n = MIN(n, rb->size - rb->head);
+  memcpy(data, rb->data + rb->head, n);
+  rb->head = (rb->head + n) % rb->size;
+  rb->fill -= n;
+  g_cond_broadcast(&rb->cond);
+  g_mutex_unlock(&rb->lock);
+
+  return n;
+}
+
+/* Called by the producer if no more data will follow. */
+void
+ringbuf_close (TIURingBuf *rb, gboolean failed)
+{
+  g_mutex_lock(&rb->lock);
+  rb->closed = TRUE;
+  rb->failed = failed;
+  g_cond_broadcast(&rb->cond);
+  g_mutex_unlock(&rb->lock);
+}
+
+/* Called by the consumer if it will not read any more data. */
+void
+ringbuf_abort (TIURingBuf *rb)
+{
+  g_mutex_lock(&rb->lock);
+  rb->aborted = TRUE;
+  g_cond_broadcast(&rb->cond);
+  g_mutex_unlock(&rb->lock);
+}
@@ -0,0 +1,612 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <glib/gprintf.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "tiu-slot.h"
+#include "tiu-uring.h"
+
+struct _TIUSlotWriter {
+  gchar *device;
+  int fd;
+  gboolean direct;   /* opened with O_DIRECT */
+  guint8 *buf;       /* the buffer being filled, one of bufs */
+  gsize fill;
+  guint64 offset;    /* device offset of the buffer */
+  gint64 start;
+  /* Full buffers are written in the background with io_uring, or
+     collected for one pwritev() without it. */
+  guint8 **bufs;
+  guint n_bufs;
+  guint cur;
+  gsize *buf_len;
+  guint64 *buf_offset;
+  gboolean *busy;
+  guint queued;      /* pwritev(): bufs[0..queued-1] are full */
+  TIUUring *uring;
+  /* skip_unchanged_blocks: compare with the old content first */
+  gboolean compare;
+  guint8 *old;
+  guint64 skipped;
+  EVP_MD_CTX *md;
+  /* every block is checked against the hash tree before writing */
+  VerityCheck *verity;
+};
+
+/* O_DIRECT needs buffers aligned to the logical block size */
+static guint8 *
+alloc_buffer (void)
+{
+  void *p;
+
+  if (posix_memalign(&p, SLOT_WRITER_ALIGN, SLOT_WRITER_BUFSIZE) != 0)
+    g_error("Out of memory allocating the slot writer buffers");
+
+  return p;
+}
+
+/*
+  Open @device for writing an image of @size bytes. If @size is
+  not 0, the device has to be large enough for it.
+*/
+TIUSlotWriter *
+slot_writer_new (const gchar *device, guint64 size, GError **error)
+{
+  TIUSlotWriter *w;
+  int flags = (skip_unchanged_blocks ? O_RDWR : O_WRONLY)|O_CLOEXEC;
+  gboolean direct = (write_queue_depth > 0);
+  int fd;
+
+  g_return_val_if_fail(device, NULL);
+  g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+  /* Bypass the page cache, writeback stalls don't slow down the
+     update and there is not much left to sync at the end. Not every
+     filesystem supports it for image files. */
+  fd = direct ? open(device, flags|O_DIRECT) : -1;
+  if (fd < 0)
+    {
+      direct = FALSE;
+      fd = open(device, flags);
+    }
+  if (fd < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to open '%s' for writing: %s", device, g_strerror(err));
+      return NULL;
+    }
+
+  if (size > 0)
+    {
+      off_t capacity = lseek(fd, 0, SEEK_END);
+
+      /* a regular file grows, only a device has a fixed size */
+      if (capacity > 0 && (guint64)capacity < size &&
+	  !g_file_test(device, G_FILE_TEST_IS_REGULAR))
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOSPC,
+		      "Image (%" G_GUINT64_FORMAT " bytes) does not fit on '%s' (%" G_GINT64_FORMAT " bytes)",
+		      size, device, (gint64)capacity);
+	  close(fd);
+	  return NULL;
+	}
+    }
+
+  w = g_new0(TIUSlotWriter, 1);
+  w->device = g_strdup(device);
+  w->fd = fd;
+  w->direct = direct;
+  w->start = g_get_monotonic_time();
+  /* the comparison reads and writes synchronously, one buffer is enough */
+  w->n_bufs = skip_unchanged_blocks ? 1 : MAX(write_queue_depth, 1);
+  w->bufs = g_new0(guint8 *, w->n_bufs);
+  for (guint i = 0; i < w->n_bufs; i++)
+    w->bufs[i] = alloc_buffer();
+  w->buf = w->bufs[0];
+  w->buf_len = g_new0(gsize, w->n_bufs);
+  w->buf_offset = g_new0(guint64, w->n_bufs);
+  w->busy = g_new0(gboolean, w->n_bufs);
+  if (skip_unchanged_blocks)
+    {
+      w->compare = TRUE;
+      w->old = alloc_buffer();
+      w->md = EVP_MD_CTX_new();
+      EVP_DigestInit_ex(w->md, EVP_sha256(), NULL);
+    }
+  else if (w->n_bufs > 1)
+    {
+      GError *ierror = NULL;
+
+      w->uring = uring_new(w->n_bufs, &ierror);
+      if (w->uring == NULL)
+	{
+	  if (debug_flag)
+	    g_printf("%s, using pwritev()\n", ierror->message);
+	  g_clear_error(&ierror);
+	}
+    }
+
+  if (debug_flag)
+    g_printf("Writing to '%s' with %s, %u buffers of %u KiB%s\n", device,
+	     w->uring ? "io_uring" : "pwritev()", w->n_bufs,
+	     SLOT_WRITER_BUFSIZE / 1024, w->direct ? ", O_DIRECT" : "");
+
+  return w;
+}
+
+static gboolean
+write_vectors (TIUSlotWriter *w, struct iovec *iov, int n, guint64 offset,
+	       GError **error)
+{
+  while (n > 0)
+    {
+      ssize_t r = pwritev(w->fd, iov, n, offset);
+      if (r < 0)
+	{
+	  int err = errno;
+
+	  if (err == EINTR)
+	    continue;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to write to '%s' at offset %" G_GUINT64_FORMAT ": %s",
+		      w->device, offset, g_strerror(err));
+	  return FALSE;
+	}
+      offset += r;
+      while (n > 0 && (gsize)r >= iov->iov_len)
+	{
+	  r -= iov->iov_len;
+	  iov++;
+	  n--;
+	}
+      if (n > 0)
+	{
+	  iov->iov_base = (guint8 *)iov->iov_base + r;
+	  iov->iov_len -= r;
+	}
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_range (TIUSlotWriter *w, gsize from, gsize to, GError **error)
+{
+  struct iovec iov = { w->buf + from, to - from };
+
+  return write_vectors(w, &iov, 1, w->offset + from, error);
+}
+
+/* Wait for the next io_uring write to finish */
+static gboolean
+reap_write (TIUSlotWriter *w, GError **error)
+{
+  guint64 id;
+  gint res;
+  guint i;
+
+  if (!uring_wait(w->uring, &id, &res, error))
+    return FALSE;
+
+  i = id;
+  w->busy[i] = FALSE;
+  if (res < 0)
+    {
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(-res),
+		  "Failed to write to '%s' at offset %" G_GUINT64_FORMAT ": %s",
+		  w->device, w->buf_offset[i], g_strerror(-res));
+      return FALSE;
+    }
+  if ((gsize)res < w->buf_len[i])
+    {
+      /* short write, the rest synchronously */
+      struct iovec iov = { w->bufs[i] + res, w->buf_len[i] - res };
+
+      return write_vectors(w, &iov, 1, w->buf_offset[i] + res, error);
+    }
+
+  return TRUE;
+}
+
+/* Write the buffers collected for pwritev() */
+static gboolean
+write_queued (TIUSlotWriter *w, GError **error)
+{
+  struct iovec iov[w->n_bufs];
+  guint n = w->queued;
+  guint8 *tmp;
+
+  if (n == 0)
+    return TRUE;
+
+  for (guint i = 0; i < n; i++)
+    {
+      iov[i].iov_base = w->bufs[i];
+      iov[i].iov_len = w->buf_len[i];
+    }
+  w->queued = 0;
+
+  /* the buffer being filled becomes the first one again */
+  tmp = w->bufs[0];
+  w->bufs[0] = w->bufs[w->cur];
+  w->bufs[w->cur] = tmp;
+  w->cur = 0;
+  w->buf = w->bufs[0];
+
+  return write_vectors(w, iov, n, w->buf_offset[0], error);
+}
+
+/* Make sure all full buffers are on the device */
+static gboolean
+drain_writes (TIUSlotWriter *w, GError **error)
+{
+  if (w->uring == NULL)
+    return write_queued(w, error);
+
+  while (uring_in_flight(w->uring) > 0)
+    if (!reap_write(w, error))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Hand the current buffer over and continue with the next free one */
+static gboolean
+queue_buffer (TIUSlotWriter *w, GError **error)
+{
+  guint i = w->cur;
+
+  w->buf_len[i] = w->fill;
+  w->buf_offset[i] = w->offset;
+
+  if (w->uring)
+    {
+      if (!uring_write(w->uring, w->fd, w->bufs[i], w->fill, w->offset,
+		       i, error))
+	return FALSE;
+      w->busy[i] = TRUE;
+      w->cur = (i + 1) % w->n_bufs;
+      while (w->busy[w->cur])
+	if (!reap_write(w, error))
+	  return FALSE;
+    }
+  else
+    {
+      w->queued++;
+      w->cur = (i + 1) % w->n_bufs;
+      if (w->cur == 0 && !write_queued(w, error))
+	return FALSE;
+    }
+
+  w->buf = w->bufs[w->cur];
+  return TRUE;
+}
+
+/* Read the current content of the device behind the buffer. Returns
+   the number of bytes available, less at the end of a file. */
+static gsize
+read_old (TIUSlotWriter *w, guint8 *data, guint64 offset, gsize len,
+	  GError **error)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = pread(w->fd, data + done, len - done, offset + done);
+      if (n < 0)
+	{
+	  int err = errno;
+
+	  if (err == EINTR)
+	    continue;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read '%s' at offset %" G_GUINT64_FORMAT ": %s",
+		      w->device, offset + done, g_strerror(err));
+	  return 0;
+	}
+      if (n == 0)
+	break;
+      done += n;
+    }
+
+  return done;
+}
+
+static gboolean
+flush_buffer (TIUSlotWriter *w, GError **error)
+{
+  if (w->fill == 0)
+    return TRUE;
+
+  /* The image may end in the middle of a block, O_DIRECT cannot
+     write that. Only the last buffer is affected. */
+  if (w->direct && w->fill % SLOT_WRITER_ALIGN != 0)
+    {
+      if (!drain_writes(w, error))
+	return FALSE;
+      if (fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT) < 0)
+	{
+	  int err = errno;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to disable O_DIRECT for '%s': %s", w->device,
+		      g_strerror(err));
+	  return FALSE;
+	}
+      w->direct = FALSE;
+    }
+
+  if (!w->compare)
+    {
+      if (!queue_buffer(w, error))
+	return FALSE;
+    }
+  else
+    {
+      GError *ierror = NULL;
+      gsize avail, pos = 0;
+
+      /* Without the verification at the end, the old content has
+	 to come from the device and not from the page cache. */
+      if (w->verity)
+	posix_fadvise(w->fd, w->offset, w->fill, POSIX_FADV_DONTNEED);
+      avail = read_old(w, w->old, w->offset, w->fill, &ierror);
+
+      if (ierror)
+	{
+	  g_propagate_error(error, ierror);
+	  return FALSE;
+	}
+
+      /* write only the runs of blocks which differ */
+      while (pos < w->fill)
+	{
+	  gsize start, len;
+
+	  len = MIN(SLOT_COMPARE_BLOCK_SIZE, w->fill - pos);
+	  if (pos + len <= avail && memcmp(w->buf + pos, w->old + pos, len) == 0)
+	    {
+	      w->skipped += len;
+	      pos += len;
+	      continue;
+	    }
+
+	  start = pos;
+	  while (pos < w->fill)
+	    {
+	      len = MIN(SLOT_COMPARE_BLOCK_SIZE, w->fill - pos);
+	      if (pos + len <= avail && memcmp(w->buf + pos, w->old + pos, len) == 0)
+		break;
+	      pos += len;
+	    }
+	  if (!write_range(w, start, pos, error))
+	    return FALSE;
+	}
+    }
+
+  w->offset += w->fill;
+  w->fill = 0;
+
+  return TRUE;
+}
+
+/*
+  Read everything back from the device, not from the page cache, and
+  compare the checksum with the one of the data written. Needed if
+  writes were skipped, the old content was only read through the
+  page cache.
+*/
+static gboolean
+verify_written (TIUSlotWriter *w, GError **error)
+{
+  guint8 expected[EVP_MAX_MD_SIZE], found[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_MD_CTX *md;
+  guint64 pos = 0;
+  gboolean res = TRUE;
+
+  EVP_DigestFinal_ex(w->md, expected, &md_len);
+
+  posix_fadvise(w->fd, 0, w->offset, POSIX_FADV_DONTNEED);
+
+  md = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+  while (pos < w->offset)
+    {
+      GError *ierror = NULL;
+      gsize n = read_old(w, w->buf, pos, MIN(SLOT_WRITER_BUFSIZE, w->offset - pos),
+			 &ierror);
+      if (n == 0)
+	{
+	  if (ierror)
+	    g_propagate_error(error, ierror);
+	  else
+	    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+			"'%s' is smaller than the written image", w->device);
+	  res = FALSE;
+	  break;
+	}
+      EVP_DigestUpdate(md, w->buf, n);
+      pos += n;
+    }
+  EVP_DigestFinal_ex(md, found, &md_len);
+  EVP_MD_CTX_free(md);
+
+  if (res && memcmp(expected, found, md_len) != 0)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+		  "Verification of '%s' failed, the written image is not correct",
+		  w->device);
+      res = FALSE;
+    }
+
+  return res;
+}
+
+/*
+  Check the image against the verity hash @tree described by @info
+  while it is written. Has to be called before the first write.
+*/
+gboolean
+slot_writer_set_verity (TIUSlotWriter *w, const VerityInfo *info,
+			const guint8 *tree, GError **error)
+{
+  g_return_val_if_fail(w, FALSE);
+  g_return_val_if_fail(slot_writer_get_offset(w) == 0, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  verity_check_free(w->verity);
+  w->verity = verity_check_new(info, tree, error);
+  if (w->verity == NULL)
+    return FALSE;
+
+  /* the checksum is only needed for the read back */
+  if (w->md)
+    g_clear_pointer(&w->md, EVP_MD_CTX_free);
+
+  return TRUE;
+}
+
+gboolean
+slot_writer_write (TIUSlotWriter *w, const void *data, gsize len,
+		   GError **error)
+{
+  const guint8 *p = data;
+  GError *ierror = NULL;
+
+  g_return_val_if_fail(w, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  if (w->verity && !verity_check_update(w->verity, data, len, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror, "Writing '%s' stopped: ",
+				 w->device);
+      return FALSE;
+    }
+
+  if (w->md)
+    EVP_DigestUpdate(w->md, data, len);
+
+  while (len > 0)
+    {
+      gsize n = MIN(len, SLOT_WRITER_BUFSIZE - w->fill);
+
+      memcpy(w->buf + w->fill, p, n);
+      w->fill += n;
+      p += n;
+      len -= n;
+
+      if (w->fill == SLOT_WRITER_BUFSIZE && !flush_buffer(w, error))
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Write the rest of the data and make sure everything is on disk */
+gboolean
+slot_writer_finish (TIUSlotWriter *w, GError **error)
+{
+  gint64 sync_start;
+
+  g_return_val_if_fail(w, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  if (w->verity && !verity_check_finish(w->verity, error))
+    return FALSE;
+
+  if (!flush_buffer(w, error) || !drain_writes(w, error))
+    return FALSE;
+
+  sync_start = g_get_monotonic_time();
+  if (fdatasync(w->fd) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to sync '%s': %s", w->device, g_strerror(err));
+      return FALSE;
+    }
+  if (debug_flag)
+    g_printf("Syncing '%s' took %.2f seconds\n", w->device,
+	     (g_get_monotonic_time() - sync_start) / (gdouble)G_USEC_PER_SEC);
+
+  if (w->compare && w->verity == NULL && !verify_written(w, error))
+    return FALSE;
+
+  if (verbose_flag)
+    {
+      gdouble secs = (g_get_monotonic_time() - w->start) / (gdouble)G_USEC_PER_SEC;
+
+      g_printf("Wrote %" G_GUINT64_FORMAT " bytes to %s in %.1f seconds (%.1f MiB/s)\n",
+	       w->offset - w->skipped, w->device, secs,
+	       secs > 0 ? w->offset / secs / (1024*1024) : 0);
+      if (w->verity)
+	g_printf("Every block was checked against the verity hash tree\n");
+      if (w->compare)
+	g_printf("%" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes were unchanged and not written\n",
+		 w->skipped, w->offset);
+    }
+
+  return TRUE;
+}
+
+/* Number of bytes handed over to the writer so far */
+guint64
+slot_writer_get_offset (TIUSlotWriter *w)
+{
+  return w->offset + w->fill;
+}
+
+void
+slot_writer_free (TIUSlotWriter *w)
+{
+  if (w == NULL)
+    return;
+
+  if (w->uring)
+    {
+      guint64 id;
+      gint res;
+
+      /* the kernel may still access the buffers of a failed update */
+      while (uring_in_flight(w->uring) > 0 &&
+	     uring_wait(w->uring, &id, &res, NULL))
+	;
+      uring_free(w->uring);
+    }
+  if (w->fd >= 0)
+    close(w->fd);
+  for (guint i = 0; i < w->n_bufs; i++)
+    free(w->bufs[i]);
+  g_free(w->bufs);
+  g_free(w->buf_len);
+  g_free(w->buf_offset);
+  g_free(w->busy);
+  free(w->old);
+  if (w->md)
+    EVP_MD_CTX_free(w->md);
+  verity_check_free(w->verity);
+  g_free(w->device);
+  g_free(w);
+}
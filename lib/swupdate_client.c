@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <string.h>
 
 #include <glib/gprintf.h>
 
@@ -27,14 +28,82 @@
 /* tiu internal */
 #include "tiu.h"
 #include "tiu-internal.h"
+#include "tiu-ringbuf.h"
+#include "tiu-slot.h"
 #include "tiu-swupdate.h"
+#include "network.h"
+#include "verity_hash.h"
+
+/* newc cpio header of the entries in a swu archive */
+#define CPIO_HEADER_SIZE 110
+#define CPIO_ALIGN(x) (((x) + 3) & ~(guint64)3)
+/* an archive has sw-description, the image and maybe some scripts */
+#define CPIO_MAX_ENTRIES 64
+
+/* Data for the thread feeding the ring buffer, either from
+   the network (url) or from a local file (fd). */
+typedef struct {
+  const gchar *url;
+  const gchar *sha256sum;
+  int fd;
+  TIURingBuf *ring;
+  gboolean res;
+  GError *error;
+} FeedData;
 
 GError *ierror = NULL;
-static int fd = -1;
+static TIURingBuf *ring = NULL;
 static pthread_mutex_t mymutex;
 static pthread_cond_t cv_end = PTHREAD_COND_INITIALIZER;
 static gboolean retval = FALSE;
-static char buf[256];
+static char *buf = NULL;
+static gsize buf_size = 0;
+static guint64 fed_bytes = 0;
+/* check of the image inside the swu archive while it is fed */
+static VerityCheck *verity = NULL;
+static guint64 image_start = 0;
+static guint64 image_end = 0;
+static GError *verity_error = NULL;
+/* the image written by tiu instead of swupdate, see swupdate_deploy() */
+static TIUSlotWriter *slot = NULL;
+static GError *slot_error = NULL;
+
+/* Check the part of the image in the next @len bytes of the archive */
+static gboolean
+check_image (const char *data, gsize len)
+{
+  guint64 from = MAX(fed_bytes, image_start);
+  guint64 to = MIN(fed_bytes + len, image_end);
+
+  if (verity == NULL || from >= to)
+    return TRUE;
+
+  if (!verity_check_update(verity, (const guint8 *)data + (from - fed_bytes),
+			   to - from, &verity_error) ||
+      (to == image_end && !verity_check_finish(verity, &verity_error)))
+    {
+      g_clear_pointer(&verity, verity_check_free);
+      return FALSE;
+    }
+  if (to == image_end)
+    g_clear_pointer(&verity, verity_check_free);
+
+  return TRUE;
+}
+
+/* Write the part of the image in the next @len bytes to the slot */
+static gboolean
+write_slot (const char *data, gsize len)
+{
+  guint64 from = MAX(fed_bytes, image_start);
+  guint64 to = MIN(fed_bytes + len, image_end);
+
+  if (slot == NULL || from >= to)
+    return TRUE;
+
+  return slot_writer_write(slot, data + (from - fed_bytes), to - from,
+			   &slot_error);
+}
 
 /*
  * this is the callback to get a new chunk of the
@@ -45,13 +114,38 @@ static char buf[256];
 static int
 readimage (char **p, int *size)
 {
-  int ret;
+  gsize fill = 0;
+
+  /* Always hand over full chunks, every call results
+     in an IPC round trip with swupdate. */
+  while (fill < buf_size)
+    {
+      gssize ret = ringbuf_read(ring, buf + fill, buf_size - fill);
+
+      if (ret < 0)
+	{
+	  *p = buf;
+	  *size = -1;
+	  return -1;
+	}
+      if (ret == 0)
+	break;
+      fill += ret;
+    }
+
+  /* A bad block is never handed over, swupdate fails instead */
+  if (!check_image(buf, fill) || !write_slot(buf, fill))
+    {
+      *p = buf;
+      *size = -1;
+      return -1;
+    }
 
-  ret = read(fd, buf, sizeof(buf));
+  fed_bytes += fill;
   *p = buf;
-  *size = ret;
+  *size = fill;
 
-  return ret;
+  return fill;
 }
 
 /*
@@ -102,26 +196,294 @@ end (RECOVERY_STATUS status)
   return 0;
 }
 
-/* Tell swupdate to deploy the image */
+/*
+ * Download thread for streaming mode, feeds the ring buffer
+ * which is read by readimage().
+ */
+static gpointer
+download_thread (gpointer data)
+{
+  FeedData *fdata = data;
+
+  fdata->res = download_stream(fdata->url, fdata->sha256sum,
+			       DEFAULT_MAX_DOWNLOAD_SIZE,
+			       fdata->ring, &fdata->error);
+
+  return NULL;
+}
+
+/*
+ * Read-ahead thread for local archives, reads large chunks
+ * so that the next chunk is already in memory when swupdate
+ * asks for it.
+ */
+static gpointer
+file_thread (gpointer data)
+{
+  FeedData *fdata = data;
+  g_autofree guint8 *chunk = g_malloc(buf_size);
+
+  /* The archive is read exactly once from start to end */
+  posix_fadvise(fdata->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fdata->fd, 0, 0, POSIX_FADV_WILLNEED);
+
+  fdata->res = TRUE;
+  for (;;)
+    {
+      ssize_t n = read(fdata->fd, chunk, buf_size);
+
+      if (n < 0)
+	{
+	  int err = errno;
+
+	  if (err == EINTR)
+	    continue;
+	  g_set_error(&fdata->error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read archive: %s", g_strerror(err));
+	  fdata->res = FALSE;
+	  break;
+	}
+      if (n == 0)
+	break;
+      /* FALSE means swupdate stopped reading, its error is
+	 more meaningful */
+      if (!ringbuf_write(fdata->ring, chunk, n))
+	break;
+    }
+
+  ringbuf_close(fdata->ring, !fdata->res);
+
+  return NULL;
+}
+
+/* Wait for the feeder thread and release the ring buffer */
+static void
+stop_feeder (GThread *feeder)
+{
+  /* If swupdate stopped reading before the end, the feeder
+     thread could wait forever for free space. */
+  ringbuf_abort(ring);
+  g_thread_join(feeder);
+  ringbuf_free(ring);
+  ring = NULL;
+  g_clear_pointer(&buf, g_free);
+}
+
+typedef gboolean (*RangeReader) (gpointer data, guint64 offset, guint8 *dest,
+				 gsize len, GError **error);
+
+static gboolean
+read_file_range (gpointer data, guint64 offset, guint8 *dest, gsize len,
+		 GError **error)
+{
+  const FeedData *fdata = data;
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = pread(fdata->fd, dest + done, len - done, offset + done);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  int err = n < 0 ? errno : EIO;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read archive: %s",
+		      n < 0 ? g_strerror(err) : "unexpected end of file");
+	  return FALSE;
+	}
+      done += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+read_url_range (gpointer data, guint64 offset, guint8 *dest, gsize len,
+		GError **error)
+{
+  const FeedData *fdata = data;
+
+  return download_range(fdata->url, offset, dest, len, error);
+}
+
+static guint64
+cpio_field (const guint8 *header, guint offset)
+{
+  gchar field[9];
+
+  memcpy(field, header + offset, 8);
+  field[8] = '\0';
+
+  return g_ascii_strtoull(field, NULL, 16);
+}
+
+/*
+  Find the image with a verity manifest in the swu archive and read
+  its hash tree. Only the headers of the cpio entries and the end of
+  the images are read, the archive itself is streamed later.
+*/
+static gboolean
+prepare_check (RangeReader reader, gpointer data, GError **error)
+{
+  guint64 pos = 0;
+
+  for (guint i = 0; i < CPIO_MAX_ENTRIES; i++)
+    {
+      guint8 header[CPIO_HEADER_SIZE];
+      g_autofree gchar *name = NULL;
+      g_autofree guint8 *tail = NULL;
+      g_autofree guint8 *tree = NULL;
+      guint64 filesize, namesize, start;
+      gsize tail_len;
+      VerityInfo info;
+
+      if (!reader(data, pos, header, sizeof(header), error))
+	return FALSE;
+      if (memcmp(header, "07070", 5) != 0 || (header[5] != '1' && header[5] != '2'))
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Archive is not a swu archive");
+	  return FALSE;
+	}
+      filesize = cpio_field(header, 54);
+      namesize = cpio_field(header, 94);
+      if (namesize == 0 || namesize > 4096)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Archive has an invalid entry");
+	  return FALSE;
+	}
+      name = g_malloc0(namesize + 1);
+      if (!reader(data, pos + CPIO_HEADER_SIZE, (guint8 *)name, namesize, error))
+	return FALSE;
+      start = CPIO_ALIGN(pos + CPIO_HEADER_SIZE + namesize);
+      pos = CPIO_ALIGN(start + filesize);
+
+      if (strcmp(name, "TRAILER!!!") == 0)
+	break;
+      if (g_str_has_prefix(name, "sw-description") || filesize < VERITY_BLOCK_SIZE)
+	continue;
+
+      tail_len = MIN(filesize, VERITY_TRAILER_MAX);
+      tail = g_malloc(tail_len);
+      if (!reader(data, start + filesize - tail_len, tail, tail_len, error))
+	return FALSE;
+      if (!verity_parse_trailer(tail, tail_len, filesize, &info, NULL))
+	continue;
+
+      tree = g_malloc(info.tree_size ? info.tree_size : 1);
+      if (!reader(data, start + info.data_size, tree, info.tree_size, error))
+	return FALSE;
+
+      verity = verity_check_new(&info, tree, error);
+      if (verity == NULL)
+	return FALSE;
+      image_start = start;
+      image_end = start + filesize;
+      if (verbose_flag)
+	g_printf("Checking '%s' against its verity hash tree while it is written\n",
+		 name);
+      return TRUE;
+    }
+
+  if (verbose_flag)
+    g_printf("Archive contains no image with verity data, it is not checked while it is written\n");
+
+  return TRUE;
+}
+
+/* Tell swupdate to deploy the image. If archive is a remote URL,
+   the archive is streamed directly to swupdate without storing it
+   on disk. A stream is checked against @sha256sum, if set; a local
+   archive was already checked when it was downloaded.
+   With @slot_device, tiu writes the image with the verity data to it
+   with the slot writer (e.g. to skip unchanged blocks) while the
+   data passes, and swupdate only verifies the archive in dry run
+   mode: the signature of sw-description and the hash of the image
+   are checked, but nothing gets installed and no scripts run. */
 gboolean
-swupdate_deploy (const char* archive, GError **error)
+swupdate_deploy (const char* archive, const gchar *sha256sum,
+		 const gchar *slot_device, GError **error)
 {
+  g_autofree gchar *scheme = NULL;
+  GThread *feeder = NULL;
+  FeedData fdata = {0};
+  gint64 start_time;
+
   if (archive == NULL) {
     /* XXX set error */
     return FALSE;
   }
 
-  if ((fd = open(archive, O_RDONLY)) < 0)
+  fdata.fd = -1;
+  scheme = g_uri_parse_scheme(archive);
+  if (is_remote_scheme(scheme))
+    {
+      if (!network_init(error))
+	return FALSE;
+
+      if (!quiet_flag)
+	g_printf("Remote URI detected, streaming tiu archive '%s' to swupdate...\n",
+		 archive);
+      fdata.url = archive;
+      fdata.sha256sum = sha256sum;
+    }
+  else if ((fdata.fd = open(archive, O_RDONLY)) < 0)
     {
       g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
                   "Unable to open '%s'", archive);
       return FALSE;
     }
 
+  g_clear_error(&verity_error);
+  if (!prepare_check(fdata.url ? read_url_range : read_file_range, &fdata,
+		     &ierror))
+    {
+      /* without the check the update is as good as before */
+      if (verbose_flag)
+	g_printf("Image is not checked while it is written: %s\n",
+		 ierror->message);
+      g_clear_error(&ierror);
+    }
+
+  g_clear_error(&slot_error);
+  if (slot_device)
+    {
+      if (verity == NULL)
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		    "'%s' contains no image with verity data, tiu cannot write it to '%s'",
+		    archive, slot_device);
+      else
+	slot = slot_writer_new(slot_device, image_end - image_start, error);
+      if (slot == NULL)
+	{
+	  g_clear_pointer(&verity, verity_check_free);
+	  if (fdata.fd >= 0)
+	    close(fdata.fd);
+	  return FALSE;
+	}
+    }
+
+  buf_size = CLAMP(feed_chunk_size, MIN_FEED_CHUNK_SIZE, MAX_FEED_CHUNK_SIZE);
+  buf = g_malloc(buf_size);
+  fed_bytes = 0;
+  /* keep a few chunks in flight */
+  ring = ringbuf_new(MAX(DEFAULT_RINGBUF_SIZE, 4 * buf_size));
+  fdata.ring = ring;
+  start_time = g_get_monotonic_time();
+  if (fdata.url)
+    feeder = g_thread_new("tiu-download", download_thread, &fdata);
+  else
+    feeder = g_thread_new("tiu-read-ahead", file_thread, &fdata);
+
   pthread_mutex_init(&mymutex, NULL);
 
   struct swupdate_request req;
   swupdate_prepare_req(&req);
+  if (slot)
+    req.dry_run = RUN_DRYRUN;
 
   int ret = swupdate_async_start(readimage, printstatus, end, &req, sizeof(req));
   /* return if we've hit an error scenario */
@@ -129,7 +491,12 @@ swupdate_deploy (const char* archive, GError **error)
     {
       g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
                   "swupdate_async_start returned '%d'", ret);
-      close(fd);
+      stop_feeder(feeder);
+      g_clear_error(&fdata.error);
+      g_clear_pointer(&verity, verity_check_free);
+      g_clear_pointer(&slot, slot_writer_free);
+      if (fdata.fd >= 0)
+	close(fdata.fd);
       return FALSE;
     }
 
@@ -138,11 +505,67 @@ swupdate_deploy (const char* archive, GError **error)
   pthread_cond_wait(&cv_end, &mymutex);
   pthread_mutex_unlock(&mymutex);
 
-  if (fd >= 0)
-    close(fd);
+  stop_feeder(feeder);
+  g_clear_pointer(&verity, verity_check_free);
 
-  if (retval != TRUE)
+  if (fdata.fd >= 0)
+    close(fdata.fd);
+
+  /* swupdate accepted the archive, now the image has to be on disk */
+  if (slot && retval == TRUE && slot_error == NULL)
+    {
+      if (fed_bytes < image_end)
+	g_set_error(&slot_error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		    "Archive ended inside of the image");
+      else
+	slot_writer_finish(slot, &slot_error);
+    }
+  g_clear_pointer(&slot, slot_writer_free);
+
+  if (verbose_flag)
+    {
+      gdouble secs = (g_get_monotonic_time() - start_time) / (gdouble)G_USEC_PER_SEC;
+      g_autofree gchar *size = g_format_size(fed_bytes);
+
+      g_printf("Fed %s to swupdate in %.1f seconds (%.1f MiB/s, %" G_GSIZE_FORMAT " bytes per chunk)\n",
+	       size, secs, secs > 0 ? fed_bytes / secs / (1024*1024) : 0.0,
+	       buf_size);
+    }
+
+  if (verity_error)
+    {
+      /* corrupt data, no matter what else failed */
+      retval = FALSE;
+      g_clear_error(&ierror);
+      g_clear_error(&fdata.error);
+      g_propagate_prefixed_error(error, verity_error,
+				 "Checking the image failed: ");
+      verity_error = NULL;
+    }
+  else if (!fdata.res)
+    {
+      /* A failed download or read is the root cause of everything
+	 swupdate complains about */
+      retval = FALSE;
+      g_clear_error(&ierror);
+      g_propagate_prefixed_error(error, fdata.error,
+				 "%s tiu archive failed: ",
+				 fdata.url ? "Downloading" : "Reading");
+    }
+  else if (slot_error)
+    {
+      /* swupdate fails as well if the feed stopped because of it */
+      retval = FALSE;
+      g_clear_error(&ierror);
+      g_clear_error(&fdata.error);
+      g_propagate_prefixed_error(error, slot_error,
+				 "Writing the image to '%s' failed: ",
+				 slot_device);
+      slot_error = NULL;
+    }
+  else if (retval != TRUE)
     {
+      g_clear_error(&fdata.error);
       if (ierror != NULL)
 	g_propagate_prefixed_error(error, ierror,
 				   "Updating /usr failed: ");
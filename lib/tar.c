@@ -0,0 +1,730 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <gio/gio.h>
+#include <glib/gprintf.h>
+
+#include "tiu-internal.h"
+#include "tiu-tar.h"
+
+/* Compressed archives are decompressed by an external tool which
+   uses all cores, libarchive only handles the tar stream. */
+typedef struct {
+  const guint8 *magic;
+  gsize magic_len;
+  const gchar * const *argv;
+} Decompressor;
+
+static const guint8 zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+static const guint8 xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const guint8 gzip_magic[] = {0x1f, 0x8b};
+static const gchar * const zstd_argv[] = {"zstd", "-d", "-c", "-q", "-T0", NULL};
+static const gchar * const xz_argv[] = {"xz", "-d", "-c", "-q", "-T0", NULL};
+static const gchar * const pigz_argv[] = {"pigz", "-d", "-c", "-q", NULL};
+
+static const Decompressor decompressors[] = {
+  {zstd_magic, sizeof(zstd_magic), zstd_argv},
+  {xz_magic, sizeof(xz_magic), xz_argv},
+  {gzip_magic, sizeof(gzip_magic), pigz_argv},
+};
+
+/* Find a parallel decompressor for @archive, NULL if there is none
+   or it is not installed. */
+static const Decompressor *
+find_decompressor (const gchar *archive)
+{
+  guint8 magic[8] = {0};
+  ssize_t n;
+  int fd;
+
+  fd = open(archive, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  n = read(fd, magic, sizeof(magic));
+  close(fd);
+
+  for (guint i = 0; i < G_N_ELEMENTS(decompressors); i++)
+    {
+      const Decompressor *d = &decompressors[i];
+
+      if (n >= (ssize_t)d->magic_len &&
+	  memcmp(magic, d->magic, d->magic_len) == 0)
+	{
+	  g_autofree gchar *path = g_find_program_in_path(d->argv[0]);
+
+	  return path ? d : NULL;
+	}
+    }
+
+  return NULL;
+}
+
+/* Start the decompressor, returns the read end of its output */
+static int
+start_decompressor (const Decompressor *d, const gchar *archive,
+		    GSubprocess **sproc, GError **error)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  GError *ierror = NULL;
+  int fds[2];
+
+  if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to create pipe: %s", g_strerror(err));
+      return -1;
+    }
+
+  launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_stdin_file_path(launcher, archive);
+  g_subprocess_launcher_take_stdout_fd(launcher, fds[1]);
+
+  *sproc = g_subprocess_launcher_spawnv(launcher, d->argv, &ierror);
+  if (*sproc == NULL)
+    {
+      g_propagate_prefixed_error(error, ierror, "Failed to start %s: ",
+				 d->argv[0]);
+      close(fds[0]);
+      return -1;
+    }
+
+  return fds[0];
+}
+
+/* TRUE if @name has a ".." component */
+static gboolean
+has_dotdot (const gchar *name)
+{
+  for (const gchar *p = name; (p = strstr(p, "..")) != NULL; p += 2)
+    if ((p == name || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Path of an entry relative to the root of the archive, with the
+   relocation applied. The root itself is "". Leading "/" are
+   stripped like tar does it, NULL if the entry would leave the
+   root with "..". */
+static gchar *
+relative_path (const gchar *name, const gchar *from, const gchar *to)
+{
+  gsize len = from ? strlen(from) : 0;
+
+  if (has_dotdot(name))
+    return NULL;
+
+  while (name[0] == '.' && (name[1] == '/' || name[1] == '\0'))
+    name += name[1] ? 2 : 1;
+  while (name[0] == '/')
+    name++;
+
+  if (from && strncmp(name, from, len) == 0 &&
+      (name[len] == '\0' || name[len] == '/'))
+    return g_strconcat(to, name + len, NULL);
+
+  return g_strdup(name);
+}
+
+/* Path of an entry below @dest, with the relocation applied, NULL
+   if it is not below @dest */
+static gchar *
+entry_path (const gchar *name, const gchar *dest, const gchar *from,
+	    const gchar *to, GError **error)
+{
+  g_autofree gchar *rel = relative_path(name, from, to);
+
+  if (rel == NULL)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Entry '%s' leaves the archive root", name);
+      return NULL;
+    }
+
+  return g_strconcat(dest, "/", rel, NULL);
+}
+
+/* Content of directories in @exclude is dropped, not the directories */
+static gboolean
+is_excluded (const gchar *rel, const gchar * const *exclude)
+{
+  for (guint i = 0; exclude && exclude[i]; i++)
+    {
+      gsize len = strlen(exclude[i]);
+
+      /* "dir/" is the directory itself */
+      if (strncmp(rel, exclude[i], len) == 0 && rel[len] == '/' &&
+	  rel[len + 1] != '\0')
+	return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* @path relative to @subtree, NULL if it is not below it */
+static const gchar *
+subtree_path (const gchar *path, const gchar *subtree)
+{
+  gsize len = strlen(subtree);
+
+  if (strncmp(path, subtree, len) != 0 ||
+      (path[len] != '\0' && path[len] != '/'))
+    return NULL;
+
+  path += len;
+  while (path[0] == '/')
+    path++;
+
+  return path[0] ? path : ".";
+}
+
+/*
+  Open @archive for reading. If a parallel decompressor is available,
+  it is started in @sproc and its output is read through @fd.
+*/
+static struct archive *
+open_archive (const gchar *archive, GSubprocess **sproc, int *fd,
+	      GError **error)
+{
+  const Decompressor *d;
+  struct archive *in;
+  int r;
+
+  *fd = -1;
+  in = archive_read_new();
+  archive_read_support_format_all(in);
+
+  d = find_decompressor(archive);
+  if (d)
+    {
+      if (debug_flag)
+	g_printf("Decompressing '%s' with %s\n", archive, d->argv[0]);
+      *fd = start_decompressor(d, archive, sproc, error);
+      if (*fd < 0)
+	{
+	  archive_read_free(in);
+	  return NULL;
+	}
+      r = archive_read_open_fd(in, *fd, TAR_READ_BLOCK_SIZE);
+    }
+  else
+    {
+      archive_read_support_filter_all(in);
+      r = archive_read_open_filename(in, archive, TAR_READ_BLOCK_SIZE);
+    }
+  if (r != ARCHIVE_OK)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to open '%s': %s", archive, archive_error_string(in));
+      archive_read_free(in);
+      if (*fd >= 0)
+	close(*fd);
+      *fd = -1;
+      return NULL;
+    }
+
+  return in;
+}
+
+/* Close what open_archive() opened, the result of the decompressor
+   is only interesting if everything else was successful */
+static gboolean
+close_archive (struct archive *in, GSubprocess *sproc, int fd,
+	       const gchar *archive, gboolean res, GError **error)
+{
+  archive_read_free(in);
+  if (fd >= 0)
+    close(fd);
+
+  if (sproc)
+    {
+      GError *ierror = NULL;
+
+      /* on error the decompressor may wait for a reader */
+      if (!res)
+	g_subprocess_force_exit(sproc);
+      if (!g_subprocess_wait_check(sproc, NULL, &ierror))
+	{
+	  if (res)
+	    g_propagate_prefixed_error(error, ierror,
+				       "Failed to decompress '%s': ", archive);
+	  else
+	    g_clear_error(&ierror);
+	  res = FALSE;
+	}
+    }
+
+  return res;
+}
+
+static gboolean
+copy_data (struct archive *in, struct archive *out, guint64 *bytes,
+	   GError **error)
+{
+  for (;;)
+    {
+      const void *block;
+      size_t size;
+      la_int64_t offset;
+      int r;
+
+      r = archive_read_data_block(in, &block, &size, &offset);
+      if (r == ARCHIVE_EOF)
+	return TRUE;
+      if (r < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to read tar archive: %s", archive_error_string(in));
+	  return FALSE;
+	}
+
+      /* holes of sparse files are skipped by the offset */
+      if (archive_write_data_block(out, block, size, offset) < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to write file: %s", archive_error_string(out));
+	  return FALSE;
+	}
+      *bytes += size;
+    }
+}
+
+/*
+  Extract the tar archive in-process. Ownership, permissions, ACLs,
+  xattrs and times are restored like tar does it as root. libarchive
+  caches the user and group lookups and sets the permissions and
+  times of directories in one pass at the end, instead of after
+  every entry below them.
+*/
+gboolean
+tar_extract (const gchar *archive, const gchar *dest,
+	     const gchar *relocate_from, const gchar *relocate_to,
+	     GError **error)
+{
+  g_autoptr(GSubprocess) sproc = NULL;
+  struct archive *in, *out;
+  struct archive_entry *entry;
+  guint64 entries = 0, bytes = 0;
+  gint64 start = g_get_monotonic_time();
+  gboolean res = FALSE;
+  int fd;
+  int r;
+
+  g_return_val_if_fail(archive, FALSE);
+  g_return_val_if_fail(dest, FALSE);
+  g_return_val_if_fail(relocate_from == NULL || relocate_to != NULL, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  in = open_archive(archive, &sproc, &fd, error);
+  if (in == NULL)
+    return FALSE;
+
+  out = archive_write_disk_new();
+  archive_write_disk_set_options(out, ARCHIVE_EXTRACT_OWNER |
+				 ARCHIVE_EXTRACT_PERM |
+				 ARCHIVE_EXTRACT_TIME |
+				 ARCHIVE_EXTRACT_ACL |
+				 ARCHIVE_EXTRACT_XATTR |
+				 /* the entries are rewritten to absolute
+				    paths below dest by entry_path(), which
+				    also rejects ".." */
+				 ARCHIVE_EXTRACT_SECURE_NODOTDOT);
+  archive_write_disk_set_standard_lookup(out);
+
+  while ((r = archive_read_next_header(in, &entry)) != ARCHIVE_EOF)
+    {
+      g_autofree gchar *path = NULL;
+      const gchar *link;
+
+      if (r < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to read '%s': %s", archive, archive_error_string(in));
+	  goto out;
+	}
+
+      path = entry_path(archive_entry_pathname(entry), dest,
+			relocate_from, relocate_to, error);
+      if (path == NULL)
+	goto out;
+      archive_entry_copy_pathname(entry, path);
+      link = archive_entry_hardlink(entry);
+      if (link)
+	{
+	  g_autofree gchar *target = entry_path(link, dest, relocate_from,
+						relocate_to, error);
+	  if (target == NULL)
+	    goto out;
+	  archive_entry_copy_hardlink(entry, target);
+	}
+
+      r = archive_write_header(out, entry);
+      if (r < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to extract '%s': %s", path, archive_error_string(out));
+	  goto out;
+	}
+      if (r < ARCHIVE_OK && debug_flag)
+	g_printf("%s: %s\n", path, archive_error_string(out));
+
+      if (archive_entry_size(entry) > 0 && !copy_data(in, out, &bytes, error))
+	goto out;
+
+      if (archive_write_finish_entry(out) < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to extract '%s': %s", path, archive_error_string(out));
+	  goto out;
+	}
+      entries++;
+    }
+
+  /* sets the metadata of the directories */
+  if (archive_write_close(out) != ARCHIVE_OK)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to extract '%s': %s", archive, archive_error_string(out));
+      goto out;
+    }
+
+  res = TRUE;
+
+ out:
+  archive_write_free(out);
+  res = close_archive(in, sproc, fd, archive, res, error);
+
+  if (res && verbose_flag)
+    {
+      gdouble secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      g_printf("Extracted %" G_GUINT64_FORMAT " entries, %" G_GUINT64_FORMAT " bytes in %.1f seconds (%.1f MiB/s)\n",
+	       entries, bytes, secs, secs > 0 ? bytes / secs / (1024*1024) : 0.0);
+    }
+
+  return res;
+}
+
+/* Add the file @root/@path as @name to @out */
+static gboolean
+append_file (struct archive *out, const gchar *root, const gchar *path,
+	     const gchar *name, guint8 *buf, guint64 *bytes, GError **error)
+{
+  g_autofree gchar *file = g_build_filename(root, path, NULL);
+  struct archive_entry *entry;
+  struct stat st;
+  gboolean res = FALSE;
+  int fd;
+
+  fd = open(file, O_RDONLY|O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      int err = errno;
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		  "Failed to add '%s' to tar stream: %s", file,
+		  g_strerror(err));
+      if (fd >= 0)
+	close(fd);
+      return FALSE;
+    }
+  if (!S_ISREG(st.st_mode))
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Failed to add '%s' to tar stream: not a regular file", file);
+      close(fd);
+      return FALSE;
+    }
+
+  entry = archive_entry_new();
+  archive_entry_copy_stat(entry, &st);
+  archive_entry_copy_pathname(entry, name);
+  if (archive_write_header(out, entry) < ARCHIVE_WARN)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to write '%s' to tar stream: %s", name,
+		  archive_error_string(out));
+      goto out;
+    }
+
+  for (;;)
+    {
+      ssize_t n = read(fd, buf, TAR_WRITE_BLOCK_SIZE);
+
+      if (n == 0)
+	break;
+      if (n < 0)
+	{
+	  int err = errno;
+
+	  if (err == EINTR)
+	    continue;
+	  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+		      "Failed to read '%s': %s", file, g_strerror(err));
+	  goto out;
+	}
+      if (archive_write_data(out, buf, n) != n)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to write tar stream: %s",
+		      archive_error_string(out));
+	  goto out;
+	}
+      *bytes += n;
+    }
+  res = TRUE;
+
+ out:
+  archive_entry_free(entry);
+  close(fd);
+  return res;
+}
+
+/* Start a pax tar stream on @fd */
+static struct archive *
+open_tar_stream (int fd, GError **error)
+{
+  struct archive *out = archive_write_new();
+
+  archive_write_set_format_pax_restricted(out);
+  archive_write_set_bytes_per_block(out, TAR_WRITE_BLOCK_SIZE);
+  archive_write_set_bytes_in_last_block(out, 1);
+  if (archive_write_open_fd(out, fd) != ARCHIVE_OK)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to start tar stream: %s", archive_error_string(out));
+      archive_write_free(out);
+      return NULL;
+    }
+
+  return out;
+}
+
+static gboolean
+close_tar_stream (struct archive *out, GError **error)
+{
+  if (archive_write_close(out) != ARCHIVE_OK)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Failed to finish tar stream: %s", archive_error_string(out));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+  Copy @archive as pax tar stream to @out_fd, with the relocation of
+  @rw applied and the content of the excluded directories left out.
+  The content of the file rw->capture is kept in rw->captured.
+  The files in rw->append are added at the end. If rw->subtree is
+  set, everything below it is written to rw->subtree_fd as a second
+  tar stream, with rw->subtree as its root.
+*/
+gboolean
+tar_rewrite (const gchar *archive, int out_fd, TarRewrite *rw, GError **error)
+{
+  g_autoptr(GSubprocess) sproc = NULL;
+  g_autofree guint8 *buf = NULL;
+  struct archive *in, *out = NULL, *sub = NULL;
+  struct archive_entry *entry;
+  guint64 entries = 0, dropped = 0, bytes = 0;
+  gint64 start = g_get_monotonic_time();
+  gboolean res = FALSE;
+  int fd;
+  int r;
+
+  g_return_val_if_fail(archive, FALSE);
+  g_return_val_if_fail(rw, FALSE);
+  g_return_val_if_fail(rw->relocate_from == NULL || rw->relocate_to != NULL, FALSE);
+  g_return_val_if_fail(rw->append == NULL || rw->append_root != NULL, FALSE);
+  g_return_val_if_fail(rw->subtree == NULL || rw->subtree_fd >= 0, FALSE);
+  g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+  in = open_archive(archive, &sproc, &fd, error);
+  if (in == NULL)
+    return FALSE;
+
+  if ((out = open_tar_stream(out_fd, error)) == NULL)
+    goto out;
+  if (rw->subtree && (sub = open_tar_stream(rw->subtree_fd, error)) == NULL)
+    goto out;
+
+  buf = g_malloc(TAR_WRITE_BLOCK_SIZE);
+
+  while ((r = archive_read_next_header(in, &entry)) != ARCHIVE_EOF)
+    {
+      g_autofree gchar *path = NULL;
+      g_autofree gchar *link = NULL;
+      const gchar *sub_path = NULL;
+      GByteArray *captured = NULL;
+
+      if (r < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to read '%s': %s", archive, archive_error_string(in));
+	  goto out;
+	}
+
+      path = relative_path(archive_entry_pathname(entry), rw->relocate_from,
+			   rw->relocate_to);
+      if (path == NULL)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Entry '%s' leaves the archive root",
+		      archive_entry_pathname(entry));
+	  goto out;
+	}
+      if (is_excluded(path, rw->exclude))
+	{
+	  dropped++;
+	  continue;
+	}
+      archive_entry_copy_pathname(entry, path[0] ? path : ".");
+      if (archive_entry_hardlink(entry))
+	{
+	  link = relative_path(archive_entry_hardlink(entry), rw->relocate_from,
+			       rw->relocate_to);
+	  if (link == NULL)
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+			  "Hard link '%s' leaves the archive root",
+			  archive_entry_hardlink(entry));
+	      goto out;
+	    }
+	  archive_entry_copy_hardlink(entry, link);
+	}
+
+      if (archive_write_header(out, entry) < ARCHIVE_WARN)
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Failed to write '%s' to tar stream: %s", path,
+		      archive_error_string(out));
+	  goto out;
+	}
+
+      if (sub && (sub_path = subtree_path(path, rw->subtree)) != NULL)
+	{
+	  archive_entry_copy_pathname(entry, sub_path);
+	  if (link)
+	    {
+	      const gchar *sub_link = subtree_path(link, rw->subtree);
+
+	      if (sub_link == NULL)
+		{
+		  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+			      "Hard link '%s' to '%s' leaves '%s'", path,
+			      link, rw->subtree);
+		  goto out;
+		}
+	      archive_entry_copy_hardlink(entry, sub_link);
+	    }
+	  if (archive_write_header(sub, entry) < ARCHIVE_WARN)
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			  "Failed to write '%s' to tar stream: %s", path,
+			  archive_error_string(sub));
+	      goto out;
+	    }
+	}
+
+      if (rw->capture && strcmp(path, rw->capture) == 0 &&
+	  archive_entry_filetype(entry) == AE_IFREG)
+	captured = g_byte_array_new();
+
+      for (;;)
+	{
+	  la_ssize_t n = archive_read_data(in, buf, TAR_WRITE_BLOCK_SIZE);
+
+	  if (n == 0)
+	    break;
+	  if (n < 0)
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			  "Failed to read '%s': %s", archive,
+			  archive_error_string(in));
+	      if (captured)
+		g_byte_array_unref(captured);
+	      goto out;
+	    }
+	  if (archive_write_data(out, buf, n) != n ||
+	      (sub_path && archive_write_data(sub, buf, n) != n))
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			  "Failed to write tar stream: %s",
+			  archive_error_string(sub_path ? sub : out));
+	      if (captured)
+		g_byte_array_unref(captured);
+	      goto out;
+	    }
+	  if (captured)
+	    g_byte_array_append(captured, buf, n);
+	  bytes += n;
+	}
+
+      if (captured)
+	{
+	  g_clear_pointer(&rw->captured, g_bytes_unref);
+	  rw->captured = g_byte_array_free_to_bytes(captured);
+	}
+      entries++;
+    }
+
+  for (guint i = 0; rw->append && rw->append[i]; i++, entries++)
+    {
+      const gchar *sub_path = sub ? subtree_path(rw->append[i], rw->subtree) : NULL;
+      guint64 sub_bytes = 0;
+
+      if (!append_file(out, rw->append_root, rw->append[i], rw->append[i],
+		       buf, &bytes, error))
+	goto out;
+      if (sub_path &&
+	  !append_file(sub, rw->append_root, rw->append[i], sub_path, buf,
+		       &sub_bytes, error))
+	goto out;
+    }
+
+  if (!close_tar_stream(out, error) ||
+      (sub && !close_tar_stream(sub, error)))
+    goto out;
+
+  res = TRUE;
+
+ out:
+  if (sub)
+    archive_write_free(sub);
+  if (out)
+    archive_write_free(out);
+  res = close_archive(in, sproc, fd, archive, res, error);
+
+  if (res && verbose_flag)
+    {
+      gdouble secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      g_printf("Streamed %" G_GUINT64_FORMAT " entries (%" G_GUINT64_FORMAT " left out), %" G_GUINT64_FORMAT " bytes in %.1f seconds (%.1f MiB/s)\n",
+	       entries, dropped, bytes, secs, secs > 0 ? bytes / secs / (1024*1024) : 0.0);
+    }
+
+  return res;
+}
@@ -1,53 +1,17 @@
 
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
-#include <openssl/evp.h>
 
 #include "tiu.h"
 #include "tiu-internal.h"
+#include "tiu-cache.h"
 #include "network.h"
 
-/*
-  Checking SHA256SUM of the archive.
-*/
-static gboolean
-check_sha256sum(const gchar *filename, const gchar *sha256sum)
-{
-  EVP_MD_CTX *mdctx;
-  const EVP_MD *md;
-  unsigned char md_value[EVP_MAX_MD_SIZE];
-  unsigned int md_len, i;
-  int bytes;
-  unsigned char data[1024];
-  char *filesha256 = (char*) malloc(33 *sizeof(char));
-
-  FILE *inFile = fopen (filename, "rb");
-  if (inFile == NULL)
-    return FALSE;
-
-  md = EVP_get_digestbyname("sha256");
-  mdctx = EVP_MD_CTX_create();
-  EVP_DigestInit_ex (mdctx, md, NULL);
-
-  while ((bytes = fread (data, 1, 1024, inFile)) != 0) {
-    EVP_DigestUpdate (mdctx, data, bytes);
-  }
-
-  EVP_DigestFinal_ex (mdctx, md_value, &md_len);
-  EVP_MD_CTX_destroy(mdctx);
-
-  for(i = 0; i < md_len; i++) {
-    sprintf(&filesha256[i*2], "%02x", md_value[i]);
-  }
-  fclose (inFile);
-  return (strcmp(filesha256, sha256sum) == 0);
-}
-
 gboolean
 download_archive (const gchar *archive, const gchar *archive_sha256sum,
 		  gchar **location, GError **error)
 {
-  const gchar *cachedir = "/var/cache/tiu";
+  const gchar *cachedir = TIU_CACHE_DIR;
   GError *ierror = NULL;
   gchar *tiuscheme = g_uri_parse_scheme(archive);
 
@@ -80,7 +44,7 @@ download_archive (const gchar *archive, const gchar *archive_sha256sum,
       if (archive_sha256sum)
 	{
 	  /*Checking if file has already been downloaded */
-	  if (check_sha256sum(*location, archive_sha256sum))
+	  if (cache_check_sha256sum(*location, archive_sha256sum))
           {
             g_printf("swu archive '%s' has already been downloaded...\n",
 		     archive);
@@ -105,9 +69,10 @@ download_archive (const gchar *archive, const gchar *archive_sha256sum,
           return FALSE;
         }
 
-      /* Make sure the file does not exist in the cache */
-      g_remove (*location);
-      if (!download_file(*location, archive,
+      /* download_file() replaces an outdated archive in the cache
+	 only after the new one is complete and, if archive_sha256sum
+	 is set, verified. */
+      if (!download_file(*location, archive, archive_sha256sum,
                          DEFAULT_MAX_DOWNLOAD_SIZE, &ierror))
         {
           g_propagate_prefixed_error(error, ierror,
@@ -115,6 +80,14 @@ download_archive (const gchar *archive, const gchar *archive_sha256sum,
 				     archive);
           return FALSE;
         }
+      if (archive_sha256sum &&
+	  !cache_add_sha256sum(*location, archive_sha256sum, &ierror))
+	{
+	  /* not fatal, the next run has to hash the archive again */
+	  if (debug_flag)
+	    g_printf("Cannot update cache index: %s\n", ierror->message);
+	  g_clear_error(&ierror);
+	}
       if (!quiet_flag)
         g_printf("Downloaded tiu archive to '%s'\n", *location);
     }
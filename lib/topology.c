@@ -0,0 +1,355 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+#include <glib/gprintf.h>
+
+#include "tiu-internal.h"
+#include "tiu-topology.h"
+
+#define SYS_BLOCK "/sys/class/block"
+
+static void
+slot_free (gpointer data)
+{
+  TIUSlot *slot = data;
+
+  if (slot == NULL)
+    return;
+
+  g_free(slot->label);
+  g_free(slot->name);
+  g_free(slot->device);
+  g_free(slot->disk);
+  g_free(slot);
+}
+
+/* Value of @key in the uevent file of a block device */
+static gchar *
+uevent_get (const gchar *uevent, const gchar *key)
+{
+  gsize len = strlen(key);
+  const gchar *p = uevent;
+
+  while (*p)
+    {
+      const gchar *end = strchrnul(p, '\n');
+
+      if (strncmp(p, key, len) == 0 && p[len] == '=')
+	return g_strndup(p + len + 1, end - p - len - 1);
+      p = *end ? end + 1 : end;
+    }
+
+  return NULL;
+}
+
+/* Device node of @devno as named by the kernel */
+static gchar *
+device_name (dev_t devno)
+{
+  g_autofree gchar *path = g_strdup_printf("/sys/dev/block/%u:%u/uevent",
+					   major(devno), minor(devno));
+  g_autofree gchar *uevent = NULL;
+  g_autofree gchar *devname = NULL;
+
+  if (g_file_get_contents(path, &uevent, NULL, NULL) &&
+      (devname = uevent_get(uevent, "DEVNAME")) != NULL)
+    return g_strconcat("/dev/", devname, NULL);
+
+  return g_strdup_printf("/dev/block/%u:%u", major(devno), minor(devno));
+}
+
+/* Device number of the filesystem mounted on @mountpoint */
+static gboolean
+mounted_devno (const gchar *mountpoint, dev_t *devno, GError **error)
+{
+  g_autofree gchar *content = NULL;
+  g_auto(GStrv) lines = NULL;
+  GError *ierror = NULL;
+
+  if (!g_file_get_contents("/proc/self/mountinfo", &content, NULL, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror, "Failed to read mounts: ");
+      return FALSE;
+    }
+
+  /* "36 35 98:0 / /usr rw,noatime master:1 - ext4 /dev/vda3 rw",
+     the last entry for a mount point is the visible one */
+  lines = g_strsplit(content, "\n", -1);
+  for (gint i = g_strv_length(lines) - 1; i >= 0; i--)
+    {
+      unsigned int major, minor;
+      char mnt[256];
+
+      if (sscanf(lines[i], "%*u %*u %u:%u %*s %255s", &major, &minor, mnt) == 3 &&
+	  strcmp(mnt, mountpoint) == 0)
+	{
+	  *devno = makedev(major, minor);
+	  return TRUE;
+	}
+    }
+
+  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+	      "Cannot find the partition mounted on %s", mountpoint);
+  return FALSE;
+}
+
+/* A dm-verity or dm-linear device on top of a single partition is
+   resolved to the partition. */
+static dev_t
+resolve_slaves (dev_t devno)
+{
+  for (guint depth = 0; depth < 8; depth++)
+    {
+      g_autofree gchar *dir = g_strdup_printf("/sys/dev/block/%u:%u/slaves",
+					      major(devno), minor(devno));
+      g_autofree gchar *slave = NULL;
+      g_autofree gchar *dev = NULL;
+      g_autofree gchar *path = NULL;
+      unsigned int maj, min;
+      const gchar *name;
+      GDir *d;
+
+      d = g_dir_open(dir, 0, NULL);
+      if (d == NULL)
+	break;
+      while ((name = g_dir_read_name(d)))
+	{
+	  /* verity with the hash tree on another device, don't guess */
+	  if (slave && strcmp(slave, name) != 0)
+	    {
+	      g_clear_pointer(&slave, g_free);
+	      break;
+	    }
+	  slave = g_strdup(name);
+	}
+      g_dir_close(d);
+      if (slave == NULL)
+	break;
+
+      path = g_build_filename(SYS_BLOCK, slave, "dev", NULL);
+      if (!g_file_get_contents(path, &dev, NULL, NULL) ||
+	  sscanf(dev, "%u:%u", &maj, &min) != 2)
+	break;
+      devno = makedev(maj, min);
+    }
+
+  return devno;
+}
+
+/* Shorter names first, so A ... Z are followed by AA */
+static gint
+compare_slots (gconstpointer a, gconstpointer b)
+{
+  const TIUSlot *sa = *(TIUSlot * const *)a;
+  const TIUSlot *sb = *(TIUSlot * const *)b;
+  gsize la = strlen(sa->name), lb = strlen(sb->name);
+
+  if (la != lb)
+    return la < lb ? -1 : 1;
+  return strcmp(sa->name, sb->name);
+}
+
+/* All partitions with a slot label */
+static GPtrArray *
+read_slots (GError **error)
+{
+  GPtrArray *slots = g_ptr_array_new_with_free_func(slot_free);
+  GError *ierror = NULL;
+  const gchar *name;
+  GDir *d;
+
+  d = g_dir_open(SYS_BLOCK, 0, &ierror);
+  if (d == NULL)
+    {
+      g_propagate_prefixed_error(error, ierror, "Failed to list block devices: ");
+      g_ptr_array_free(slots, TRUE);
+      return NULL;
+    }
+
+  while ((name = g_dir_read_name(d)))
+    {
+      g_autofree gchar *path = g_build_filename(SYS_BLOCK, name, "uevent", NULL);
+      g_autofree gchar *uevent = NULL;
+      g_autofree gchar *partname = NULL;
+      g_autofree gchar *major = NULL, *minor = NULL, *devname = NULL;
+      g_autofree gchar *link = NULL;
+      TIUSlot *slot;
+
+      if (!g_file_get_contents(path, &uevent, NULL, NULL))
+	continue;
+      partname = uevent_get(uevent, "PARTNAME");
+      if (partname == NULL || !g_str_has_prefix(partname, SLOT_LABEL_PREFIX) ||
+	  partname[strlen(SLOT_LABEL_PREFIX)] == '\0')
+	continue;
+      major = uevent_get(uevent, "MAJOR");
+      minor = uevent_get(uevent, "MINOR");
+      devname = uevent_get(uevent, "DEVNAME");
+      if (major == NULL || minor == NULL || devname == NULL)
+	continue;
+
+      slot = g_new0(TIUSlot, 1);
+      slot->label = g_steal_pointer(&partname);
+      slot->name = g_strdup(slot->label + strlen(SLOT_LABEL_PREFIX));
+      slot->device = g_strconcat("/dev/", devname, NULL);
+      slot->devno = makedev(strtoul(major, NULL, 10), strtoul(minor, NULL, 10));
+      /* ../../devices/pci0000:00/.../block/vda/vda3 */
+      g_free(path);
+      path = g_build_filename(SYS_BLOCK, name, NULL);
+      link = g_file_read_link(path, NULL);
+      if (link)
+	{
+	  g_autofree gchar *parent = g_path_get_dirname(link);
+	  slot->disk = g_path_get_basename(parent);
+	}
+      g_ptr_array_add(slots, slot);
+    }
+  g_dir_close(d);
+
+  return slots;
+}
+
+/*
+  Find the slots and which of them is in use. Only the slots on the
+  disk of the running /usr are taken into account, a second disk
+  (e.g. an USB stick with an installation image) may have the same
+  labels.
+*/
+TIUTopology *
+topology_new (GError **error)
+{
+  TIUTopology *topo;
+  GPtrArray *all;
+  dev_t usr_devno, part_devno;
+  gint64 start = g_get_monotonic_time();
+  GError *ierror = NULL;
+
+  g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+  if (!mounted_devno("/usr", &usr_devno, &ierror))
+    {
+      g_propagate_error(error, ierror);
+      return NULL;
+    }
+  part_devno = resolve_slaves(usr_devno);
+
+  all = read_slots(&ierror);
+  if (all == NULL)
+    {
+      g_propagate_error(error, ierror);
+      return NULL;
+    }
+
+  topo = g_new0(TIUTopology, 1);
+  topo->slots = g_ptr_array_new_with_free_func(slot_free);
+  topo->usr_device = device_name(usr_devno);
+
+  for (guint i = 0; i < all->len; i++)
+    {
+      TIUSlot *slot = g_ptr_array_index(all, i);
+
+      if (slot->devno == part_devno)
+	topo->current = slot;
+    }
+  for (guint i = 0; i < all->len; i++)
+    {
+      TIUSlot *slot = g_ptr_array_index(all, i);
+
+      if (topo->current == NULL ||
+	  g_strcmp0(slot->disk, topo->current->disk) == 0)
+	{
+	  g_ptr_array_add(topo->slots, slot);
+	  all->pdata[i] = NULL;
+	}
+    }
+  g_ptr_array_free(all, TRUE);
+
+  g_ptr_array_sort(topo->slots, compare_slots);
+  for (guint i = 0; i < topo->slots->len; i++)
+    ((TIUSlot *)g_ptr_array_index(topo->slots, i))->index = i;
+
+  if (topo->current == NULL)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+		  "The partition mounted on /usr (%u:%u) has no %s* label",
+		  major(part_devno), minor(part_devno), SLOT_LABEL_PREFIX);
+      topology_free(topo);
+      return NULL;
+    }
+
+  if (debug_flag)
+    {
+      g_printf("Found current partition label for /usr: %s (%s)\n",
+	       topo->current->label, topo->current->device);
+      for (guint i = 0; i < topo->slots->len; i++)
+	{
+	  TIUSlot *slot = g_ptr_array_index(topo->slots, i);
+	  g_printf("  slot %u: %s on %s\n", slot->index, slot->label,
+		   slot->device);
+	}
+      g_printf("Reading the partition layout took %" G_GINT64_FORMAT " us\n",
+	       g_get_monotonic_time() - start);
+    }
+
+  return topo;
+}
+
+void
+topology_free (TIUTopology *topo)
+{
+  if (topo == NULL)
+    return;
+
+  g_ptr_array_free(topo->slots, TRUE);
+  g_free(topo->usr_device);
+  g_free(topo);
+}
+
+TIUSlot *
+topology_find (TIUTopology *topo, const gchar *label)
+{
+  for (guint i = 0; i < topo->slots->len; i++)
+    {
+      TIUSlot *slot = g_ptr_array_index(topo->slots, i);
+
+      if (strcmp(slot->label, label) == 0)
+	return slot;
+    }
+
+  return NULL;
+}
+
+/* The slot after the current one, the last one is followed by the
+   first one again. */
+TIUSlot *
+topology_next (TIUTopology *topo, GError **error)
+{
+  guint n = topo->slots->len;
+
+  if (n < 2)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "No free partition found!");
+      return NULL;
+    }
+
+  return g_ptr_array_index(topo->slots, (topo->current->index + 1) % n);
+}
@@ -16,60 +16,32 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <mntent.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 #include <libeconf.h>
 
 #include "tiu.h"
 #include "tiu-internal.h"
 #include "tiu-swupdate.h"
 #include "tiu-mount.h"
+#include "tiu-bootentry.h"
+#include "tiu-chunk.h"
+#include "tiu-delta.h"
+#include "tiu-grubenv.h"
+#include "tiu-kernel.h"
+#include "tiu-topology.h"
 
 static gboolean
-update_kernel (gchar *chroot, gchar *partition, GError **error)
+update_kernel (gchar *chroot, const TIUSlot *slot, GError **error)
 {
-  g_autoptr (GSubprocess) sproc = NULL;
-  GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, NULL);
-  gboolean retval = TRUE;
-
   if (debug_flag)
-    g_printf("Updating kernel in %s/boot/%s...\n", chroot?chroot:"", partition);
-
-
-  if (chroot)
-    {
-      g_ptr_array_add(args, "chroot");
-      g_ptr_array_add(args, chroot);
-    }
-  g_ptr_array_add(args, "/usr/libexec/tiu/update-kernel");
-  g_ptr_array_add(args, &partition[4]);
-  g_ptr_array_add(args, NULL);
-
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
-    {
-      g_propagate_prefixed_error(error, ierror,
-				 "Failed to start update-kernel sub-process: ");
-      retval = FALSE;
-      goto cleanup;
-    }
+    g_printf("Updating kernel in %s/boot/%s...\n", chroot?chroot:"", slot->name);
 
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
-    {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute update-kernel sub-process: ");
-      retval = FALSE;
-    }
-
- cleanup:
-  g_ptr_array_free (args, TRUE);
-
-  return retval;
+  return stage_kernels (chroot, slot->name, error);
 }
 
 #if 0
@@ -120,230 +92,60 @@ update_bootloader (gchar *chroot, GError **error)
 static gboolean
 set_default_partition (gint menuentry_id, GError **error)
 {
-  g_autoptr (GSubprocess) sproc = NULL;
+  g_autofree gchar *entry = g_strdup_printf("%i", menuentry_id);
   GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, NULL);
-  gboolean retval = TRUE;
-  gchar *entry = NULL;
+  TIUGrubenv *env;
+  gboolean retval;
 
   if (debug_flag)
     g_printf("Updating default boot entry to %i...\n", menuentry_id);
 
-  if (asprintf (&entry, "saved_entry=%i", menuentry_id) < 0)
+  if ((env = grubenv_read (GRUBENV_FILE, &ierror)) == NULL)
     {
-      /* XXX set usefull out of memory error message */
+      g_propagate_error(error, ierror);
       return FALSE;
     }
 
-  g_ptr_array_add(args, "/usr/bin/grub2-editenv");
-  g_ptr_array_add(args, "-");
-  g_ptr_array_add(args, "set");
-  g_ptr_array_add(args, entry);
-  g_ptr_array_add(args, NULL);
-
-  sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
-    {
-      g_propagate_prefixed_error(error, ierror,
-				 "Failed to start grub2-editenv: ");
-      retval = FALSE;
-      goto cleanup;
-    }
-
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
-    {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute grub2-editenv: ");
-      retval = FALSE;
-    }
-
- cleanup:
-  g_ptr_array_free (args, TRUE);
-
-  return retval;
-}
-
-/* XXX find a more robust way for this */
-static gchar *
-map_dev_to_partlabel (gchar *device, GError **error)
-{
-  gchar *retval = NULL;
-  g_autoptr (GSubprocess) sproc = NULL;
-  GError *ierror = NULL;
-  GPtrArray *args = g_ptr_array_new_full(8, NULL);
-
-  if (debug_flag)
-    g_printf("Get partition label for '/dev%s'...\n", device);
-
-  gchar *sharg = g_strjoin (NULL, "/bin/ls -l /dev/disk/by-partlabel/ |grep ",
-			    device, "$ |sed -e 's|.*\\(USR_[A-Z]\\).*|\\1|g'", NULL);
-
-  g_ptr_array_add(args, "/bin/sh");
-  g_ptr_array_add(args, "-c");
-  g_ptr_array_add(args, sharg);
-  g_ptr_array_add(args, NULL);
-
-    sproc = g_subprocess_newv((const gchar * const *)args->pdata,
-                            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
-  if (sproc == NULL)
-    {
-      g_propagate_prefixed_error(error, ierror, "Failed to start getting partition label: ");
-      goto cleanup;
-    }
-
-  if (!g_subprocess_wait_check(sproc, NULL, &ierror))
-    {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to execute getting partition label: ");
-      goto cleanup;
-    }
-
-  gchar *stdout;
-  gchar *stderr;
-  if (!g_subprocess_communicate_utf8 (sproc, NULL, NULL, &stdout, &stderr, &ierror))
-    {
-      g_propagate_prefixed_error(error, ierror,
-                                 "Failed to read stdout to get partition label: ");
-      goto cleanup;
-
-    }
-
-  if (stdout)
-    {
-      /* Remove trailing "\n" from output */
-      int len = strlen(stdout);
-      if (stdout[len - 1] == '\n')
-        stdout[len - 1] = '\0';
-      retval = g_strdup(stdout);
-    }
-  else
-    {
-      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(EPIPE),
-                  "Failed to read stdout to get partition label:");
-      retval = FALSE;
-      goto cleanup;
-    }
-
- cleanup:
-  g_ptr_array_free (args, TRUE);
-  if (sharg)
-    free (sharg);
+  grubenv_set (env, "saved_entry", entry);
+  if (!(retval = grubenv_write (env, &ierror)))
+    g_propagate_prefixed_error(error, ierror,
+			       "Failed to set default boot entry: ");
+  grubenv_free (env);
 
   return retval;
 }
 
-static gchar *
-get_next_partition (GError **error)
+static TIUSlot *
+internal_update_system_pre (TIUTopology *topo, GError **error)
 {
-  struct mntent *ent;
-  FILE *f;
-  GError *ierror = NULL;
-  char *curr_dev = NULL;
-
-  f = setmntent ("/proc/mounts", "r");
-  if (f == NULL)
-    {
-      int err = errno;
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno(err),
-		   "Failed to open /proc/mounts: %s", g_strerror(err));
-      return FALSE;
-    }
-
-  while (NULL != (ent = getmntent (f)))
-    {
-      if (strcmp (ent->mnt_dir, "/usr") == 0)
-	{
-	  curr_dev = map_dev_to_partlabel (&(ent->mnt_fsname)[4], &ierror);
-	  if (curr_dev == NULL)
-	    {
-	      g_propagate_error(error, ierror);
-	      return NULL;
-	    }
-	  break;
-	}
-    }
-
-  endmntent(f);
-
-  if (curr_dev == NULL)
-    {
-      /* XXX set error that we haven't found the device */
-      return NULL;
-    }
-
-  if (debug_flag)
-    printf ("Found current partition label for /usr: %s\n", curr_dev);
-
-
-  gchar *next_dev = g_strdup (curr_dev);
-
-  /* USR_A -> USR_B, ... */
-  next_dev[strlen(next_dev)-1]++;
-
-  gchar *test_dev = g_strjoin("/", "/dev/disk/by-partlabel", next_dev, NULL);
-
-  if (g_file_test(test_dev, G_FILE_TEST_EXISTS))
-    {
-      free (test_dev);
-    }
-  else
-    {
-      /* so next partition does not exist, so start by USR_A again */
-      next_dev[strlen(next_dev)-1] = 'A';
+  TIUSlot *next;
 
-      if (strcmp (curr_dev, next_dev) == 0)
-	{
-	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-		      "No free partition found!");
-	  free (curr_dev);
-	  free (next_dev);
-	  return NULL;
-	}
-    }
-
-  free (curr_dev);
-  return next_dev;
-}
-
-static gchar *
-internal_update_system_pre (GError **error)
-{
-  GError *ierror = NULL;
-  gchar *next_partlabel = NULL;
-  gchar *retval = NULL;
+  if ((next = topology_next (topo, error)) == NULL)
+    return NULL;
 
-  if ((next_partlabel = get_next_partition(&ierror)) == NULL)
-    {
-      if (ierror != NULL)
-	g_propagate_error(error, ierror);
-      return NULL;
-    }
+  /* the content of the slot gets replaced, its index is wrong now */
+  gchar *slot_index = g_strdup_printf ("%s/%s.tiuidx", TIU_SLOT_INDEX_DIR,
+				       next->label);
+  g_remove (slot_index);
+  g_free (slot_index);
 
   /* we have at minimum two partitions A/B to switch between.
      /dev/update-image-usr should be a symlink to the next free partition. */
   remove("/dev/update-image-usr");
-  gchar *device = g_strjoin("/", "/dev/disk/by-partlabel", next_partlabel, NULL);
-  if (symlink (device, "/dev/update-image-usr"))
+  if (symlink (next->device, "/dev/update-image-usr"))
     {
       int err = errno;
       g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
                   "failed to create symlink: %s", g_strerror(err));
-
-      retval = NULL;
+      return NULL;
     }
-  else
-    retval = g_strdup (next_partlabel);
 
-  free (device);
-  if (next_partlabel)
-    free (next_partlabel);
-
-  return retval;
+  return next;
 }
 
 static gboolean
-internal_update_system_post (gchar *next_partlabel, GError **error)
+internal_update_system_post (TIUTopology *topo, const TIUSlot *next,
+			     GError **error)
 {
   gboolean retval = TRUE;
   GError *ierror = NULL;
@@ -363,7 +165,14 @@ internal_update_system_post (gchar *next_partlabel, GError **error)
         }
     }
 
-  if (!update_kernel (NULL, next_partlabel, &ierror))
+  if (!update_kernel (NULL, next, &ierror))
+    {
+      g_propagate_error(error, ierror);
+      retval = FALSE;
+      goto cleanup;
+    }
+
+  if (!write_boot_entries (NULL, topo, next, &ierror))
     {
       g_propagate_error(error, ierror);
       retval = FALSE;
@@ -379,8 +188,7 @@ internal_update_system_post (gchar *next_partlabel, GError **error)
     }
 #endif
 
-  gint menuentry_id = next_partlabel[4] - 'A';
-  if (!set_default_partition (menuentry_id, &ierror))
+  if (!set_default_partition (next->index, &ierror))
     {
       g_propagate_error(error, ierror);
       retval = FALSE;
@@ -408,41 +216,118 @@ internal_update_system_post (gchar *next_partlabel, GError **error)
 gboolean
 update_system_pre (GError **error)
 {
-  GError *ierror = NULL;
+  TIUTopology *topo;
+  gboolean retval;
 
-  if (internal_update_system_pre (&ierror) == NULL)
-    {
-      g_propagate_error (error, ierror);
-      return FALSE;
-    }
+  if ((topo = topology_new (error)) == NULL)
+    return FALSE;
+
+  retval = (internal_update_system_pre (topo, error) != NULL);
+  topology_free (topo);
 
-  return TRUE;
+  return retval;
 }
 
 gboolean
 update_system_post (GError **error)
 {
+  TIUTopology *topo;
+  TIUSlot *next;
+  gboolean retval = FALSE;
+
+  if ((topo = topology_new (error)) == NULL)
+    return FALSE;
+
+  if ((next = topology_next (topo, error)) != NULL)
+    retval = internal_update_system_post (topo, next, error);
+  topology_free (topo);
+
+  return retval;
+}
+
+/*
+  Update with a chunk index or a delta archive instead of a swu
+  archive. Both use the running /usr partition as source of most of
+  the data, the image is assembled and written by tiu itself.
+  The image of a swu archive is written by tiu as well if unchanged
+  blocks should be skipped, swupdate only verifies the archive then.
+*/
+static gboolean
+update_system_direct (const gchar *archive, const gchar *archive_sha256sum,
+		      GError **error)
+{
+  gboolean chunked = g_str_has_suffix (archive, ".tiuidx");
+  gboolean delta = g_str_has_suffix (archive, ".tiudelta");
   GError *ierror = NULL;
-  gchar *next_partlabel = NULL;
+  TIUTopology *topo = NULL;
+  TIUSlot *next;
+  g_autofree gchar *seed_index = NULL;
+  g_autofree gchar *slot_index = NULL;
+  gboolean res = FALSE;
 
-  if ((next_partlabel = get_next_partition(&ierror)) == NULL)
+  if (chunked && chunk_store_url == NULL)
     {
-      if (ierror != NULL)
-	g_propagate_error(error, ierror);
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "No chunk store configured for '%s'", archive);
       return FALSE;
     }
 
-  if (!internal_update_system_post (next_partlabel, &ierror))
+  if ((topo = topology_new (error)) == NULL)
+    return FALSE;
+
+  if ((next = internal_update_system_pre (topo, error)) == NULL)
+    goto out;
+
+  if (verbose_flag)
+    g_printf ("Write new image to partition '%s'\n", next->label);
+
+  seed_index = g_strdup_printf ("%s/%s.tiuidx", TIU_SLOT_INDEX_DIR,
+				topo->current->label);
+  slot_index = g_strdup_printf ("%s/%s.tiuidx", TIU_SLOT_INDEX_DIR, next->label);
+
+  if (chunked)
+    res = chunk_update (archive, chunk_store_url, topo->usr_device, seed_index,
+			"/dev/update-image-usr", &ierror);
+  else if (delta)
+    res = delta_apply (archive, topo->usr_device, seed_index,
+		       "/dev/update-image-usr", &ierror);
+  else
+    res = swupdate_deploy (archive, archive_sha256sum,
+			   "/dev/update-image-usr", &ierror);
+  if (!res)
     {
       g_propagate_error (error, ierror);
-      return FALSE;
+      remove ("/dev/update-image-usr");
+      goto out;
     }
 
-  return TRUE;
+  /* Remember what is in the slot, the next update can use it
+     without reading the whole partition. */
+  if (chunked)
+    {
+      g_autoptr(GFile) src = g_file_new_for_path (archive);
+      g_autoptr(GFile) dst = g_file_new_for_path (slot_index);
+
+      if (g_mkdir_with_parents (TIU_SLOT_INDEX_DIR, 0700) != 0 ||
+	  !g_file_copy (src, dst, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &ierror))
+	{
+	  if (debug_flag)
+	    g_printf ("Cannot save index of '%s': %s\n", next->label,
+		      ierror ? ierror->message : g_strerror (errno));
+	  g_clear_error (&ierror);
+	}
+    }
+
+  res = internal_update_system_post (topo, next, error);
+
+ out:
+  topology_free (topo);
+  return res;
 }
 
 gboolean
-update_system (const gchar *archive, GError **error)
+update_system (const gchar *archive, const gchar *archive_sha256sum,
+	       GError **error)
 {
   gboolean retval = TRUE;
   GError *ierror = NULL;
@@ -451,6 +336,11 @@ update_system (const gchar *archive, GError **error)
   if (!quiet_flag)
     g_printf("Update /usr...\n");
 
+  /* swupdate's raw handler always writes the whole image */
+  if (g_str_has_suffix (archive, ".tiuidx") ||
+      g_str_has_suffix (archive, ".tiudelta") || skip_unchanged_blocks)
+    return update_system_direct (archive, archive_sha256sum, error);
+
 #if 0
   if ((next_partlabel = internal_update_system_pre (&ierror)) == NULL)
     {
@@ -466,7 +356,7 @@ update_system (const gchar *archive, GError **error)
   if (debug_flag)
     g_printf("Calling swupdate...\n");
 
-  if (!swupdate_deploy (archive, &ierror))
+  if (!swupdate_deploy (archive, archive_sha256sum, NULL, &ierror))
     {
       g_propagate_error(error, ierror);
       retval = FALSE;
@@ -0,0 +1,246 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <gio/gio.h>
+
+#include "tiu-uring.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+struct _TIUUring {
+  int fd;
+  guint depth;
+  guint in_flight;
+  /* submission queue */
+  void *sq_ring;
+  gsize sq_ring_size;
+  guint *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  gsize sqes_size;
+  /* completion queue, shares the mapping with the SQ on newer kernels */
+  void *cq_ring;
+  gsize cq_ring_size;
+  guint *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* IORING_OP_WRITEV works since 5.1, IORING_OP_WRITE only since 5.6 */
+  struct iovec *iov;
+};
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+TIUUring *
+uring_new (guint depth, GError **error)
+{
+  struct io_uring_params p;
+  TIUUring *u;
+  int fd;
+
+  g_return_val_if_fail(depth > 0, NULL);
+  g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+  memset(&p, 0, sizeof(p));
+  fd = sys_io_uring_setup(depth, &p);
+  if (fd < 0)
+    {
+      int err = errno;
+
+      /* ENOSYS: too old, EPERM: disabled by kernel.io_uring_disabled
+	 or a seccomp filter */
+      g_set_error(error, G_IO_ERROR,
+		  (err == ENOSYS || err == EPERM) ? G_IO_ERROR_NOT_SUPPORTED :
+		  g_io_error_from_errno(err),
+		  "io_uring is not available: %s", g_strerror(err));
+      return NULL;
+    }
+
+  u = g_new0(TIUUring, 1);
+  u->fd = fd;
+  u->depth = p.sq_entries;
+  u->sq_ring = u->cq_ring = MAP_FAILED;
+  u->sqes = MAP_FAILED;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(guint);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->sq_ring_size = u->cq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cq_ring = u->sq_ring;
+  else
+    {
+      u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (u->cq_ring == MAP_FAILED)
+	goto fail;
+    }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail;
+
+  /* the kernel aligns the offsets for the fields */
+  u->sq_head = u->sq_ring + p.sq_off.head;
+  u->sq_tail = u->sq_ring + p.sq_off.tail;
+  u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+  u->sq_array = u->sq_ring + p.sq_off.array;
+  u->cq_head = u->cq_ring + p.cq_off.head;
+  u->cq_tail = u->cq_ring + p.cq_off.tail;
+  u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+  u->cqes = u->cq_ring + p.cq_off.cqes;
+  u->iov = g_new0(struct iovec, p.sq_entries);
+
+  return u;
+
+ fail:
+  {
+    int err = errno;
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+		"Failed to map the io_uring: %s", g_strerror(err));
+    uring_free(u);
+    return NULL;
+  }
+}
+
+void
+uring_free (TIUUring *u)
+{
+  if (u == NULL)
+    return;
+
+  if (u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+  g_free(u->iov);
+  g_free(u);
+}
+
+gboolean
+uring_write (TIUUring *u, int fd, void *buf, gsize len, off_t offset,
+	     guint64 user_data, GError **error)
+{
+  struct io_uring_sqe *sqe;
+  guint tail, index;
+  int r;
+
+  g_return_val_if_fail(u, FALSE);
+  g_return_val_if_fail(u->in_flight < u->depth, FALSE);
+
+  /* the kernel consumes every entry in io_uring_enter() */
+  tail = *u->sq_tail;
+  index = tail & *u->sq_mask;
+  sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->iov[index].iov_base = buf;
+  u->iov[index].iov_len = len;
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (guint64)(uintptr_t)&u->iov[index];
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do
+    r = sys_io_uring_enter(u->fd, 1, 0, 0);
+  while (r < 0 && errno == EINTR);
+  if (r < 0)
+    {
+      int err = errno;
+
+      /* take the entry back, it was not consumed */
+      __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+		  "Failed to submit write: %s", g_strerror(err));
+      return FALSE;
+    }
+
+  u->in_flight++;
+  return TRUE;
+}
+
+gboolean
+uring_wait (TIUUring *u, guint64 *user_data, gint *result, GError **error)
+{
+  g_return_val_if_fail(u, FALSE);
+  g_return_val_if_fail(u->in_flight > 0, FALSE);
+
+  for (;;)
+    {
+      guint head = *u->cq_head;
+
+      if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+	  *user_data = cqe->user_data;
+	  *result = cqe->res;
+	  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	  u->in_flight--;
+	  return TRUE;
+	}
+
+      if (sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+	  errno != EINTR)
+	{
+	  int err = errno;
+
+	  g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+		      "Failed to wait for write: %s", g_strerror(err));
+	  return FALSE;
+	}
+    }
+}
+
+guint
+uring_in_flight (TIUUring *u)
+{
+  return u->in_flight;
+}
@@ -3,3 +3,9 @@
 gboolean debug_flag = FALSE;
 gboolean verbose_flag = FALSE;
 gboolean quiet_flag = FALSE;
+gsize feed_chunk_size = DEFAULT_FEED_CHUNK_SIZE;
+guint download_connections = DEFAULT_DOWNLOAD_CONNECTIONS;
+gchar *chunk_store_url = NULL;
+gboolean skip_unchanged_blocks = FALSE;
+guint write_queue_depth = DEFAULT_WRITE_QUEUE_DEPTH;
+gboolean dracut_fallback = TRUE;
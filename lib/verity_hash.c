@@ -0,0 +1,766 @@
+/*  Copyright (C) 2022  Thorsten Kukuk <kukuk@suse.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gprintf.h>
+#include <openssl/evp.h>
+
+#include "tiu-internal.h"
+#include "verity_hash.h"
+
+#define HASHES_PER_BLOCK (VERITY_BLOCK_SIZE/VERITY_DIGEST_SIZE)
+/* with 128 hashes per block, 10 levels cover 2^64 data blocks */
+#define VERITY_MAX_LEVELS 11
+/* smallest amount of data blocks worth a job for another thread */
+#define VERITY_JOB_BLOCKS 256
+
+typedef struct {
+  guint8 *hashes;
+  guint64 n_blocks;  /* allocated hash blocks */
+  guint64 done;      /* hash blocks already hashed into the next level */
+} VerityLevel;
+
+struct _VerityHash {
+  EVP_MD_CTX *salted;  /* sha256 context which has seen the salt */
+  guint n_threads;
+  GThreadPool *pool;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+  /* level 0 are the hashes of the data blocks */
+  VerityLevel level[VERITY_MAX_LEVELS];
+  guint64 complete;    /* data blocks hashed without gap from the start */
+};
+
+typedef struct {
+  VerityHash *vh;
+  const guint8 *data;
+  guint64 n_blocks;
+  guint8 *out;
+} HashJob;
+
+/* sha256(salt || block) of @n_blocks blocks */
+static void
+hash_blocks (const EVP_MD_CTX *salted, const guint8 *data, guint64 n_blocks,
+	     guint8 *out)
+{
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  for (guint64 i = 0; i < n_blocks; i++)
+    {
+      EVP_MD_CTX_copy_ex(ctx, salted);
+      EVP_DigestUpdate(ctx, data + i * VERITY_BLOCK_SIZE, VERITY_BLOCK_SIZE);
+      EVP_DigestFinal_ex(ctx, out + i * VERITY_DIGEST_SIZE, NULL);
+    }
+
+  EVP_MD_CTX_free(ctx);
+}
+
+static void
+hash_job (gpointer data, gpointer user_data __attribute__((unused)))
+{
+  HashJob *job = data;
+  VerityHash *vh = job->vh;
+
+  hash_blocks(vh->salted, job->data, job->n_blocks, job->out);
+
+  g_mutex_lock(&vh->lock);
+  if (--vh->pending == 0)
+    g_cond_signal(&vh->cond);
+  g_mutex_unlock(&vh->lock);
+}
+
+/* Make room for @n_blocks hash blocks, new space is zeroed */
+static void
+level_reserve (VerityLevel *level, guint64 n_blocks)
+{
+  guint64 size;
+
+  if (n_blocks <= level->n_blocks)
+    return;
+
+  size = MAX(n_blocks, level->n_blocks * 2);
+  level->hashes = g_realloc(level->hashes, size * VERITY_BLOCK_SIZE);
+  memset(level->hashes + level->n_blocks * VERITY_BLOCK_SIZE, 0,
+	 (size - level->n_blocks) * VERITY_BLOCK_SIZE);
+  level->n_blocks = size;
+}
+
+/* Hash blocks of the levels below into the next one, as far as the
+   data blocks are complete. */
+static void
+propagate (VerityHash *vh)
+{
+  guint64 available = vh->complete / HASHES_PER_BLOCK;
+
+  for (guint i = 0; i + 1 < VERITY_MAX_LEVELS; i++)
+    {
+      VerityLevel *level = &vh->level[i];
+      VerityLevel *next = &vh->level[i + 1];
+
+      if (level->done < available)
+	{
+	  level_reserve(next, (available + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK);
+	  hash_blocks(vh->salted, level->hashes + level->done * VERITY_BLOCK_SIZE,
+		      available - level->done,
+		      next->hashes + level->done * VERITY_DIGEST_SIZE);
+	  level->done = available;
+	}
+      available = level->done / HASHES_PER_BLOCK;
+      if (available == 0)
+	break;
+    }
+}
+
+/* Data blocks from @block on changed, the levels above have to be
+   built again from there. */
+static void
+invalidate (VerityHash *vh, guint64 block)
+{
+  guint64 index = block / HASHES_PER_BLOCK;
+
+  for (guint i = 0; i < VERITY_MAX_LEVELS; i++)
+    {
+      if (vh->level[i].done > index)
+	vh->level[i].done = index;
+      index /= HASHES_PER_BLOCK;
+    }
+}
+
+/*
+  Create a builder for a hash tree with @salt (VERITY_SALT_SIZE bytes).
+  @n_threads is the number of cores used for hashing, 0 for all.
+*/
+VerityHash *
+verity_hash_new (const guint8 *salt, guint n_threads)
+{
+  VerityHash *vh = g_new0(VerityHash, 1);
+
+  vh->salted = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(vh->salted, EVP_sha256(), NULL);
+  EVP_DigestUpdate(vh->salted, salt, VERITY_SALT_SIZE);
+
+  vh->n_threads = n_threads ? n_threads : g_get_num_processors();
+  if (vh->n_threads > 1)
+    vh->pool = g_thread_pool_new(hash_job, vh, vh->n_threads - 1, TRUE, NULL);
+  g_mutex_init(&vh->lock);
+  g_cond_init(&vh->cond);
+
+  return vh;
+}
+
+/* Hash @n_blocks blocks into @out, spread over the threads */
+static void
+hash_parallel (VerityHash *vh, const guint8 *data, guint64 n_blocks,
+	       guint8 *out)
+{
+  guint64 per_job;
+  guint n_jobs;
+
+  n_jobs = MIN(vh->n_threads, MAX(n_blocks / VERITY_JOB_BLOCKS, 1));
+  per_job = (n_blocks + n_jobs - 1) / n_jobs;
+
+  if (n_jobs > 1)
+    {
+      HashJob jobs[n_jobs];
+
+      vh->pending = n_jobs - 1;
+      for (guint i = 0; i < n_jobs; i++)
+	{
+	  guint64 first = i * per_job;
+
+	  jobs[i].vh = vh;
+	  jobs[i].data = data + first * VERITY_BLOCK_SIZE;
+	  jobs[i].n_blocks = MIN(per_job, n_blocks - first);
+	  jobs[i].out = out + first * VERITY_DIGEST_SIZE;
+	}
+      for (guint i = 1; i < n_jobs; i++)
+	g_thread_pool_push(vh->pool, &jobs[i], NULL);
+
+      /* this thread takes the first part */
+      hash_blocks(vh->salted, jobs[0].data, jobs[0].n_blocks, jobs[0].out);
+
+      g_mutex_lock(&vh->lock);
+      while (vh->pending > 0)
+	g_cond_wait(&vh->cond, &vh->lock);
+      g_mutex_unlock(&vh->lock);
+    }
+  else
+    hash_blocks(vh->salted, data, n_blocks, out);
+}
+
+/*
+  Hash @n_blocks data blocks starting at data block @block.
+*/
+void
+verity_hash_add (VerityHash *vh, guint64 block, const guint8 *data,
+		 guint64 n_blocks)
+{
+  if (n_blocks == 0)
+    return;
+
+  level_reserve(&vh->level[0],
+		(block + n_blocks + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK);
+  hash_parallel(vh, data, n_blocks,
+		vh->level[0].hashes + block * VERITY_DIGEST_SIZE);
+
+  if (block / HASHES_PER_BLOCK < vh->level[0].done)
+    invalidate(vh, block);
+  if (block <= vh->complete)
+    vh->complete = MAX(vh->complete, block + n_blocks);
+
+  propagate(vh);
+}
+
+/*
+  Complete the hash tree for @data_blocks data blocks, all of them
+  have to be added before. Stores the root hash in @root_hash and
+  returns the size of the tree, the tree itself in @tree. With only
+  one data block there is no tree, the root hash is the hash of
+  that block.
+*/
+gsize
+verity_hash_finish (VerityHash *vh, guint64 data_blocks, guint8 *root_hash,
+		    guint8 **tree)
+{
+  guint64 blocks[VERITY_MAX_LEVELS];
+  guint64 n = data_blocks;
+  gsize tree_size = 0;
+  guint top = 0;
+
+  g_return_val_if_fail(data_blocks > 0, 0);
+
+  /* hashes behind the end of the data are zero in the last block */
+  level_reserve(&vh->level[0],
+		(data_blocks + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK);
+  memset(vh->level[0].hashes + data_blocks * VERITY_DIGEST_SIZE, 0,
+	 vh->level[0].n_blocks * VERITY_BLOCK_SIZE - data_blocks * VERITY_DIGEST_SIZE);
+  invalidate(vh, data_blocks);
+
+  if (tree)
+    *tree = NULL;
+
+  if (data_blocks == 1)
+    {
+      memcpy(root_hash, vh->level[0].hashes, VERITY_DIGEST_SIZE);
+      return 0;
+    }
+
+  for (guint i = 0; i + 1 < VERITY_MAX_LEVELS; i++)
+    {
+      VerityLevel *level = &vh->level[i];
+      VerityLevel *next = &vh->level[i + 1];
+
+      blocks[i] = (n + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK;
+      level_reserve(next, (blocks[i] + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK);
+      memset(next->hashes + blocks[i] * VERITY_DIGEST_SIZE, 0,
+	     next->n_blocks * VERITY_BLOCK_SIZE - blocks[i] * VERITY_DIGEST_SIZE);
+      if (level->done < blocks[i])
+	{
+	  hash_blocks(vh->salted, level->hashes + level->done * VERITY_BLOCK_SIZE,
+		      blocks[i] - level->done,
+		      next->hashes + level->done * VERITY_DIGEST_SIZE);
+	  level->done = blocks[i];
+	}
+      tree_size += blocks[i] * VERITY_BLOCK_SIZE;
+
+      if (blocks[i] == 1)
+	{
+	  memcpy(root_hash, next->hashes, VERITY_DIGEST_SIZE);
+	  top = i;
+	  break;
+	}
+      n = blocks[i];
+    }
+
+  if (tree)
+    {
+      guint8 *p = *tree = g_malloc(tree_size);
+
+      /* the top level comes first */
+      for (gint i = top; i >= 0; i--)
+	{
+	  memcpy(p, vh->level[i].hashes, blocks[i] * VERITY_BLOCK_SIZE);
+	  p += blocks[i] * VERITY_BLOCK_SIZE;
+	}
+    }
+
+  return tree_size;
+}
+
+void
+verity_hash_free (VerityHash *vh)
+{
+  if (vh == NULL)
+    return;
+
+  if (vh->pool)
+    g_thread_pool_free(vh->pool, FALSE, TRUE);
+  g_mutex_clear(&vh->lock);
+  g_cond_clear(&vh->cond);
+  for (guint i = 0; i < VERITY_MAX_LEVELS; i++)
+    g_free(vh->level[i].hashes);
+  EVP_MD_CTX_free(vh->salted);
+  g_free(vh);
+}
+
+gboolean
+verity_hash_fd (int fd, guint64 data_blocks, const guint8 *salt,
+		guint n_threads, guint8 *root_hash, guint8 **tree,
+		gsize *tree_size, GError **error)
+{
+  g_autofree guint8 *buf = g_malloc(VERITY_READ_SIZE);
+  VerityHash *vh = verity_hash_new(salt, n_threads);
+  guint64 block = 0;
+  gsize size;
+
+  posix_fadvise(fd, 0, data_blocks * VERITY_BLOCK_SIZE, POSIX_FADV_SEQUENTIAL);
+
+  while (block < data_blocks)
+    {
+      gsize len = MIN(VERITY_READ_SIZE,
+		      (data_blocks - block) * VERITY_BLOCK_SIZE);
+      gsize fill = 0;
+
+      while (fill < len)
+	{
+	  ssize_t r = pread(fd, buf + fill, len - fill,
+			    block * VERITY_BLOCK_SIZE + fill);
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  if (r <= 0)
+	    {
+	      int err = r < 0 ? errno : EIO;
+	      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			  "Failed to read data block %" G_GUINT64_FORMAT ": %s",
+			  block + fill / VERITY_BLOCK_SIZE,
+			  r < 0 ? g_strerror(err) : "unexpected end of file");
+	      verity_hash_free(vh);
+	      return FALSE;
+	    }
+	  fill += r;
+	}
+
+      verity_hash_add(vh, block, buf, len / VERITY_BLOCK_SIZE);
+      block += len / VERITY_BLOCK_SIZE;
+    }
+
+  size = verity_hash_finish(vh, data_blocks, root_hash, tree);
+  if (tree_size)
+    *tree_size = size;
+  verity_hash_free(vh);
+
+  return TRUE;
+}
+
+int
+verity_create_or_verify_hash (int verify, int fd, uint64_t data_blocks,
+			      off_t *combined_size, guint8 *root_hash,
+			      const guint8 *salt)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree guint8 *tree = NULL;
+  g_autofree guint8 *old = NULL;
+  guint8 hash[VERITY_DIGEST_SIZE];
+  off_t hash_offset = data_blocks * VERITY_BLOCK_SIZE;
+  gsize tree_size = 0;
+  gint64 start = g_get_monotonic_time();
+
+  if (data_blocks == 0)
+    {
+      fprintf(stderr, "ERROR: no data blocks to hash\n");
+      return -1;
+    }
+
+  if (!verity_hash_fd(fd, data_blocks, salt, 0, hash, &tree, &tree_size,
+		      &error))
+    {
+      fprintf(stderr, "ERROR: %s\n", error->message);
+      return -1;
+    }
+
+  if (debug_flag)
+    {
+      gdouble secs = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+      g_printf("Hashed %" G_GUINT64_FORMAT " blocks on %u cores in %.2fs (%.2f GiB/s)\n",
+	       (guint64)data_blocks, g_get_num_processors(), secs,
+	       secs > 0 ? data_blocks * VERITY_BLOCK_SIZE / secs / (1024*1024*1024) : 0.0);
+    }
+
+  if (verify)
+    {
+      gsize fill = 0;
+
+      old = g_malloc(tree_size ? tree_size : 1);
+      while (fill < tree_size)
+	{
+	  ssize_t r = pread(fd, old + fill, tree_size - fill, hash_offset + fill);
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  if (r <= 0)
+	    {
+	      fprintf(stderr, "ERROR: failed to read verity hash tree: %s\n",
+		      r < 0 ? g_strerror(errno) : "unexpected end of file");
+	      return -1;
+	    }
+	  fill += r;
+	}
+      if (memcmp(old, tree, tree_size) != 0 ||
+	  memcmp(root_hash, hash, VERITY_DIGEST_SIZE) != 0)
+	{
+	  fprintf(stderr, "ERROR: verity hash tree does not match\n");
+	  return -1;
+	}
+    }
+  else
+    {
+      gsize written = 0;
+
+      while (written < tree_size)
+	{
+	  ssize_t r = pwrite(fd, tree + written, tree_size - written,
+			     hash_offset + written);
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  if (r < 0)
+	    {
+	      fprintf(stderr, "ERROR: failed to write verity hash tree: %s\n",
+		      g_strerror(errno));
+	      return -1;
+	    }
+	  written += r;
+	}
+      memcpy(root_hash, hash, VERITY_DIGEST_SIZE);
+    }
+
+  *combined_size = data_blocks + tree_size / VERITY_BLOCK_SIZE;
+
+  return 0;
+}
+
+static gboolean
+hex_decode (const gchar *hex, guint8 *out, gsize len)
+{
+  if (hex == NULL || strlen(hex) != len * 2)
+    return FALSE;
+
+  for (gsize i = 0; i < len; i++)
+    {
+      gint hi = g_ascii_xdigit_value(hex[2 * i]);
+      gint lo = g_ascii_xdigit_value(hex[2 * i + 1]);
+
+      if (hi < 0 || lo < 0)
+	return FALSE;
+      out[i] = hi << 4 | lo;
+    }
+
+  return TRUE;
+}
+
+/* Number of hash blocks per level for @data_blocks data blocks,
+   returns the number of levels. */
+static guint
+tree_levels (guint64 data_blocks, guint64 *blocks)
+{
+  guint levels = 0;
+
+  while (data_blocks > 1 && levels < VERITY_MAX_LEVELS)
+    {
+      data_blocks = (data_blocks + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK;
+      blocks[levels++] = data_blocks;
+    }
+
+  return levels;
+}
+
+/*
+  Get the verity parameters from the last @len bytes of an image of
+  @image_size bytes, as written by calc_verity(): the hash tree is
+  followed by the manifest and the size of the manifest.
+*/
+gboolean
+verity_parse_trailer (const guint8 *tail, gsize len, guint64 image_size,
+		      VerityInfo *info, GError **error)
+{
+  g_autoptr(GKeyFile) manifest = NULL;
+  g_autofree gchar *format = NULL;
+  g_autofree gchar *hash = NULL;
+  g_autofree gchar *salt = NULL;
+  guint64 manifest_size;
+  GError *ierror = NULL;
+
+  g_return_val_if_fail(tail, FALSE);
+  g_return_val_if_fail(info, FALSE);
+
+  if (len < sizeof(manifest_size) || len > image_size)
+    goto invalid;
+  memcpy(&manifest_size, tail + len - sizeof(manifest_size),
+	 sizeof(manifest_size));
+  manifest_size = GUINT64_FROM_BE(manifest_size);
+  if (manifest_size == 0 || manifest_size > len - sizeof(manifest_size))
+    goto invalid;
+
+  manifest = g_key_file_new();
+  if (!g_key_file_load_from_data(manifest,
+				 (const gchar *)tail + len - sizeof(manifest_size) - manifest_size,
+				 manifest_size, G_KEY_FILE_NONE, &ierror))
+    {
+      g_propagate_prefixed_error(error, ierror, "Invalid image manifest: ");
+      return FALSE;
+    }
+
+  format = g_key_file_get_string(manifest, "tiu", "format", NULL);
+  if (g_strcmp0(format, "verity") != 0)
+    goto invalid;
+
+  hash = g_key_file_get_string(manifest, "tiu", "verity-hash", NULL);
+  salt = g_key_file_get_string(manifest, "tiu", "verity-salt", NULL);
+  info->tree_size = g_key_file_get_uint64(manifest, "tiu", "verity-size", NULL);
+  info->image_size = image_size;
+  if (!hex_decode(hash, info->root_hash, VERITY_DIGEST_SIZE) ||
+      !hex_decode(salt, info->salt, VERITY_SALT_SIZE) ||
+      info->tree_size % VERITY_BLOCK_SIZE != 0 ||
+      image_size - sizeof(manifest_size) - manifest_size < info->tree_size)
+    goto invalid;
+
+  info->data_size = image_size - sizeof(manifest_size) - manifest_size - info->tree_size;
+  if (info->data_size == 0 || info->data_size % VERITY_BLOCK_SIZE != 0)
+    goto invalid;
+
+  return TRUE;
+
+ invalid:
+  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+	      "Image has no valid verity manifest");
+  return FALSE;
+}
+
+struct _VerityCheck {
+  VerityInfo info;
+  VerityHash *vh;
+  guint8 *tree;
+  const guint8 *leaves;     /* hashes of the data blocks in tree */
+  guint8 *hashes;           /* hashes of the blocks just checked */
+  gsize hashes_size;
+  guint8 partial[VERITY_BLOCK_SIZE];
+  gsize partial_fill;
+  guint64 offset;           /* bytes of the image seen so far */
+};
+
+/* Hash @n_blocks blocks and compare the hashes with @expected.
+   Returns the index of the first block which does not match, or
+   @n_blocks if all match. */
+static guint64
+check_blocks (VerityCheck *vc, const guint8 *data, guint64 n_blocks,
+	      const guint8 *expected)
+{
+  if (vc->hashes_size < n_blocks * VERITY_DIGEST_SIZE)
+    {
+      vc->hashes_size = n_blocks * VERITY_DIGEST_SIZE;
+      vc->hashes = g_realloc(vc->hashes, vc->hashes_size);
+    }
+  hash_parallel(vc->vh, data, n_blocks, vc->hashes);
+
+  if (memcmp(vc->hashes, expected, n_blocks * VERITY_DIGEST_SIZE) == 0)
+    return n_blocks;
+
+  for (guint64 i = 0; i < n_blocks; i++)
+    if (memcmp(vc->hashes + i * VERITY_DIGEST_SIZE,
+	       expected + i * VERITY_DIGEST_SIZE, VERITY_DIGEST_SIZE) != 0)
+      return i;
+
+  return n_blocks;
+}
+
+/*
+  Prepare the check of an image described by @info. @tree is the
+  hash tree of the image, it gets checked against the root hash
+  before it is used.
+*/
+VerityCheck *
+verity_check_new (const VerityInfo *info, const guint8 *tree, GError **error)
+{
+  guint64 data_blocks = info->data_size / VERITY_BLOCK_SIZE;
+  guint64 blocks[VERITY_MAX_LEVELS];
+  guint64 tree_blocks = 0;
+  guint levels;
+  VerityCheck *vc;
+  const guint8 *level;
+
+  g_return_val_if_fail(info, NULL);
+  g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+  levels = tree_levels(data_blocks, blocks);
+  for (guint i = 0; i < levels; i++)
+    tree_blocks += blocks[i];
+  if (tree_blocks * VERITY_BLOCK_SIZE != info->tree_size ||
+      (info->tree_size > 0 && tree == NULL))
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Verity hash tree has the wrong size");
+      return NULL;
+    }
+
+  vc = g_new0(VerityCheck, 1);
+  vc->info = *info;
+  vc->vh = verity_hash_new(info->salt, 0);
+  if (info->tree_size > 0)
+    {
+      vc->tree = g_malloc(info->tree_size);
+      memcpy(vc->tree, tree, info->tree_size);
+    }
+
+  /* With one data block there is no tree, its hash is the root hash */
+  if (levels == 0)
+    {
+      vc->leaves = vc->info.root_hash;
+      return vc;
+    }
+
+  /* Each level is stored behind the one above it, the top level has
+     one block whose hash is the root hash. */
+  level = vc->tree;
+  for (gint i = levels - 1; i >= 0; i--)
+    {
+      const guint8 *above = (i == (gint)levels - 1) ? vc->info.root_hash
+	: level - blocks[i + 1] * VERITY_BLOCK_SIZE;
+
+      if (check_blocks(vc, level, blocks[i], above) != blocks[i])
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Verity hash tree does not match the root hash");
+	  verity_check_free(vc);
+	  return NULL;
+	}
+      vc->leaves = level;
+      level += blocks[i] * VERITY_BLOCK_SIZE;
+    }
+
+  return vc;
+}
+
+static gboolean
+bad_block (guint64 block, GError **error)
+{
+  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+	      "Block %" G_GUINT64_FORMAT " of the image does not match its verity hash",
+	      block);
+  return FALSE;
+}
+
+/*
+  Check the next @len bytes of the image. Data blocks are checked
+  against the hash tree, the hash tree against the one from the
+  manifest.
+*/
+gboolean
+verity_check_update (VerityCheck *vc, const guint8 *data, gsize len,
+		     GError **error)
+{
+  const VerityInfo *info = &vc->info;
+
+  while (len > 0)
+    {
+      gsize n;
+
+      if (vc->offset < info->data_size)
+	{
+	  guint64 block = vc->offset / VERITY_BLOCK_SIZE;
+
+	  if (vc->partial_fill > 0 || len < VERITY_BLOCK_SIZE)
+	    {
+	      n = MIN(len, VERITY_BLOCK_SIZE - vc->partial_fill);
+	      memcpy(vc->partial + vc->partial_fill, data, n);
+	      vc->partial_fill += n;
+	      if (vc->partial_fill == VERITY_BLOCK_SIZE)
+		{
+		  if (check_blocks(vc, vc->partial, 1,
+				   vc->leaves + block * VERITY_DIGEST_SIZE) != 1)
+		    return bad_block(block, error);
+		  vc->partial_fill = 0;
+		}
+	    }
+	  else
+	    {
+	      guint64 n_blocks = MIN(len, info->data_size - vc->offset) / VERITY_BLOCK_SIZE;
+	      guint64 good = check_blocks(vc, data, n_blocks,
+					  vc->leaves + block * VERITY_DIGEST_SIZE);
+
+	      if (good != n_blocks)
+		return bad_block(block + good, error);
+	      n = n_blocks * VERITY_BLOCK_SIZE;
+	    }
+	}
+      else if (vc->offset < info->data_size + info->tree_size)
+	{
+	  guint64 pos = vc->offset - info->data_size;
+
+	  n = MIN(len, info->tree_size - pos);
+	  if (memcmp(data, vc->tree + pos, n) != 0)
+	    {
+	      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			  "Verity hash tree of the image is corrupt");
+	      return FALSE;
+	    }
+	}
+      else if (vc->offset < info->image_size)
+	/* the manifest was already parsed */
+	n = MIN(len, info->image_size - vc->offset);
+      else
+	{
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		      "Image is larger than its manifest says");
+	  return FALSE;
+	}
+
+      vc->offset += n;
+      data += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+gboolean
+verity_check_finish (VerityCheck *vc, GError **error)
+{
+  if (vc->offset != vc->info.image_size)
+    {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Image is incomplete: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes",
+		  vc->offset, vc->info.image_size);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+void
+verity_check_free (VerityCheck *vc)
+{
+  if (vc == NULL)
+    return;
+
+  verity_hash_free(vc->vh);
+  g_free(vc->tree);
+  g_free(vc->hashes);
+  g_free(vc);
+}
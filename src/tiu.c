@@ -16,7 +16,9 @@
 #include <libeconf.h>
 #include "tiu.h"
 #include "tiu-internal.h"
+#include "network.h"
 
+#define CREATE "create"
 #define INSTALL "install"
 #define EXTRACT "extract"
 #define UPDATE "update"
@@ -33,6 +35,22 @@ static GOptionEntry entries_extract[] = {
 };
 static GOptionGroup *extract_group;
 
+static gchar *input_file = NULL;
+static gchar *previous_image = NULL;
+static gchar *chunk_store_dir = NULL;
+static gchar *squashfs_profile = NULL;
+static gboolean build_initrd = false;
+static GOptionEntry entries_create[] = {
+  {"input", 'i', 0, G_OPTION_ARG_FILENAME, &input_file, "rootfs tar archive", "FILENAME"},
+  {"output", 'o', 0, G_OPTION_ARG_FILENAME, &target_dir, "output directory", "DIRECTORY"},
+  {"previous", '\0', 0, G_OPTION_ARG_FILENAME, &previous_image, "USR image of the previous release, create a delta archive against it", "FILENAME"},
+  {"store", 's', 0, G_OPTION_ARG_FILENAME, &chunk_store_dir, "add the chunks of the image to this chunk store and create a chunk index", "DIRECTORY"},
+  {"profile", 'p', 0, G_OPTION_ARG_STRING, &squashfs_profile, "mksquashfs profile (xz, zstd, zstd-max, zstd-fast, lz4, gzip, sweep)", "PROFILE"},
+  {"initrd", '\0', 0, G_OPTION_ARG_NONE, &build_initrd, "build generic initrds into the image", NULL},
+  {0}
+};
+static GOptionGroup *create_group;
+
 static gchar *device = NULL;
 static GOptionEntry entries_install[] = {
   {"archive", 'a', 0, G_OPTION_ARG_FILENAME, &archive_file, "swu archive", "FILENAME"},
@@ -53,6 +71,10 @@ static GOptionGroup *update_group;
 static void
 init_group_options (void)
 {
+  create_group = g_option_group_new(CREATE, "Create options:",
+				    "Show help options for create", NULL, NULL);
+  g_option_group_add_entries(create_group, entries_create);
+
   extract_group = g_option_group_new(EXTRACT, "Extract options:",
 				    "Show help options for extract", NULL, NULL);
   g_option_group_add_entries(extract_group, entries_extract);
@@ -67,8 +89,8 @@ init_group_options (void)
 }
 
 static void
-read_config(const gchar *kind, gchar **archive, gchar **archive_md5sum,
-	    gchar **disk_layout)
+read_config(const gchar *kind, gchar **archive, gchar **archive_sha256sum,
+	    gchar **disk_layout, gboolean *stream)
 {
    econf_file *key_file = NULL;
    econf_err ecerror;
@@ -114,19 +136,91 @@ read_config(const gchar *kind, gchar **archive, gchar **archive_md5sum,
      *disk_layout = NULL;
    }
 
-   ecerror = econf_getStringValue(key_file, kind, "archive_md5sum", archive_md5sum);
+   ecerror = econf_getStringValue(key_file, kind, "archive_sha256sum", archive_sha256sum);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getStringValue(key_file, "global", "archive_sha256sum", archive_sha256sum);
+   /* old name of the entry, it always contained a SHA256 checksum */
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getStringValue(key_file, kind, "archive_md5sum", archive_sha256sum);
+   if (ecerror != ECONF_SUCCESS)
+     econf_getStringValue(key_file, "global", "archive_md5sum", archive_sha256sum);
+
+   bool stream_value = false;
+   ecerror = econf_getBoolValue(key_file, kind, "stream", &stream_value);
+   if (ecerror != ECONF_SUCCESS)
+     econf_getBoolValue(key_file, "global", "stream", &stream_value);
+   *stream = stream_value;
+
+   uint64_t chunk_size = 0;
+   ecerror = econf_getUInt64Value(key_file, kind, "feed_chunk_size", &chunk_size);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getUInt64Value(key_file, "global", "feed_chunk_size", &chunk_size);
+   if (ecerror == ECONF_SUCCESS && chunk_size > 0)
+     feed_chunk_size = chunk_size;
+
+   uint32_t connections = 0;
+   ecerror = econf_getUIntValue(key_file, kind, "download_connections", &connections);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getUIntValue(key_file, "global", "download_connections", &connections);
+   if (ecerror == ECONF_SUCCESS && connections > 0)
+     download_connections = connections;
+
+   bool skip_value = false;
+   ecerror = econf_getBoolValue(key_file, kind, "skip_unchanged_blocks", &skip_value);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getBoolValue(key_file, "global", "skip_unchanged_blocks", &skip_value);
+   if (ecerror == ECONF_SUCCESS)
+     skip_unchanged_blocks = skip_value;
+
+   uint32_t queue_depth = 0;
+   ecerror = econf_getUIntValue(key_file, kind, "write_queue_depth", &queue_depth);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getUIntValue(key_file, "global", "write_queue_depth", &queue_depth);
+   if (ecerror == ECONF_SUCCESS)
+     write_queue_depth = MIN(queue_depth, MAX_WRITE_QUEUE_DEPTH);
+
+   bool dracut_value = false;
+   ecerror = econf_getBoolValue(key_file, kind, "dracut_fallback", &dracut_value);
+   if (ecerror != ECONF_SUCCESS)
+     ecerror = econf_getBoolValue(key_file, "global", "dracut_fallback", &dracut_value);
+   if (ecerror == ECONF_SUCCESS)
+     dracut_fallback = dracut_value;
+
+   /* Chunk store for updates with a .tiuidx archive, by default
+      next to the index. */
+   ecerror = econf_getStringValue(key_file, kind, "chunk_store", &chunk_store_url);
    if (ecerror != ECONF_SUCCESS)
-     econf_getStringValue(key_file, "global", "archive_md5sum", archive_md5sum);
+     ecerror = econf_getStringValue(key_file, "global", "chunk_store", &chunk_store_url);
+   if (ecerror != ECONF_SUCCESS && *archive && g_str_has_suffix(*archive, ".tiuidx"))
+     {
+       g_autofree gchar *dir = g_path_get_dirname(*archive);
+       chunk_store_url = g_build_path("/", dir, "store", NULL);
+     }
 
    econf_free (key_file);
 }
 
 static gboolean
-download_and_verify (const gchar *archive_name, const gchar *archive_md5sum, gchar **location)
+download_and_verify (const gchar *archive_name, const gchar *archive_sha256sum,
+		     gboolean stream, gchar **location)
 {
   GError *error = NULL;
+  g_autofree gchar *scheme = g_uri_parse_scheme(archive_name);
+
+  /* In stream mode a remote archive is not stored in the cache,
+     swupdate will read it directly from the network. The checksum
+     is then verified by swupdate_deploy() while the data passes. A chunk index
+     or delta archive is always needed as local file. Other schemes
+     like file:// are no remote archives, swupdate_deploy() needs a
+     local path for them. */
+  if (stream && is_remote_scheme(scheme) && !g_str_has_suffix(archive_name, ".tiuidx") &&
+      !g_str_has_suffix(archive_name, ".tiudelta"))
+    {
+      *location = g_strdup(archive_name);
+      return TRUE;
+    }
 
-  if (!download_archive (archive_name, archive_md5sum, location, &error))
+  if (!download_archive (archive_name, archive_sha256sum, location, &error))
     {
       if (error)
 	{
@@ -159,8 +253,9 @@ int
 main(int argc, char **argv)
 {
   gboolean help = FALSE, version = FALSE;
-  gchar *archive_md5sum = NULL;
+  gchar *archive_sha256sum = NULL;
   gchar *disk_layout = NULL;
+  gboolean stream = FALSE;
   g_autoptr(GOptionContext) context = NULL;
   GError *error = NULL;
   GOptionEntry options[] = {
@@ -179,10 +274,12 @@ main(int argc, char **argv)
   context = g_option_context_new("<COMMAND>");
   g_option_context_add_main_entries (context, options, NULL);
   g_option_context_set_description (context, "List of tiu commands:\n"
+				    "  create\tCreate the images of a release\n"
 				    "  extract\tExtract a tiu archive\n"
 				    "  install\tInstall a new system\n"
 				    "  update\tUpdate current system\n"
 				    );
+  g_option_context_add_group (context, create_group);
   g_option_context_add_group (context, extract_group);
   g_option_context_add_group (context, install_group);
   g_option_context_add_group (context, update_group);
@@ -228,7 +325,7 @@ main(int argc, char **argv)
     {
       TIUBundle *bundle = NULL;
 
-      read_config(EXTRACT, NULL, &archive_file, &archive_md5sum, &disk_layout,
+      read_config(EXTRACT, NULL, &archive_file, &archive_sha256sum, &disk_layout,
 		  &config_store);
 
       if (target_dir == NULL)
@@ -243,7 +340,7 @@ main(int argc, char **argv)
 	  exit (1);
 	}
 
-      if (!download_check_mount (archive_file, archive_md5sum, &bundle,
+      if (!download_check_mount (archive_file, archive_sha256sum, &bundle,
 				 config_store, &chunk_store))
       	exit (1);
 
@@ -262,7 +359,29 @@ main(int argc, char **argv)
   else
 #endif
 
-    if (strcmp (argv[1], INSTALL) == 0)
+    if (strcmp (argv[1], CREATE) == 0)
+      {
+	if (input_file == NULL)
+	  {
+	    g_fprintf (stderr, "ERROR: no input archive specified!\n");
+	    exit (1);
+	  }
+
+	if (!create_image (input_file, target_dir, previous_image, chunk_store_dir,
+			   squashfs_profile, build_initrd, &error))
+	  {
+	    if (error)
+	      {
+		g_fprintf (stderr, "ERROR: %s\n", error->message);
+		g_clear_error (&error);
+	      }
+	    else
+	      g_fprintf (stderr, "ERROR: creating the images failed!\n");
+	    exit (1);
+	  }
+      }
+
+    else if (strcmp (argv[1], INSTALL) == 0)
       {
 	gchar *location = NULL;
 
@@ -278,7 +397,8 @@ main(int argc, char **argv)
 	    } while (count!=1 || answer != 'y');
 	  }
 
-	read_config(INSTALL, &archive_file, &archive_md5sum, &disk_layout);
+	read_config(INSTALL, &archive_file, &archive_sha256sum, &disk_layout,
+		    &stream);
 
       if (device == NULL)
 	{
@@ -286,14 +406,16 @@ main(int argc, char **argv)
 	  exit (1);
 	}
 
-      if (!download_and_verify (archive_file, archive_md5sum, &location))
+      if (!download_and_verify (archive_file, archive_sha256sum, stream,
+				&location))
 	exit (1);
 
       if (!quiet_flag)
         g_printf("Installing %s with disk layout described in %s\n",
 	         archive_file, disk_layout);
 
-      if (!install_system (location, device, disk_layout, &error))
+      if (!install_system (location, archive_sha256sum, device, disk_layout,
+			   &error))
 	{
 	  if (error)
 	    {
@@ -343,15 +465,17 @@ main(int argc, char **argv)
 	}
       else
 	{
-	  read_config(UPDATE, &archive_file, &archive_md5sum, &disk_layout);
+	  read_config(UPDATE, &archive_file, &archive_sha256sum, &disk_layout,
+		      &stream);
 
-	  if (!download_and_verify (archive_file, archive_md5sum, &location))
+	  if (!download_and_verify (archive_file, archive_sha256sum, stream,
+				    &location))
 	    exit (1);
 
 	  if (!quiet_flag)
 	    g_printf("Updating using %s\n", archive_file);
 
-	  if (!update_system (location, &error))
+	  if (!update_system (location, archive_sha256sum, &error))
 	    {
 	      if (error)
 		{